@@ -107,12 +107,59 @@ typedef void (*voyeur_open_callback)(const char* path,
 typedef enum {
   OBSERVE_OPEN_DEFAULT = 0,
   OBSERVE_OPEN_CWD     = 1 << 0,  // Include 'cwd' (working directory).
+  OBSERVE_OPEN_UNIQUE  = 1 << 1,  // Only report the first open() of a
+                                  // path by each process with each
+                                  // access mode and outcome.
 } voyeur_open_options;
 void voyeur_observe_open(voyeur_context_t ctx,
                          uint8_t opts,
                          voyeur_open_callback callback,
                          void* userdata);
 
+// Only observe open() calls on some paths. Observed processes apply the
+// filter themselves, so the calls it rejects cost them no IPC at all.
+//
+// 'include' and 'exclude' are NULL-terminated lists of patterns, and
+// either may be NULL. A pattern containing '*', '?', or '[' is a glob
+// matched against the whole path with fnmatch(); any other pattern
+// matches paths that start with it. An open() call is observed if its
+// path matches no exclude pattern and either matches an include pattern
+// or there are none. Relative paths are compared only with the exclude
+// patterns. Patterns that are empty or contain ':' are ignored, and so
+// are all of them if together they're too long to pass on. Like
+// voyeur_observe_open(), this must be called before voyeur_prepare().
+void voyeur_filter_open(voyeur_context_t ctx,
+                        const char* const include[],
+                        const char* const exclude[]);
+
+// Observing the files each process opened, all at once.
+//
+// Instead of reporting each open() call as it's made, each process
+// collects the paths it opens and reports them in a single summary when
+// it exits, which is all that's needed for tracking dependencies. Each
+// path appears once, with the ways it was accessed. Relative paths are
+// made absolute using the working directory at the time of the call.
+// A process that calls exec reports its summary just before the exec;
+// if the exec fails, it reports another summary later with the paths it
+// opens after that. A vforked child reports each call in a summary of
+// its own. A process that's killed by a signal reports nothing, as do
+// any calls made after the process has started to exit. voyeur_filter_open()
+// still applies. This replaces voyeur_observe_open(), and vice versa.
+typedef enum {
+  VOYEUR_ACCESS_READ    = 1 << 0,  // Opened for reading.
+  VOYEUR_ACCESS_WRITE   = 1 << 1,  // Opened for writing.
+  VOYEUR_ACCESS_MISSING = 1 << 2,  // Failed to open because it, or a
+                                   // directory above it, didn't exist.
+} voyeur_access;
+typedef void (*voyeur_open_summary_callback)(size_t count,
+                                             const char* const paths[],
+                                             const uint8_t access[],
+                                             pid_t pid,
+                                             void* userdata);
+void voyeur_observe_open_summary(voyeur_context_t ctx,
+                                 voyeur_open_summary_callback callback,
+                                 void* userdata);
+
 // Observing close() calls.
 typedef void (*voyeur_close_callback)(int fd,
                                       int retval,
@@ -147,6 +194,72 @@ void voyeur_observe_close(voyeur_context_t ctx,
 void voyeur_set_resource_path(voyeur_context_t ctx,
                               const char* path);
 
+// Deliver events through a shared memory ring buffer of at least
+// 'size' bytes instead of a socket.
+//
+// By default, every event is sent to libvoyeur over a socket, which
+// costs the observed process a system call per event. With a ring
+// buffer, observed processes copy events directly into memory shared
+// with libvoyeur, which is much cheaper for processes that generate a
+// lot of events. The ring is inherited by child processes as a pair of
+// file descriptors, so processes that close descriptors they didn't
+// open will fall back to the socket.
+//
+// Events too large to fit in the ring are still sent over the socket,
+// so they may be observed out of order relative to other events. So
+// are events written while the ring is stuck behind a process that was
+// stopped in the middle of writing to it; space reserved by a process
+// that died is reclaimed.
+// Rings are currently only supported on Linux; elsewhere, this option
+// has no effect. A size of 0, the default, disables the ring.
+void voyeur_set_ring_size(voyeur_context_t ctx, size_t size);
+
+// Controls whether libvoyeur may use io_uring to accept connections and
+// receive events. When it's enabled, the default, io_uring is used on
+// Linux 6.0 and later; otherwise epoll or select is used.
+void voyeur_set_io_uring(voyeur_context_t ctx, char enabled);
+
+// Controls whether observed processes pass their connection to
+// libvoyeur on to the programs they exec.
+//
+// By default, every exec sends its event over a new connection, and
+// the new program connects again to send its own events. With this
+// enabled, the connection is left open across exec and advertised to
+// the new program in LIBVOYEUR_FD, which saves a connection for every
+// exec in a deep chain like 'sh -c' -> make -> cc -> cc1. Forked
+// children never share their parent's connection. This is disabled by
+// default, since it leaves an extra descriptor open in observed
+// processes.
+void voyeur_set_inherit_connection(voyeur_context_t ctx, char enabled);
+
+// Run callbacks on a pool of 'threads' worker threads instead of on the
+// thread that receives events.
+//
+// By default, callbacks run as soon as each event is received, so a
+// slow callback delays every event after it, and observed processes
+// may block until the backlog is cleared. With an executor, events are
+// queued for the workers instead. Events from the same process are
+// always delivered in order, but callbacks for different processes may
+// run concurrently, so they must be thread safe.
+//
+// Each worker queues up to 'queue_size' events; 0 picks a default.
+// 'policy' decides what happens when a queue is full. Every callback
+// has run by the time voyeur_start() returns, voyeur_is_done() returns
+// 1, or voyeur_wait_any() reports a job. A 'threads' value of 0, the
+// default, disables the executor.
+typedef enum {
+  VOYEUR_BACKPRESSURE_BLOCK = 0,  // Wait until there's room.
+  VOYEUR_BACKPRESSURE_DROP  = 1,  // Drop the event.
+} voyeur_backpressure;
+void voyeur_set_executor(voyeur_context_t ctx,
+                         int threads,
+                         size_t queue_size,
+                         voyeur_backpressure policy);
+
+// Returns the number of events dropped because an executor queue was
+// full.
+size_t voyeur_dropped_events(voyeur_context_t ctx);
+
 
 //////////////////////////////////////////////////
 // Observing processes.
@@ -180,6 +293,43 @@ char** voyeur_prepare(voyeur_context_t ctx, char* const envp[]);
 // to release the resources libvoyeur has acquired.
 int voyeur_start(voyeur_context_t ctx, pid_t child_pid);
 
+// Start observing a child process without blocking.
+//
+// voyeur_start_async() is an alternative to voyeur_start() for programs
+// that have their own event loop. Instead of blocking, it returns
+// immediately, and it's up to you to call voyeur_process_events()
+// whenever the descriptor returned by voyeur_get_fd() becomes readable.
+// Callbacks are only ever called from within voyeur_process_events().
+//
+// Call this after forking, in the parent process. Returns 0 on success
+// and -1 on failure.
+int voyeur_start_async(voyeur_context_t ctx, pid_t child_pid);
+
+// Returns a file descriptor that becomes readable when there are events
+// for voyeur_process_events() to handle. It's valid from the time
+// voyeur_prepare() returns until the observation is done, and it must
+// not be read from or closed. Returns -1 if no such descriptor is
+// available on this platform; in that case, call
+// voyeur_process_events() periodically instead.
+int voyeur_get_fd(voyeur_context_t ctx);
+
+// Handles pending events without blocking, calling the callbacks you've
+// registered for each of them, until 'max_events' have been handled.
+// Events arrive in batches, so a few more may be handled than you asked
+// for. If 'max_events' is 0, every pending event is handled. Once the
+// child process has exited, everything that's left is handled
+// regardless of 'max_events'.
+//
+// Returns the number of events handled, or -1 on failure.
+int voyeur_process_events(voyeur_context_t ctx, int max_events);
+
+// Returns 1 once the child process has exited and all of its events
+// have been handled, and 0 otherwise. When it returns 1, the child's
+// exit status is stored in 'status', just as voyeur_start() would have
+// returned it. After that, you should use voyeur_context_destroy() to
+// release the resources libvoyeur has acquired.
+int voyeur_is_done(voyeur_context_t ctx, int* status);
+
 // Create and observe a new child process.
 //
 // voyeur_exec() is a convenience function that behaves just as if
@@ -202,4 +352,50 @@ int voyeur_exec(voyeur_context_t ctx,
                 char* const argv[],
                 char* const envp[]);
 
+
+//////////////////////////////////////////////////
+// Observing many processes at once.
+//////////////////////////////////////////////////
+
+// Create and observe a new child process as part of a job.
+//
+// voyeur_spawn() lets a single context observe any number of child
+// processes at the same time. Each call starts a new job and stores its
+// id, which is always positive, in 'job_id'. The job includes the child
+// and every process it creates. While the job is running, events are
+// delivered by voyeur_wait_any() or voyeur_process_events(), and
+// callbacks can use voyeur_current_job() to find out which job an event
+// came from.
+//
+// A context used with voyeur_spawn() can't also be used with
+// voyeur_prepare() or voyeur_exec(). Returns 0 on success and -1 on
+// failure.
+int voyeur_spawn(voyeur_context_t ctx,
+                 const char* path,
+                 char* const argv[],
+                 char* const envp[],
+                 int* job_id);
+
+typedef enum {
+  VOYEUR_WAIT_DEFAULT = 0,
+  VOYEUR_WNOHANG      = 1 << 0,  // Don't block if no job has finished.
+} voyeur_wait_options;
+
+// Wait for a job started by voyeur_spawn() to finish, handling events
+// from every job in the meantime.
+//
+// When a job's child process has exited and its events have been
+// handled, this stores the child's exit status in 'status', just as
+// voyeur_start() would have returned it, and returns the job's id. Each
+// job is only reported once. With VOYEUR_WNOHANG, it returns 0 if no job
+// has finished yet. Returns -1 if there are no jobs left to wait for or
+// on failure.
+int voyeur_wait_any(voyeur_context_t ctx, int* status, int options);
+
+// Returns the id of the job that the event being delivered came from.
+// This is only meaningful inside a callback, on the thread running the
+// callback; it's 0 for events from processes started without
+// voyeur_spawn().
+int voyeur_current_job(voyeur_context_t ctx);
+
 #endif
@@ -2,15 +2,21 @@
 #define _GNU_SOURCE
 #endif
 
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef __linux__
 #include <bsd/bsd.h>
 #endif
 
 #include "env.h"
+#include "net.h"
 
 #ifdef __APPLE__
 #define INSERT_LIBS "DYLD_INSERT_LIBRARIES="
@@ -20,24 +26,80 @@
 
 typedef char env_buf[2048];
 
-char** voyeur_augment_environment(char* const* envp,
+static unsigned environment_length(char* const* envp)
+{
+  unsigned envlen = 0;
+  while (envp[envlen] != NULL) {
+    ++envlen;
+  }
+  return envlen;
+}
+
+// libvoyeur's variables, in the order they're added to an environment
+// that doesn't have them yet. INSERT_LIBS always comes last.
+enum {
+  VAR_LIBS,
+  VAR_OPTS,
+  VAR_SOCKET,
+  VAR_RING,
+  VAR_JOB,
+  VAR_FD,
+  VAR_ENV,
+  VAR_FILTER,
+  VAR_INSERT_LIBS,
+  VAR_COUNT
+};
+
+static const char* var_prefixes[VAR_COUNT] = {
+  "LIBVOYEUR_LIBS=",
+  "LIBVOYEUR_OPTS=",
+  "LIBVOYEUR_SOCKET=",
+  "LIBVOYEUR_RING=",
+  "LIBVOYEUR_JOB=",
+  "LIBVOYEUR_FD=",
+  "LIBVOYEUR_ENV=",
+  "LIBVOYEUR_FILTER=",
+  INSERT_LIBS
+};
+
+// Builds the new environment in 'newenvp', which must have room for
+// VAR_COUNT more entries than 'envp' plus a terminating NULL, and stores
+// libvoyeur's variables in 'buf'.
+static char** augment_environment(char* const* envp,
                                   const char* voyeur_libs,
                                   const char* voyeur_opts,
                                   const char* sockpath,
-                                  void** buf_out)
+                                  const char* ring,
+                                  const char* job,
+                                  const char* fd,
+                                  const char* env,
+                                  const char* filter,
+                                  char** newenvp,
+                                  env_buf* buf)
 {
-  // Determine the size of the original environment.
+  // Find any of our variables that are already present. Replacing them
+  // in place keeps the environment the same size from one generation of
+  // processes to the next, and means that getenv() sees the new values.
   unsigned envlen = 0;
-  unsigned existing_insert_idx = 0;
-  char* existing_insert = NULL;
+  int existing_idx[VAR_COUNT];
+  for (int i = 0 ; i < VAR_COUNT ; ++i) {
+    existing_idx[i] = -1;
+  }
   for ( ; envp[envlen] != NULL ; ++envlen) {
-    if (strncmp(envp[envlen], INSERT_LIBS, sizeof(INSERT_LIBS) - 1) == 0) {
-      existing_insert = envp[envlen] +
-                             sizeof(INSERT_LIBS) - 1;
-      existing_insert_idx = envlen;
+    for (int i = 0 ; i < VAR_COUNT ; ++i) {
+      if (strncmp(envp[envlen], var_prefixes[i], strlen(var_prefixes[i])) == 0) {
+        existing_idx[i] = envlen;
+        break;
+      }
     }
   }
 
+  char* existing_insert = NULL;
+  if (existing_idx[VAR_INSERT_LIBS] >= 0) {
+    existing_insert = envp[existing_idx[VAR_INSERT_LIBS]] +
+                      sizeof(INSERT_LIBS) - 1;
+  }
+
   char must_add_voyeur_libs = 1;
   if (existing_insert && strnstr(existing_insert, voyeur_libs, sizeof(env_buf) * 2)) {
     must_add_voyeur_libs = 0;
@@ -48,50 +110,500 @@ char** voyeur_augment_environment(char* const* envp,
     must_add_voyeur_libs = 0;
   }
 
-  // Allocate the new environment variables.
-  env_buf* buf = malloc(sizeof(env_buf) * 4);
-  *buf_out = (void*) buf;
-
-  strlcpy(buf[0], "LIBVOYEUR_LIBS=", sizeof(env_buf));
-  strlcat(buf[0], voyeur_libs, sizeof(env_buf));
-
-  strlcpy(buf[1], "LIBVOYEUR_OPTS=", sizeof(env_buf));
-  strlcat(buf[1], voyeur_opts, sizeof(env_buf));
+  // Fill in the new environment variables. A NULL value leaves the
+  // variable alone.
+  const char* values[VAR_COUNT] = {
+    voyeur_libs, voyeur_opts, sockpath, ring, job, fd, env, filter, ""
+  };
 
-  strlcpy(buf[2], "LIBVOYEUR_SOCKET=", sizeof(env_buf));
-  strlcat(buf[2], sockpath, sizeof(env_buf));
+  for (int i = 0 ; i < VAR_INSERT_LIBS ; ++i) {
+    if (values[i]) {
+      strlcpy(buf[i], var_prefixes[i], sizeof(env_buf));
+      strlcat(buf[i], values[i], sizeof(env_buf));
+    }
+  }
 
-  strlcpy(buf[3], INSERT_LIBS, sizeof(env_buf));
+  strlcpy(buf[VAR_INSERT_LIBS], INSERT_LIBS, sizeof(env_buf));
   if (must_add_voyeur_libs) {
-    strlcat(buf[3], voyeur_libs, sizeof(env_buf));
+    strlcat(buf[VAR_INSERT_LIBS], voyeur_libs, sizeof(env_buf));
     if (existing_insert) {
-      strlcat(buf[3], ":", sizeof(env_buf));
-      strlcat(buf[3], existing_insert, sizeof(env_buf));
+      strlcat(buf[VAR_INSERT_LIBS], ":", sizeof(env_buf));
+      strlcat(buf[VAR_INSERT_LIBS], existing_insert, sizeof(env_buf));
     }
   } else if (existing_insert) {
-    strlcat(buf[3], existing_insert, sizeof(env_buf));
+    strlcat(buf[VAR_INSERT_LIBS], existing_insert, sizeof(env_buf));
   }
 
-  // Allocate a new environment, including additional space for the 4
-  // extra environment variables we'll add and a terminating NULL.
-  char** newenvp = malloc(sizeof(char*) * (envlen + 5));
+  // Build the new environment.
   memcpy(newenvp, envp, sizeof(char*) * envlen);
-  newenvp[envlen + 0] = buf[0];
-  newenvp[envlen + 1] = buf[1];
-  newenvp[envlen + 2] = buf[2];
-
-  if (existing_insert) {
-    // Make sure we don't have two INSERT_LIBS environment variables.
-    newenvp[existing_insert_idx] = buf[3];
-    newenvp[envlen + 3] = NULL;
-  } else {
-    newenvp[envlen + 3] = buf[3];
-    newenvp[envlen + 4] = NULL;
+  unsigned newenvlen = envlen;
+  for (int i = 0 ; i < VAR_COUNT ; ++i) {
+    if (!values[i]) {
+      continue;
+    } else if (existing_idx[i] >= 0) {
+      newenvp[existing_idx[i]] = buf[i];
+    } else {
+      newenvp[newenvlen++] = buf[i];
+    }
   }
 
+  newenvp[newenvlen] = NULL;
+
   return newenvp;
 }
 
+char** voyeur_augment_environment(char* const* envp,
+                                  const char* voyeur_libs,
+                                  const char* voyeur_opts,
+                                  const char* sockpath,
+                                  const char* ring,
+                                  const char* job,
+                                  const char* fd,
+                                  const char* env,
+                                  const char* filter,
+                                  void** buf_out)
+{
+  // Allocate a new environment, including additional space for the
+  // extra environment variables we'll add and a terminating NULL.
+  env_buf* buf = malloc(sizeof(env_buf) * VAR_COUNT);
+  *buf_out = (void*) buf;
+  char** newenvp =
+    malloc(sizeof(char*) * (environment_length(envp) + VAR_COUNT + 1));
+
+  return augment_environment(envp, voyeur_libs, voyeur_opts, sockpath,
+                             ring, job, fd, env, filter, newenvp, buf);
+}
+
+size_t voyeur_augment_environment_size(char* const* envp)
+{
+  return sizeof(char*) * (environment_length(envp) + VAR_COUNT + 1)
+       + sizeof(env_buf) * VAR_COUNT;
+}
+
+char** voyeur_augment_environment_in(char* const* envp,
+                                     const char* voyeur_libs,
+                                     const char* voyeur_opts,
+                                     const char* sockpath,
+                                     const char* ring,
+                                     const char* job,
+                                     const char* fd,
+                                     const char* env,
+                                     const char* filter,
+                                     void* mem)
+{
+  char** newenvp = (char**) mem;
+  env_buf* buf =
+    (env_buf*) (newenvp + environment_length(envp) + VAR_COUNT + 1);
+
+  return augment_environment(envp, voyeur_libs, voyeur_opts, sockpath,
+                             ring, job, fd, env, filter, newenvp, buf);
+}
+
+int voyeur_environment_job()
+{
+  const char* job = getenv("LIBVOYEUR_JOB");
+  return job ? atoi(job) : 0;
+}
+
+int voyeur_environment_fd()
+{
+  // LIBVOYEUR_FD is "<fd>:<pid>", where <pid> is the process that owns
+  // the connection. Forked children inherit the variable and the
+  // descriptor, but they must not write to their parent's connection.
+  const char* value = getenv("LIBVOYEUR_FD");
+  if (!value) {
+    return -1;
+  }
+
+  char* end;
+  long fd = strtol(value, &end, 10);
+  if (fd < 0 || *end != ':' || strtol(end + 1, NULL, 10) != getpid()) {
+    return -1;
+  }
+
+  // Make sure the descriptor is still the connection we were given.
+  struct stat info;
+  if (fstat((int) fd, &info) < 0 || !S_ISSOCK(info.st_mode)) {
+    return -1;
+  }
+
+  return (int) fd;
+}
+
+//////////////////////////////////////////////////
+// Environment snapshots.
+//////////////////////////////////////////////////
+
+#define SNAPSHOT_MAGIC 0x564e4559
+
+// How an exec event's environment is written.
+#define ENV_FULL  0   // Every variable, as a string.
+#define ENV_DELTA 1   // A list of operations that rebuild it from a snapshot.
+
+// Operations in an environment delta. Each is a varint holding a count
+// shifted left by two bits, with the kind of operation in the low bits.
+#define ENV_OP_COPY    0   // Copy the next 'count' variables of the snapshot.
+#define ENV_OP_SEEK    1   // Move to variable 'count' of the snapshot.
+#define ENV_OP_LITERAL 2   // A string follows.
+#define ENV_OP_BITS    2
+
+struct voyeur_env_snapshot {
+  size_t id;              // Distinguishes snapshots from different jobs.
+  size_t count;
+  const char** vars;      // Point into 'data' or 'mapping'.
+
+  // An open-addressed hash table of indices into 'vars', plus one, so
+  // that a variable's position in the snapshot can be found quickly.
+  // Only clients need it.
+  uint32_t* index;
+  size_t index_capacity;
+
+  int fd;                 // The memfd, or -1 once it's closed.
+  char name[16];
+  voyeur_buf data;        // The server's copy of the contents.
+  void* mapping;          // The client's view of the contents.
+  size_t mapping_size;
+};
+
+static size_t hash_var(const char* val)
+{
+  // FNV-1a.
+  size_t hash = 2166136261u;
+  for ( ; *val ; ++val) {
+    hash ^= (unsigned char) *val;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void snapshot_free(voyeur_env_snapshot* snapshot)
+{
+  if (snapshot->fd >= 0) {
+    close(snapshot->fd);
+  }
+  if (snapshot->mapping) {
+    munmap(snapshot->mapping, snapshot->mapping_size);
+  }
+  voyeur_buf_destroy(&snapshot->data);
+  free(snapshot->vars);
+  free(snapshot->index);
+  free(snapshot);
+}
+
+// Reads the contents of a snapshot, which are a magic number, the id,
+// and the variables, each a varint or string as in a voyeur_buf.
+static int snapshot_parse(voyeur_env_snapshot* snapshot,
+                          char* data, size_t size)
+{
+  voyeur_buf buf;
+  buf.data = data;
+  buf.size = size;
+  buf.capacity = 0;
+  buf.pos = 0;
+  buf.fixed = 0;
+
+  size_t magic;
+  if (voyeur_buf_read_size(&buf, &magic) < 0 || magic != SNAPSHOT_MAGIC ||
+      voyeur_buf_read_size(&buf, &snapshot->id) < 0 ||
+      voyeur_buf_read_size(&buf, &snapshot->count) < 0 ||
+      snapshot->count > size) {
+    return -1;
+  }
+
+  snapshot->vars = malloc(sizeof(char*) * (snapshot->count + 1));
+  for (size_t i = 0 ; i < snapshot->count ; ++i) {
+    if (voyeur_buf_read_string(&buf, &snapshot->vars[i]) < 0) {
+      return -1;
+    }
+  }
+  snapshot->vars[snapshot->count] = NULL;
+
+  return 0;
+}
+
+static void snapshot_build_index(voyeur_env_snapshot* snapshot)
+{
+  size_t capacity = 16;
+  while (capacity < snapshot->count * 2) {
+    capacity *= 2;
+  }
+
+  snapshot->index = calloc(capacity, sizeof(uint32_t));
+  snapshot->index_capacity = capacity;
+
+  // Insert in reverse, so a duplicated variable finds its first copy.
+  for (size_t i = snapshot->count ; i > 0 ; --i) {
+    size_t slot = hash_var(snapshot->vars[i - 1]) & (capacity - 1);
+    while (snapshot->index[slot] != 0 &&
+           strcmp(snapshot->vars[snapshot->index[slot] - 1],
+                  snapshot->vars[i - 1]) != 0) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    snapshot->index[slot] = (uint32_t) i;
+  }
+}
+
+// Returns the position of 'val' in the snapshot, or -1 if it's absent.
+static long snapshot_find(const voyeur_env_snapshot* snapshot,
+                          const char* val)
+{
+  size_t mask = snapshot->index_capacity - 1;
+  for (size_t slot = hash_var(val) & mask ;
+       snapshot->index[slot] != 0 ;
+       slot = (slot + 1) & mask) {
+    if (strcmp(snapshot->vars[snapshot->index[slot] - 1], val) == 0) {
+      return (long) snapshot->index[slot] - 1;
+    }
+  }
+
+  return -1;
+}
+
+voyeur_env_snapshot* voyeur_env_snapshot_create()
+{
+#ifdef __linux__
+  int fd = memfd_create("libvoyeur-env", MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // Ids only need to differ between the snapshots of this process.
+  static size_t next_id = 0;
+
+  voyeur_env_snapshot* snapshot = calloc(1, sizeof(voyeur_env_snapshot));
+  snapshot->id = __sync_add_and_fetch(&next_id, 1);
+  snapshot->fd = fd;
+  snprintf(snapshot->name, sizeof(snapshot->name), "%d", fd);
+  voyeur_buf_init(&snapshot->data);
+  return snapshot;
+#else
+  return NULL;
+#endif
+}
+
+void voyeur_env_snapshot_destroy(voyeur_env_snapshot* snapshot)
+{
+  snapshot_free(snapshot);
+}
+
+const char* voyeur_env_snapshot_name(voyeur_env_snapshot* snapshot)
+{
+  return snapshot->name;
+}
+
+int voyeur_env_snapshot_fill(voyeur_env_snapshot* snapshot,
+                             char* const* envp)
+{
+#ifdef __linux__
+  voyeur_buf* buf = &snapshot->data;
+  voyeur_buf_write_size(buf, SNAPSHOT_MAGIC);
+  voyeur_buf_write_size(buf, snapshot->id);
+  voyeur_buf_write_size(buf, environment_length(envp));
+  for (char* const* var = envp ; *var ; ++var) {
+    voyeur_buf_write_string(buf, *var, 0);
+  }
+
+  // Seal the memfd so that a client can't change it under another
+  // client's feet.
+  if (pwrite(snapshot->fd, buf->data, buf->size, 0) != (ssize_t) buf->size ||
+      fcntl(snapshot->fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    return -1;
+  }
+
+  return snapshot_parse(snapshot, buf->data, buf->size);
+#else
+  return -1;
+#endif
+}
+
+void voyeur_env_snapshot_close(voyeur_env_snapshot* snapshot)
+{
+  if (snapshot->fd >= 0) {
+    close(snapshot->fd);
+    snapshot->fd = -1;
+  }
+}
+
+voyeur_env_snapshot* voyeur_env_snapshot_attach(const char* name)
+{
+#ifdef __linux__
+  char* end;
+  long fd = name ? strtol(name, &end, 10) : -1;
+  if (fd < 0 || *end != '\0') {
+    return NULL;
+  }
+
+  // Only trust a memfd that's been sealed, since the process may have
+  // closed the one it inherited and reused the descriptor.
+  struct stat info;
+  if (fstat((int) fd, &info) < 0 || info.st_size == 0 ||
+      fcntl((int) fd, F_GET_SEALS) != (F_SEAL_SHRINK | F_SEAL_GROW |
+                                       F_SEAL_WRITE | F_SEAL_SEAL)) {
+    return NULL;
+  }
+
+  void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED,
+                       (int) fd, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  voyeur_env_snapshot* snapshot = calloc(1, sizeof(voyeur_env_snapshot));
+  snapshot->fd = -1;
+  snapshot->mapping = mapping;
+  snapshot->mapping_size = info.st_size;
+  voyeur_buf_init(&snapshot->data);
+
+  // The strings are NUL-terminated in the mapping, so nothing is
+  // written to it.
+  if (snapshot_parse(snapshot, mapping, info.st_size) < 0 ||
+      snapshot->count >= UINT32_MAX) {
+    snapshot_free(snapshot);
+    return NULL;
+  }
+
+  snapshot_build_index(snapshot);
+  return snapshot;
+#else
+  return NULL;
+#endif
+}
+
+static int write_env_op(voyeur_buf* buf, int op, size_t count)
+{
+  return voyeur_buf_write_size(buf, (count << ENV_OP_BITS) | op);
+}
+
+int voyeur_buf_write_env(voyeur_buf* buf,
+                         const voyeur_env_snapshot* base,
+                         char* const* envp)
+{
+  int envc = (int) environment_length(envp);
+
+  if (!base) {
+    voyeur_buf_write_byte(buf, ENV_FULL);
+    voyeur_buf_write_int(buf, envc);
+    for (int i = 0 ; i < envc ; ++i) {
+      voyeur_buf_write_string(buf, envp[i], 0);
+    }
+    return 0;
+  }
+
+  voyeur_buf_write_byte(buf, ENV_DELTA);
+  voyeur_buf_write_size(buf, base->id);
+  voyeur_buf_write_int(buf, envc);
+
+  // Runs of variables that match the snapshot are copied. Shells often
+  // reorder the environment, so a variable found elsewhere in the
+  // snapshot starts a new run there. Anything else is written out.
+  size_t cursor = 0;
+  size_t run = 0;
+  for (int i = 0 ; i < envc ; ++i) {
+    if (cursor < base->count && strcmp(base->vars[cursor], envp[i]) == 0) {
+      ++cursor;
+      ++run;
+      continue;
+    }
+
+    if (run > 0) {
+      write_env_op(buf, ENV_OP_COPY, run);
+      run = 0;
+    }
+
+    long found = snapshot_find(base, envp[i]);
+    if (found >= 0) {
+      write_env_op(buf, ENV_OP_SEEK, found);
+      cursor = found + 1;
+      run = 1;
+    } else {
+      write_env_op(buf, ENV_OP_LITERAL, 0);
+      voyeur_buf_write_string(buf, envp[i], 0);
+    }
+  }
+
+  if (run > 0) {
+    write_env_op(buf, ENV_OP_COPY, run);
+  }
+
+  return 0;
+}
+
+int voyeur_buf_read_env(voyeur_buf* buf,
+                        const voyeur_env_snapshot* base,
+                        const char*** envp_out)
+{
+  char mode;
+  size_t id;
+  int envc;
+  if (voyeur_buf_read_byte(buf, &mode) < 0) {
+    return -1;
+  }
+  if (mode == ENV_DELTA) {
+    if (voyeur_buf_read_size(buf, &id) < 0 || !base || base->id != id) {
+      return -1;
+    }
+  } else if (mode != ENV_FULL) {
+    return -1;
+  }
+  if (voyeur_buf_read_int(buf, &envc) < 0 || envc < 0) {
+    return -1;
+  }
+
+  const char** envp = malloc(sizeof(char*) * (envc + 1));
+  size_t cursor = 0;
+  int i = 0;
+  while (i < envc) {
+    if (mode == ENV_FULL) {
+      if (voyeur_buf_read_string(buf, &envp[i++]) < 0) {
+        goto fail;
+      }
+      continue;
+    }
+
+    size_t op;
+    if (voyeur_buf_read_size(buf, &op) < 0) {
+      goto fail;
+    }
+
+    size_t count = op >> ENV_OP_BITS;
+    switch (op & ((1 << ENV_OP_BITS) - 1)) {
+      case ENV_OP_COPY:
+        if (count > (size_t) (envc - i) || count > base->count - cursor) {
+          goto fail;
+        }
+        memcpy(&envp[i], &base->vars[cursor], sizeof(char*) * count);
+        i += count;
+        cursor += count;
+        break;
+
+      case ENV_OP_SEEK:
+        if (count > base->count) {
+          goto fail;
+        }
+        cursor = count;
+        break;
+
+      case ENV_OP_LITERAL:
+        if (voyeur_buf_read_string(buf, &envp[i++]) < 0) {
+          goto fail;
+        }
+        break;
+
+      default:
+        goto fail;
+    }
+  }
+
+  envp[envc] = NULL;
+  *envp_out = envp;
+  return 0;
+
+fail:
+  free(envp);
+  return -1;
+}
+
 char voyeur_encode_options(uint8_t opts)
 {
   // Stripping all but the last 5 bits and bitwise-or'ing with '@' will always
@@ -7,12 +7,101 @@
 // variables required for libvoyeur to observe a process. If the
 // caller doesn't fork, then after calling exec() they should free
 // both the returned environment and the buffer returned in buf_out.
+// 'ring' may be NULL if events aren't delivered through a ring, and
+// 'job' may be NULL if the process isn't part of a job. 'fd' is the
+// value of LIBVOYEUR_FD: "<fd>:<pid>" to pass on a connection, "-1" to
+// let the process's children pass on connections without passing one
+// yet, or NULL if connections aren't inherited. 'env' names the job's
+// environment snapshot, and 'filter' is the encoded open filter; either
+// may be NULL. Any of libvoyeur's variables that are already present
+// are replaced in place.
 char** voyeur_augment_environment(char* const* envp,
                                   const char* voyeur_libs,
                                   const char* voyeur_opts,
                                   const char* sockpath,
+                                  const char* ring,
+                                  const char* job,
+                                  const char* fd,
+                                  const char* env,
+                                  const char* filter,
                                   void** buf_out);
 
+// Like voyeur_augment_environment, but builds the environment in
+// 'mem', which must be at least voyeur_augment_environment_size(envp)
+// bytes, instead of allocating memory. This is safe to call in a
+// vforked child.
+size_t voyeur_augment_environment_size(char* const* envp);
+char** voyeur_augment_environment_in(char* const* envp,
+                                     const char* voyeur_libs,
+                                     const char* voyeur_opts,
+                                     const char* sockpath,
+                                     const char* ring,
+                                     const char* job,
+                                     const char* fd,
+                                     const char* env,
+                                     const char* filter,
+                                     void* mem);
+
+// Returns the job that this process belongs to according to
+// LIBVOYEUR_JOB, or 0 if it isn't part of a job.
+int voyeur_environment_job();
+
+// Returns the connection to libvoyeur that this process inherited
+// through LIBVOYEUR_FD, or -1 if it doesn't own one.
+int voyeur_environment_fd();
+
+//////////////////////////////////////////////////
+// Environment snapshots.
+//////////////////////////////////////////////////
+
+// A snapshot holds the environment a job started with. The server
+// writes it to a memfd that every process in the job inherits, and
+// which they find through LIBVOYEUR_ENV, so that an exec event can
+// describe its environment as changes to the snapshot rather than
+// listing every variable. Most processes pass on their environment
+// unchanged, so the changes are usually few. This is only supported on
+// Linux; elsewhere voyeur_env_snapshot_create and
+// voyeur_env_snapshot_attach always fail, and exec events contain the
+// whole environment.
+struct voyeur_buf;
+typedef struct voyeur_env_snapshot voyeur_env_snapshot;
+
+// Server side.
+
+// Creates an empty snapshot. Returns NULL on failure.
+voyeur_env_snapshot* voyeur_env_snapshot_create();
+void voyeur_env_snapshot_destroy(voyeur_env_snapshot* snapshot);
+
+// The value of LIBVOYEUR_ENV that the job's first process should get.
+const char* voyeur_env_snapshot_name(voyeur_env_snapshot* snapshot);
+
+// Stores 'envp' in the snapshot. Returns -1 on failure.
+int voyeur_env_snapshot_fill(voyeur_env_snapshot* snapshot,
+                             char* const* envp);
+
+// Closes the memfd once the job's first process has inherited it.
+void voyeur_env_snapshot_close(voyeur_env_snapshot* snapshot);
+
+// Client side.
+
+// Attaches to the snapshot named by 'name', which should be the value
+// of LIBVOYEUR_ENV. It stays attached for the life of the process.
+// Returns NULL if 'name' is NULL or the snapshot isn't usable.
+voyeur_env_snapshot* voyeur_env_snapshot_attach(const char* name);
+
+// Writes 'envp' into 'buf', as changes to 'base' if it isn't NULL. This
+// doesn't allocate memory, so it's safe to call in a vforked child.
+int voyeur_buf_write_env(struct voyeur_buf* buf,
+                         const voyeur_env_snapshot* base,
+                         char* const* envp);
+
+// Reads an environment written by voyeur_buf_write_env, which may refer
+// to 'base'. The strings point into 'buf' or 'base'; the array is
+// allocated and must be freed by the caller.
+int voyeur_buf_read_env(struct voyeur_buf* buf,
+                        const voyeur_env_snapshot* base,
+                        const char*** envp);
+
 // Encoding and decoding options.
 char voyeur_encode_options(uint8_t opts);
 uint8_t voyeur_decode_options(const char* opts, uint8_t offset);
@@ -23,96 +23,98 @@
 // even if the callback isn't present, so we can move on to the
 // next event in the stream. In practice the callback should always be
 // present, so it's not worth worrying about.
-
-static void handle_exec(voyeur_context* context, int fd)
+//
+// Strings are read in place, or found in the sender's table of
+// interned strings or its job's environment snapshot, so they don't
+// need to be freed; they remain valid
+// until the buffer holding the event is reused.
+
+// The job of the event whose callback is running on this thread. With
+// an executor, several callbacks may be running at once.
+static __thread int current_job = 0;
+
+static void handle_exec(voyeur_context* context, voyeur_buf* buf,
+                        const voyeur_sender* sender)
 {
+  // Read the pid and ppid. These come first, and unlike other events
+  // they're included, since posix_spawn reports exec events on behalf
+  // of the processes it creates.
+  pid_t pid, ppid;
+  RETURN_ON_FAIL(voyeur_buf_read_pid, buf, &pid);
+  RETURN_ON_FAIL(voyeur_buf_read_pid, buf, &ppid);
+
   // Read the path.
-  char* file;
-  RETURN_ON_FAIL(voyeur_read_string, fd, &file, 0);
+  const char* file;
+  RETURN_ON_FAIL(voyeur_buf_read_string, buf, &file);
 
   // Read the arguments.
   int argc;
-  RETURN_ON_FAIL(voyeur_read_int, fd, &argc);
+  RETURN_ON_FAIL(voyeur_buf_read_int, buf, &argc);
+
+  // Every argument takes at least two bytes, a length and a terminator,
+  // so a count the frame can't hold is malformed.
+  if (argc < 0 || (size_t) argc > (buf->size - buf->pos) / 2) {
+    SHOULD_NOT_REACH("libvoyeur: malformed argument count %d\n", argc);
+    return;
+  }
 
-  char** argv = malloc(sizeof(char*) * (argc + 1));
+  const char** argv = malloc(sizeof(char*) * (argc + 1));
+  if (!argv) {
+    return;
+  }
   for (int i = 0 ; i < argc ; ++i) {
-    char* arg;
-    RETURN_ON_FAIL(voyeur_read_string, fd, &arg, 0);
-    argv[i] = arg;
+    if (voyeur_buf_read_string(buf, &argv[i]) < 0) {
+      free(argv);
+      return;
+    }
   }
   argv[argc] = NULL;
 
-  // Read the environment.
-  int envc;
-  char** envp = NULL;
+  // Read the environment, which may be written as changes to the
+  // environment the sender's job started with.
+  const char** envp = NULL;
   if (context->exec_opts & OBSERVE_EXEC_ENV) {
-    RETURN_ON_FAIL(voyeur_read_int, fd, &envc);
-
-    envp = malloc(sizeof(char*) * (envc + 1));
-    for (int i = 0 ; i < envc ; ++i) {
-      char* envvar;
-      RETURN_ON_FAIL(voyeur_read_string, fd, &envvar, 0);
-      envp[i] = envvar;
+    if (voyeur_buf_read_env(buf, sender->env, &envp) < 0) {
+      free(argv);
+      return;
     }
-    envp[envc] = NULL;
   }
 
   // Read the value of PATH.
-  char* path = NULL;
+  const char* path = NULL;
   if (context->exec_opts & OBSERVE_EXEC_PATH) {
-    RETURN_ON_FAIL(voyeur_read_string, fd, &path, 0);
+    voyeur_buf_read_string(buf, &path);
   }
 
   // Read the current working directory.
-  char* cwd = NULL;
+  const char* cwd = NULL;
   if (context->exec_opts & OBSERVE_EXEC_CWD) {
-    RETURN_ON_FAIL(voyeur_read_string, fd, &cwd, 0);
+    voyeur_buf_read_string(buf, &cwd);
   }
 
-  // Read the pid and ppid.
-  pid_t pid, ppid;
-  RETURN_ON_FAIL(voyeur_read_pid, fd, &pid);
-  RETURN_ON_FAIL(voyeur_read_pid, fd, &ppid);
-
   if (context->exec_cb) {
-    ((voyeur_exec_callback)context->exec_cb)(file, argv, envp,
+    ((voyeur_exec_callback)context->exec_cb)(file,
+                                             (char* const*) argv,
+                                             (char* const*) envp,
                                              path, cwd,
                                              pid, ppid,
                                              context->exec_userdata);
   }
 
-  // Free everything.
-  free(file);
-
-  for (int i = 0 ; i < argc ; ++i) {
-    free(argv[i]);
-  }
   free(argv);
-
-  if (context->exec_opts & OBSERVE_EXEC_ENV) {
-    for (int i = 0 ; i < envc ; ++i) {
-      free(envp[i]);
-    }
-    free(envp);
-  }
-
-  if (context->exec_opts & OBSERVE_EXEC_PATH) {
-    free(path);
-  }
-
-  if (context->exec_opts & OBSERVE_EXEC_CWD) {
-    free(cwd);
-  }
+  free(envp);
 }
 
-static void handle_exit(voyeur_context* context, int fd)
+static void handle_exit(voyeur_context* context, voyeur_buf* buf,
+                        const voyeur_sender* sender)
 {
+  pid_t pid = sender->pid;
   int status;
-  pid_t pid, ppid;
+  pid_t ppid;
 
-  RETURN_ON_FAIL(voyeur_read_int, fd, &status);
-  RETURN_ON_FAIL(voyeur_read_pid, fd, &pid);
-  RETURN_ON_FAIL(voyeur_read_pid, fd, &ppid);
+  // The parent can change while a process runs, so it's included.
+  RETURN_ON_FAIL(voyeur_buf_read_int, buf, &status);
+  RETURN_ON_FAIL(voyeur_buf_read_pid, buf, &ppid);
 
   if (context->exit_cb) {
     ((voyeur_exit_callback)context->exit_cb)(status, pid, ppid,
@@ -120,23 +122,98 @@ static void handle_exit(voyeur_context* context, int fd)
   }
 }
 
-static void handle_open(voyeur_context* context, int fd)
+static void handle_open_summary(voyeur_context* context, voyeur_buf* buf,
+                                const voyeur_sender* sender)
+{
+  size_t count;
+  RETURN_ON_FAIL(voyeur_buf_read_size, buf, &count);
+
+  // Every entry takes at least three bytes.
+  if (count > (buf->size - buf->pos) / 3) {
+    return;
+  }
+
+  // Paths are split like those of open events, so they're joined into
+  // one buffer here.
+  char** paths = calloc(count + 1, sizeof(char*));
+  uint8_t* access = malloc(count + 1);
+  if (!paths || !access) {
+    free(paths);
+    free(access);
+    return;
+  }
+
+  // Entries we can't allocate a path for are dropped from the summary,
+  // so 'kept' may end up less than 'count'.
+  size_t i = 0, kept = 0;
+  for ( ; i < count ; ++i) {
+    const char* dir;
+    const char* name;
+    char bits;
+    if (voyeur_buf_read_interned(buf, sender->strings, &dir) < 0 ||
+        voyeur_buf_read_string(buf, &name) < 0 ||
+        voyeur_buf_read_byte(buf, &bits) < 0) {
+      break;
+    }
+
+    size_t size = strlen(dir) + strlen(name) + 1;
+    char* joined = malloc(size);
+    if (!joined) {
+      continue;
+    }
+    snprintf(joined, size, "%s%s", dir, name);
+    paths[kept] = joined;
+    access[kept] = (uint8_t) bits;
+    kept++;
+  }
+
+  if (i == count && context->open_cb) {
+    ((voyeur_open_summary_callback)context->open_cb)(kept,
+                                                     (const char* const*) paths,
+                                                     access,
+                                                     sender->pid,
+                                                     context->open_userdata);
+  }
+
+  for (size_t j = 0 ; j < kept ; ++j) {
+    free(paths[j]);
+  }
+  free(paths);
+  free(access);
+}
+
+static void handle_open(voyeur_context* context, voyeur_buf* buf,
+                        const voyeur_sender* sender)
 {
-  char* path;
+  pid_t pid = sender->pid;
+
+  if (context->open_opts & OBSERVE_OPEN_SUMMARY) {
+    handle_open_summary(context, buf, sender);
+    return;
+  }
+  const char* dir;
+  const char* name;
   int oflag, mode, retval;
-  char* cwd = NULL;
-  pid_t pid;
+  const char* cwd = NULL;
 
-  RETURN_ON_FAIL(voyeur_read_string, fd, &path, 0);
-  RETURN_ON_FAIL(voyeur_read_int, fd, &oflag);
-  RETURN_ON_FAIL(voyeur_read_int, fd, &mode);
-  RETURN_ON_FAIL(voyeur_read_int, fd, &retval);
+  // The path is split after its last slash, so that the directory can
+  // be interned.
+  RETURN_ON_FAIL(voyeur_buf_read_interned, buf, sender->strings, &dir);
+  RETURN_ON_FAIL(voyeur_buf_read_string, buf, &name);
+  RETURN_ON_FAIL(voyeur_buf_read_int, buf, &oflag);
+  RETURN_ON_FAIL(voyeur_buf_read_int, buf, &mode);
+  RETURN_ON_FAIL(voyeur_buf_read_int, buf, &retval);
 
   if (context->open_opts & OBSERVE_OPEN_CWD) {
-    RETURN_ON_FAIL(voyeur_read_string, fd, &cwd, 0);
+    RETURN_ON_FAIL(voyeur_buf_read_interned, buf, sender->strings, &cwd);
   }
 
-  RETURN_ON_FAIL(voyeur_read_pid, fd, &pid);
+  const char* path = name;
+  char joined[2 * VOYEUR_MAX_STRLEN + 1];
+  if (dir[0] != '\0') {
+    snprintf(joined, sizeof(joined), "%s%s", dir, name);
+    path = joined;
+  }
 
   if (context->open_cb) {
     ((voyeur_open_callback)context->open_cb)(path, oflag,
@@ -144,18 +221,16 @@ static void handle_open(voyeur_context* context, int fd)
                                              cwd, retval, pid,
                                              context->open_userdata);
   }
-
-  free(path);
 }
 
-static void handle_close(voyeur_context* context, int fd)
+static void handle_close(voyeur_context* context, voyeur_buf* buf,
+                         const voyeur_sender* sender)
 {
+  pid_t pid = sender->pid;
   int fildes, retval;
-  pid_t pid;
 
-  RETURN_ON_FAIL(voyeur_read_int, fd, &fildes);
-  RETURN_ON_FAIL(voyeur_read_int, fd, &retval);
-  RETURN_ON_FAIL(voyeur_read_pid, fd, &pid);
+  RETURN_ON_FAIL(voyeur_buf_read_int, buf, &fildes);
+  RETURN_ON_FAIL(voyeur_buf_read_int, buf, &retval);
 
   if (context->close_cb) {
     ((voyeur_close_callback)context->close_cb)(fildes, retval, pid,
@@ -165,22 +240,53 @@ static void handle_close(voyeur_context* context, int fd)
 
 #define ON_EVENT(E, e)                          \
   case VOYEUR_EVENT_##E:                        \
-    handle_##e(context, fd);                    \
+    handle_##e(context, buf, sender);           \
     break;
 
-void voyeur_handle_event(voyeur_context* context, voyeur_event_type type, int fd)
+void voyeur_handle_event(voyeur_context* context,
+                         voyeur_event_type type,
+                         const voyeur_sender* sender,
+                         voyeur_buf* buf)
 {
+  current_job = sender->job;
+
   switch (type) {
     MAP_EVENTS
     default:
       SHOULD_NOT_REACH("libvoyeur: got unknown event type %u\n",
                        (unsigned) type);
-      return;
+      break;
   }
+
+  current_job = 0;
 }
 
 #undef ON_EVENT
 
+int voyeur_current_job(voyeur_context_t ctx)
+{
+  (void) ctx;
+  return current_job;
+}
+
+int voyeur_event_pid(voyeur_event_type type,
+                     voyeur_buf* buf,
+                     pid_t sender,
+                     pid_t* pid)
+{
+  // Events are about the process that sent them, except for exec
+  // events, which start with the pid of the process being exec'd.
+  if (type != VOYEUR_EVENT_EXEC) {
+    *pid = sender;
+    return 0;
+  }
+
+  size_t pos = buf->pos;
+  int status = voyeur_buf_read_pid(buf, pid);
+  buf->pos = pos;
+  return status;
+}
+
 #ifdef __APPLE__
 #define LIB_SUFFIX ".dylib"
 #else
@@ -253,12 +359,25 @@ char* voyeur_requested_libs(voyeur_context* context)
     context->exec_cb = &did_force_exec;  // Just a dummy value.
   }
 
+  // Similarly, open summaries are sent from voyeur-exit's hooks. (We
+  // set OBSERVE_EXIT_SILENT in that case.)
+  char did_force_exit = 0;
+  if (!context->exit_cb && context->open_cb &&
+      (context->open_opts & OBSERVE_OPEN_SUMMARY)) {
+    did_force_exit = 1;
+    context->exit_cb = &did_force_exit;
+  }
+
   MAP_EVENTS
 
   if (did_force_exec) {
     context->exec_cb = NULL;
   }
 
+  if (did_force_exit) {
+    context->exit_cb = NULL;
+  }
+
   if (did_allocate) {
     free(libdir);
   }
@@ -283,6 +402,10 @@ char* voyeur_requested_opts(voyeur_context* context)
     context->exec_opts = OBSERVE_EXEC_SILENT;
   }
 
+  if (!context->exit_cb) {
+    context->exit_opts = OBSERVE_EXIT_SILENT;
+  }
+
   MAP_EVENTS
 
   return opts;
@@ -305,3 +428,14 @@ void voyeur_observe_##e(voyeur_context_t ctx,           \
 MAP_EVENTS
 
 #undef ON_EVENT
+
+void voyeur_observe_open_summary(voyeur_context_t ctx,
+                                 voyeur_open_summary_callback callback,
+                                 void* userdata)
+{
+  // The summary takes the place of the open() events.
+  voyeur_context* context = (voyeur_context*) ctx;
+  context->open_opts = OBSERVE_OPEN_SUMMARY;
+  context->open_cb = (void*) callback;
+  context->open_userdata = userdata;
+}
@@ -2,6 +2,7 @@
 #define VOYEUR_EVENTS_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
 // How to define a new event:
 // 1. Add the new event name to MAP_EVENTS.
@@ -37,13 +38,49 @@ typedef struct {
   MAP_EVENTS
 
   char* resource_path;
+  char* open_filter;
+  size_t ring_size;
+  char io_uring_disabled;
+  char inherit_connection;
+  int executor_threads;
+  size_t executor_queue_size;
+  char executor_drop;
   void* server_state;
 } voyeur_context;
 
 #undef ON_EVENT
 
-// Dispatch to the correct handler for the given event type.
-void voyeur_handle_event(voyeur_context* context, voyeur_event_type type, int fd);
+// What the server knows about the process that sent an event.
+struct voyeur_string_table;
+struct voyeur_env_snapshot;
+typedef struct {
+  int job;
+  pid_t pid;
+
+  // Its interned strings, or NULL.
+  struct voyeur_string_table* strings;
+
+  // The environment its job started with, or NULL.
+  const struct voyeur_env_snapshot* env;
+} voyeur_sender;
+
+// Dispatch to the correct handler for the given event type. The
+// handler reads the rest of the event from 'buf', using what's known
+// about the sender to decode it. While the callback runs,
+// voyeur_current_job() returns the sender's job.
+struct voyeur_buf;
+void voyeur_handle_event(voyeur_context* context,
+                         voyeur_event_type type,
+                         const voyeur_sender* sender,
+                         struct voyeur_buf* buf);
+
+// Find the pid of the process an event is about without consuming any
+// of it. That's usually 'sender', the process that sent it. Returns -1
+// if the event is malformed.
+int voyeur_event_pid(voyeur_event_type type,
+                     struct voyeur_buf* buf,
+                     pid_t sender,
+                     pid_t* pid);
 
 // Create the VOYEUR_LIBS and VOYEUR_OPTS strings based on the
 // context. The caller is responsible for freeing them.
@@ -55,4 +92,17 @@ typedef enum {
   OBSERVE_EXEC_SILENT = 1 << 4
 } voyeur_extra_exec_options;
 
+// Likewise, the exit() handler is loaded to run the other hooks' exit
+// handlers when open() calls are summarized, but with this option it
+// doesn't report the exit itself.
+typedef enum {
+  OBSERVE_EXIT_SILENT = 1 << 4
+} voyeur_extra_exit_options;
+
+// Set by voyeur_observe_open_summary(), in which case 'open_cb' is a
+// voyeur_open_summary_callback.
+typedef enum {
+  OBSERVE_OPEN_SUMMARY = 1 << 4
+} voyeur_extra_open_options;
+
 #endif
@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "executor.h"
+#include "net.h"
+
+typedef struct {
+  voyeur_event_type type;
+  voyeur_sender sender;
+  char* data;
+  size_t size;
+} work_item;
+
+typedef struct {
+  voyeur_executor* executor;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;   // Also signaled whenever an event is handled.
+
+  // A circular queue of events waiting to be handled.
+  work_item* items;
+  size_t head;
+  size_t count;
+
+  char busy;                 // Set while an event is being handled.
+  char stopping;
+} worker;
+
+struct voyeur_executor {
+  voyeur_context* context;
+  worker* workers;
+  int threads;
+  size_t queue_size;
+  char drop;
+
+  // Only the server thread submits events, so this needs no locking.
+  size_t dropped;
+};
+
+static void handle_item(voyeur_context* context, work_item* item)
+{
+  // The copy is borrowed by the voyeur_buf rather than owned by it.
+  voyeur_buf buf;
+  buf.data = item->data;
+  buf.size = item->size;
+  buf.capacity = 0;
+  buf.pos = 0;
+  buf.fixed = 0;
+
+  voyeur_handle_event(context, item->type, &item->sender, &buf);
+  free(item->data);
+  if (item->sender.strings) {
+    voyeur_string_table_release(item->sender.strings);
+  }
+}
+
+static void* worker_thread(void* arg)
+{
+  worker* w = (worker*) arg;
+  size_t queue_size = w->executor->queue_size;
+
+  pthread_mutex_lock(&w->mutex);
+  while (1) {
+    while (w->count == 0 && !w->stopping) {
+      pthread_cond_wait(&w->not_empty, &w->mutex);
+    }
+
+    if (w->count == 0) {
+      break;  // We're stopping and there's nothing left to do.
+    }
+
+    work_item item = w->items[w->head];
+    w->head = (w->head + 1) % queue_size;
+    w->count--;
+    w->busy = 1;
+    pthread_mutex_unlock(&w->mutex);
+
+    handle_item(w->executor->context, &item);
+
+    pthread_mutex_lock(&w->mutex);
+    w->busy = 0;
+    pthread_cond_broadcast(&w->not_full);
+  }
+  pthread_mutex_unlock(&w->mutex);
+
+  return NULL;
+}
+
+voyeur_executor* voyeur_executor_create(voyeur_context* context,
+                                        int threads,
+                                        size_t queue_size,
+                                        char drop)
+{
+  if (threads <= 0 || queue_size == 0) {
+    return NULL;
+  }
+
+  voyeur_executor* executor = calloc(1, sizeof(voyeur_executor));
+  executor->context = context;
+  executor->queue_size = queue_size;
+  executor->drop = drop;
+  executor->workers = calloc(threads, sizeof(worker));
+
+  for (int i = 0 ; i < threads ; ++i) {
+    worker* w = &executor->workers[i];
+    w->executor = executor;
+    w->items = malloc(queue_size * sizeof(work_item));
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->not_empty, NULL);
+    pthread_cond_init(&w->not_full, NULL);
+
+    if (pthread_create(&w->thread, NULL, worker_thread, (void*) w) != 0) {
+      free(w->items);
+      break;
+    }
+
+    executor->threads++;
+  }
+
+  if (executor->threads == 0) {
+    free(executor->workers);
+    free(executor);
+    return NULL;
+  }
+
+  return executor;
+}
+
+void voyeur_executor_destroy(voyeur_executor* executor)
+{
+  for (int i = 0 ; i < executor->threads ; ++i) {
+    worker* w = &executor->workers[i];
+    pthread_mutex_lock(&w->mutex);
+    w->stopping = 1;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->mutex);
+  }
+
+  for (int i = 0 ; i < executor->threads ; ++i) {
+    worker* w = &executor->workers[i];
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->not_empty);
+    pthread_cond_destroy(&w->not_full);
+    free(w->items);
+  }
+
+  free(executor->workers);
+  free(executor);
+}
+
+int voyeur_executor_submit(voyeur_executor* executor,
+                           voyeur_event_type type,
+                           const voyeur_sender* sender,
+                           voyeur_buf* buf)
+{
+  pid_t subject;
+  if (voyeur_event_pid(type, buf, sender->pid, &subject) < 0) {
+    return -1;
+  }
+
+  worker* w = &executor->workers[(unsigned) subject % executor->threads];
+
+  pthread_mutex_lock(&w->mutex);
+  if (w->count == executor->queue_size && executor->drop) {
+    pthread_mutex_unlock(&w->mutex);
+    executor->dropped++;
+    return -1;
+  }
+
+  while (w->count == executor->queue_size) {
+    pthread_cond_wait(&w->not_full, &w->mutex);
+  }
+
+  work_item* item =
+    &w->items[(w->head + w->count) % executor->queue_size];
+  item->type = type;
+  item->sender = *sender;
+  if (sender->strings) {
+    voyeur_string_table_retain(sender->strings);
+  }
+  item->size = buf->size - buf->pos;
+  item->data = malloc(item->size);
+  memcpy(item->data, buf->data + buf->pos, item->size);
+  w->count++;
+
+  pthread_cond_signal(&w->not_empty);
+  pthread_mutex_unlock(&w->mutex);
+  return 0;
+}
+
+void voyeur_executor_drain(voyeur_executor* executor)
+{
+  for (int i = 0 ; i < executor->threads ; ++i) {
+    worker* w = &executor->workers[i];
+    pthread_mutex_lock(&w->mutex);
+    while (w->count > 0 || w->busy) {
+      pthread_cond_wait(&w->not_full, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+  }
+}
+
+size_t voyeur_executor_dropped(voyeur_executor* executor)
+{
+  return executor->dropped;
+}
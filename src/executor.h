@@ -0,0 +1,51 @@
+#ifndef VOYEUR_EXECUTOR_H
+#define VOYEUR_EXECUTOR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "event.h"
+
+//////////////////////////////////////////////////
+// Handling events on worker threads.
+//////////////////////////////////////////////////
+
+// A voyeur_executor handles events, and so calls the user's callbacks,
+// on a pool of worker threads, so that slow callbacks don't stop the
+// server from receiving events. Each worker has its own bounded queue,
+// and every event from a given pid goes to the same worker, so the
+// events from a process are always handled in the order they arrived.
+
+typedef struct voyeur_executor voyeur_executor;
+struct voyeur_buf;
+
+// Creates 'threads' workers, each of which can queue up to
+// 'queue_size' events. When a queue is full, voyeur_executor_submit
+// waits for room unless 'drop' is set, in which case the event is
+// dropped. Returns NULL on failure.
+voyeur_executor* voyeur_executor_create(voyeur_context* context,
+                                        int threads,
+                                        size_t queue_size,
+                                        char drop);
+
+// Handles every queued event and then stops the workers.
+void voyeur_executor_destroy(voyeur_executor* executor);
+
+// Queues the rest of the event in 'buf', which was sent by 'sender', to
+// be handled by the worker responsible for the process it's about. The
+// event is copied and holds a reference to the sender's strings, so
+// 'buf' may be reused as soon as this returns. The sender's environment
+// snapshot must outlive the executor. Returns -1 if the event was
+// dropped or is malformed.
+int voyeur_executor_submit(voyeur_executor* executor,
+                           voyeur_event_type type,
+                           const voyeur_sender* sender,
+                           struct voyeur_buf* buf);
+
+// Blocks until every event submitted so far has been handled.
+void voyeur_executor_drain(voyeur_executor* executor);
+
+// The number of events that have been dropped because a queue was full.
+size_t voyeur_executor_dropped(voyeur_executor* executor);
+
+#endif
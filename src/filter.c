@@ -0,0 +1,237 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <bsd/bsd.h>
+#endif
+
+#include "filter.h"
+
+#define FILTER_INCLUDE 1
+#define FILTER_EXCLUDE 2
+
+// Encoded filters are a ':'-separated list of patterns, each prefixed
+// with '+' for an include or '-' for an exclude.
+#define FILTER_SEPARATOR ':'
+#define FILTER_GLOB_CHARS "*?["
+
+// Trie nodes live in one array. Node 0 is the root, which is never
+// anyone's child or sibling, so an index of 0 means there's none.
+typedef struct {
+  char c;
+  uint8_t flags;    // Set if a pattern ends here.
+  uint32_t child;
+  uint32_t sibling;
+} filter_node;
+
+typedef struct {
+  char* pattern;
+  uint8_t flags;
+} filter_glob;
+
+struct voyeur_filter {
+  filter_node* nodes;
+  uint32_t node_count;
+  uint32_t node_capacity;
+
+  filter_glob* globs;
+  size_t glob_count;
+
+  char has_includes;
+};
+
+
+//////////////////////////////////////////////////
+// Encoding.
+//////////////////////////////////////////////////
+
+static int append_patterns(char* encoded, char sign,
+                           const char* const patterns[])
+{
+  for (int i = 0 ; patterns && patterns[i] ; ++i) {
+    const char* pattern = patterns[i];
+    if (pattern[0] == '\0' || strchr(pattern, FILTER_SEPARATOR)) {
+      continue;
+    }
+
+    size_t len = strlen(encoded);
+    if (len + strlen(pattern) + 2 >= VOYEUR_FILTER_MAX) {
+      return -1;
+    }
+
+    if (len > 0) {
+      encoded[len++] = FILTER_SEPARATOR;
+    }
+    encoded[len++] = sign;
+    strlcpy(encoded + len, pattern, VOYEUR_FILTER_MAX - len);
+  }
+
+  return 0;
+}
+
+char* voyeur_filter_encode(const char* const include[],
+                           const char* const exclude[])
+{
+  char* encoded = calloc(1, VOYEUR_FILTER_MAX);
+
+  if (append_patterns(encoded, '+', include) < 0 ||
+      append_patterns(encoded, '-', exclude) < 0 ||
+      encoded[0] == '\0') {
+    free(encoded);
+    return NULL;
+  }
+
+  return encoded;
+}
+
+
+//////////////////////////////////////////////////
+// Compiling and matching.
+//////////////////////////////////////////////////
+
+static uint32_t add_node(voyeur_filter* filter, char c)
+{
+  if (filter->node_count == filter->node_capacity) {
+    filter->node_capacity *= 2;
+    filter->nodes = realloc(filter->nodes,
+                            filter->node_capacity * sizeof(filter_node));
+  }
+
+  filter_node* node = &filter->nodes[filter->node_count];
+  node->c = c;
+  node->flags = 0;
+  node->child = 0;
+  node->sibling = 0;
+  return filter->node_count++;
+}
+
+static void add_prefix(voyeur_filter* filter, const char* prefix,
+                       size_t len, uint8_t flags)
+{
+  uint32_t node = 0;
+  for (size_t i = 0 ; i < len ; ++i) {
+    uint32_t child = filter->nodes[node].child;
+    while (child && filter->nodes[child].c != prefix[i]) {
+      child = filter->nodes[child].sibling;
+    }
+
+    if (!child) {
+      child = add_node(filter, prefix[i]);
+      filter->nodes[child].sibling = filter->nodes[node].child;
+      filter->nodes[node].child = child;
+    }
+
+    node = child;
+  }
+
+  filter->nodes[node].flags |= flags;
+}
+
+static void add_glob(voyeur_filter* filter, const char* glob,
+                     size_t len, uint8_t flags)
+{
+  filter->globs = realloc(filter->globs,
+                          (filter->glob_count + 1) * sizeof(filter_glob));
+  filter->globs[filter->glob_count].pattern = strndup(glob, len);
+  filter->globs[filter->glob_count].flags = flags;
+  filter->glob_count++;
+}
+
+voyeur_filter* voyeur_filter_create(const char* encoded)
+{
+  if (!encoded || encoded[0] == '\0') {
+    return NULL;
+  }
+
+  voyeur_filter* filter = calloc(1, sizeof(voyeur_filter));
+  filter->node_capacity = 64;
+  filter->nodes = malloc(filter->node_capacity * sizeof(filter_node));
+  add_node(filter, '\0');
+
+  const char* pattern = encoded;
+  while (*pattern) {
+    const char* end = strchr(pattern, FILTER_SEPARATOR);
+    size_t len = end ? (size_t) (end - pattern) : strlen(pattern);
+
+    if (len > 1 && (pattern[0] == '+' || pattern[0] == '-')) {
+      uint8_t flags = pattern[0] == '+' ? FILTER_INCLUDE : FILTER_EXCLUDE;
+      if (flags == FILTER_INCLUDE) {
+        filter->has_includes = 1;
+      }
+
+      // strpbrk would look past the end of the pattern.
+      char is_glob = 0;
+      for (size_t i = 1 ; i < len ; ++i) {
+        if (strchr(FILTER_GLOB_CHARS, pattern[i])) {
+          is_glob = 1;
+          break;
+        }
+      }
+
+      if (is_glob) {
+        add_glob(filter, pattern + 1, len - 1, flags);
+      } else {
+        add_prefix(filter, pattern + 1, len - 1, flags);
+      }
+    }
+
+    pattern += len;
+    if (*pattern == FILTER_SEPARATOR) {
+      ++pattern;
+    }
+  }
+
+  return filter;
+}
+
+void voyeur_filter_destroy(voyeur_filter* filter)
+{
+  for (size_t i = 0 ; i < filter->glob_count ; ++i) {
+    free(filter->globs[i].pattern);
+  }
+  free(filter->globs);
+  free(filter->nodes);
+  free(filter);
+}
+
+int voyeur_filter_match(const voyeur_filter* filter, const char* path)
+{
+  // Walk the trie as far as the path goes, collecting the flags of
+  // every prefix that matches along the way.
+  uint8_t flags = 0;
+  uint32_t node = 0;
+  for (const char* c = path ; *c ; ++c) {
+    uint32_t child = filter->nodes[node].child;
+    while (child && filter->nodes[child].c != *c) {
+      child = filter->nodes[child].sibling;
+    }
+
+    if (!child) {
+      break;
+    }
+
+    node = child;
+    flags |= filter->nodes[node].flags;
+  }
+
+  for (size_t i = 0 ; i < filter->glob_count ; ++i) {
+    if ((filter->globs[i].flags & ~flags) &&
+        fnmatch(filter->globs[i].pattern, path, 0) == 0) {
+      flags |= filter->globs[i].flags;
+    }
+  }
+
+  if (flags & FILTER_EXCLUDE) {
+    return 0;
+  }
+
+  // Include patterns are normally directories, which a relative path
+  // can't be compared with, so relative paths are always included.
+  return !filter->has_includes || (flags & FILTER_INCLUDE) || path[0] != '/';
+}
@@ -0,0 +1,42 @@
+#ifndef VOYEUR_FILTER_H
+#define VOYEUR_FILTER_H
+
+#include <stddef.h>
+
+//////////////////////////////////////////////////
+// Path filters.
+//////////////////////////////////////////////////
+
+// A voyeur_filter decides which paths a hooked process reports. The
+// server encodes the user's include and exclude patterns into
+// LIBVOYEUR_FILTER, and each process compiles them once into a trie of
+// prefixes plus a list of globs, so that rejected events are dropped
+// before they're even serialized.
+
+typedef struct voyeur_filter voyeur_filter;
+
+// The longest encoded filter we'll pass on. It must fit comfortably in
+// one of augment_environment's buffers.
+#define VOYEUR_FILTER_MAX 1024
+
+// Server side.
+
+// Encodes NULL-terminated lists of patterns as the value of
+// LIBVOYEUR_FILTER. Either list may be NULL. Patterns that are empty or
+// contain ':' are skipped. Returns NULL if no patterns are left or they
+// don't fit in VOYEUR_FILTER_MAX; otherwise the caller must free the
+// result.
+char* voyeur_filter_encode(const char* const include[],
+                           const char* const exclude[]);
+
+// Client side.
+
+// Compiles an encoded filter. Returns NULL if 'encoded' is NULL or
+// empty, in which case every path should be reported.
+voyeur_filter* voyeur_filter_create(const char* encoded);
+void voyeur_filter_destroy(voyeur_filter* filter);
+
+// Returns nonzero if 'path' should be reported.
+int voyeur_filter_match(const voyeur_filter* filter, const char* path);
+
+#endif
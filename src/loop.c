@@ -0,0 +1,841 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+// Multishot receives need headers from Linux 6.0 or later.
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+#define HAVE_IO_URING 1
+#endif
+
+#include "loop.h"
+
+typedef enum {
+  LOOP_IO_URING,
+  LOOP_EPOLL,
+  LOOP_SELECT
+} loop_backend;
+
+#ifdef HAVE_IO_URING
+
+// Each request's user_data records what kind of request it is and the
+// descriptor it's for. Descriptors are reused, so it also records a
+// generation number that's bumped whenever a descriptor is removed;
+// completions for an old generation are ignored.
+typedef enum {
+  URING_NONE,
+  URING_POLL,
+  URING_ACCEPT,
+  URING_RECV,
+  URING_CANCEL
+} uring_kind;
+
+typedef struct {
+  uint32_t generation;
+  uint8_t kind;
+} uring_slot;
+
+typedef struct {
+  int ring_fd;
+
+  // The submission queue.
+  void* sq_ring;
+  size_t sq_ring_size;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned sq_local_tail;
+  unsigned to_submit;
+
+  // The completion queue. It shares the submission queue's mapping.
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // Provided buffers for receiving data. Buffers handed out with DATA
+  // events are returned to the kernel at the start of the next wait.
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  char* bufs;
+  uint16_t buf_tail;
+  uint16_t* lent;
+  int lent_count;
+
+  // Per-descriptor state, indexed by descriptor.
+  uring_slot* slots;
+  int slots_capacity;
+} uring_state;
+
+#endif
+
+struct voyeur_loop {
+  loop_backend backend;
+
+  // epoll.
+  int epoll_fd;
+
+  // select.
+  fd_set active_fd_set;
+  int max_fd;
+
+#ifdef HAVE_IO_URING
+  // io_uring.
+  uring_state uring;
+#endif
+};
+
+
+//////////////////////////////////////////////////
+// io_uring backend.
+//////////////////////////////////////////////////
+
+#ifdef HAVE_IO_URING
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUF_COUNT 64
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_BUF_GROUP 0
+
+#define USER_DATA(_kind, _gen, _fd) \
+  (((uint64_t) (_kind) << 56) |     \
+   ((uint64_t) ((_gen) & 0xffffff) << 32) | (uint32_t) (_fd))
+#define USER_DATA_KIND(_data) ((uring_kind) ((_data) >> 56))
+#define USER_DATA_GEN(_data) ((uint32_t) ((_data) >> 32) & 0xffffff)
+#define USER_DATA_FD(_data) ((int) (uint32_t) (_data))
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd,
+                       unsigned to_submit,
+                       unsigned min_complete,
+                       unsigned flags,
+                       void* arg,
+                       size_t argsz)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned nargs)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+// Checks that the kernel supports every operation we use. Zero-copy
+// send isn't used, but it arrived in the same release as multishot
+// receives, which can't be probed for directly.
+static int uring_probe(int ring_fd)
+{
+  static const int required_ops[] = {
+    IORING_OP_POLL_ADD,
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_ASYNC_CANCEL,
+    IORING_OP_SEND_ZC
+  };
+
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, size);
+  if (!probe) {
+    return -1;
+  }
+
+  int result = -1;
+  if (uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+    result = 0;
+    for (size_t i = 0 ; i < sizeof(required_ops) / sizeof(int) ; ++i) {
+      int op = required_ops[i];
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        result = -1;
+      }
+    }
+  }
+
+  free(probe);
+  return result;
+}
+
+static void uring_provide_buffer(uring_state* uring, uint16_t bid)
+{
+  struct io_uring_buf* buf =
+    &uring->buf_ring->bufs[uring->buf_tail & (URING_BUF_COUNT - 1)];
+  buf->addr = (uint64_t) (uintptr_t) (uring->bufs + bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  ++uring->buf_tail;
+}
+
+static void uring_publish_buffers(uring_state* uring)
+{
+  __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_destroy(uring_state* uring)
+{
+  if (uring->ring_fd >= 0) {
+    close(uring->ring_fd);
+  }
+  if (uring->sq_ring && uring->sq_ring != MAP_FAILED) {
+    munmap(uring->sq_ring, uring->sq_ring_size);
+  }
+  if (uring->sqes && uring->sqes != MAP_FAILED) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if (uring->buf_ring && uring->buf_ring != MAP_FAILED) {
+    munmap(uring->buf_ring, uring->buf_ring_size);
+  }
+  free(uring->bufs);
+  free(uring->lent);
+  free(uring->slots);
+}
+
+static int uring_init(uring_state* uring)
+{
+  memset(uring, 0, sizeof(uring_state));
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+  params.cq_entries = URING_CQ_ENTRIES;
+
+  uring->ring_fd = uring_setup(URING_SQ_ENTRIES, &params);
+  if (uring->ring_fd < 0) {
+    return -1;
+  }
+
+  // We rely on a single mapping for both queues, on completions never
+  // being dropped, and on being able to wait with a timeout.
+  unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                      IORING_FEAT_EXT_ARG;
+  if ((params.features & features) != features ||
+      uring_probe(uring->ring_fd) < 0) {
+    goto fail;
+  }
+
+  // Map the queues.
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+  uring->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                        IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) {
+    goto fail;
+  }
+
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                     IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    goto fail;
+  }
+
+  char* ring = (char*) uring->sq_ring;
+  uring->sq_head = (unsigned*) (ring + params.sq_off.head);
+  uring->sq_tail = (unsigned*) (ring + params.sq_off.tail);
+  uring->sq_mask = *(unsigned*) (ring + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned*) (ring + params.sq_off.array);
+  uring->sq_local_tail = *uring->sq_tail;
+  uring->cq_head = (unsigned*) (ring + params.cq_off.head);
+  uring->cq_tail = (unsigned*) (ring + params.cq_off.tail);
+  uring->cq_mask = *(unsigned*) (ring + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+
+  // Set up the provided buffers.
+  uring->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+  uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  uring->bufs = malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+  uring->lent = malloc(URING_BUF_COUNT * sizeof(uint16_t));
+  if (uring->buf_ring == MAP_FAILED || !uring->bufs || !uring->lent) {
+    goto fail;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) uring->buf_ring;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BUF_GROUP;
+  if (uring_register(uring->ring_fd, IORING_REGISTER_PBUF_RING,
+                     &reg, 1) < 0) {
+    goto fail;
+  }
+
+  for (uint16_t bid = 0 ; bid < URING_BUF_COUNT ; ++bid) {
+    uring_provide_buffer(uring, bid);
+  }
+  uring_publish_buffers(uring);
+
+  return 0;
+
+ fail:
+  uring_destroy(uring);
+  return -1;
+}
+
+// Submits everything that's been queued and processes any pending
+// completions. If 'min_complete' is nonzero, also waits for
+// completions, for at most 'timeout_ms' if it's not negative.
+static int uring_submit(uring_state* uring,
+                        unsigned min_complete,
+                        int timeout_ms)
+{
+  unsigned flags = IORING_ENTER_GETEVENTS;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  void* argp = NULL;
+  size_t argsz = 0;
+
+  if (min_complete > 0 && timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+
+  int submitted = uring_enter(uring->ring_fd, uring->to_submit,
+                              min_complete, flags, argp, argsz);
+  if (submitted < 0) {
+    return -1;
+  }
+
+  uring->to_submit -= submitted;
+  return 0;
+}
+
+static struct io_uring_sqe* uring_get_sqe(uring_state* uring)
+{
+  unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  if (uring->sq_local_tail - head > uring->sq_mask) {
+    // The queue is full; flush it.
+    if (uring_submit(uring, 0, 0) < 0) {
+      return NULL;
+    }
+    head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (uring->sq_local_tail - head > uring->sq_mask) {
+      return NULL;
+    }
+  }
+
+  unsigned index = uring->sq_local_tail & uring->sq_mask;
+  struct io_uring_sqe* sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  uring->sq_array[index] = index;
+  return sqe;
+}
+
+static void uring_queue_sqe(uring_state* uring)
+{
+  ++uring->sq_local_tail;
+  ++uring->to_submit;
+  __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static uring_slot* uring_get_slot(uring_state* uring, int fd)
+{
+  if (fd >= uring->slots_capacity) {
+    int capacity = uring->slots_capacity ? uring->slots_capacity : 64;
+    while (capacity <= fd) {
+      capacity *= 2;
+    }
+
+    uring_slot* slots = realloc(uring->slots, capacity * sizeof(uring_slot));
+    if (!slots) {
+      return NULL;
+    }
+
+    memset(slots + uring->slots_capacity, 0,
+           (capacity - uring->slots_capacity) * sizeof(uring_slot));
+    uring->slots = slots;
+    uring->slots_capacity = capacity;
+  }
+
+  return &uring->slots[fd];
+}
+
+// Queues the multishot request that watches 'fd'.
+static int uring_arm(uring_state* uring, int fd)
+{
+  uring_slot* slot = &uring->slots[fd];
+  struct io_uring_sqe* sqe = uring_get_sqe(uring);
+  if (!sqe) {
+    return -1;
+  }
+
+  sqe->fd = fd;
+  sqe->user_data = USER_DATA(slot->kind, slot->generation, fd);
+
+  switch (slot->kind) {
+    case URING_POLL:
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->poll32_events = POLLIN;
+      break;
+
+    case URING_ACCEPT:
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_CLOEXEC;
+      break;
+
+    case URING_RECV:
+      sqe->opcode = IORING_OP_RECV;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = URING_BUF_GROUP;
+      break;
+
+    default:
+      return -1;
+  }
+
+  uring_queue_sqe(uring);
+  return 0;
+}
+
+static int uring_add(uring_state* uring, int fd, uring_kind kind)
+{
+  uring_slot* slot = uring_get_slot(uring, fd);
+  if (!slot) {
+    return -1;
+  }
+
+  slot->kind = kind;
+  return uring_arm(uring, fd);
+}
+
+static void uring_remove(uring_state* uring, int fd)
+{
+  if (fd < 0 || fd >= uring->slots_capacity ||
+      uring->slots[fd].kind == URING_NONE) {
+    return;
+  }
+
+  uring_slot* slot = &uring->slots[fd];
+  struct io_uring_sqe* sqe = uring_get_sqe(uring);
+  if (sqe) {
+    // Cancel by user_data rather than by descriptor, since the caller
+    // is about to close the descriptor.
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = USER_DATA(slot->kind, slot->generation, fd);
+    sqe->user_data = USER_DATA(URING_CANCEL, 0, fd);
+    uring_queue_sqe(uring);
+  }
+
+  slot->kind = URING_NONE;
+  ++slot->generation;
+}
+
+static int uring_wait(uring_state* uring,
+                      voyeur_loop_event* events,
+                      int max,
+                      int timeout_ms)
+{
+  // Give back the buffers from the last batch.
+  for (int i = 0 ; i < uring->lent_count ; ++i) {
+    uring_provide_buffer(uring, uring->lent[i]);
+  }
+  if (uring->lent_count > 0) {
+    uring_publish_buffers(uring);
+    uring->lent_count = 0;
+  }
+
+  // No more buffers than we have can be handed out at once.
+  if (max > URING_BUF_COUNT) {
+    max = URING_BUF_COUNT;
+  }
+
+  // If nothing's ready yet, enter the kernel even when we're not going
+  // to block, so that completions it hasn't posted yet can be found.
+  unsigned head = *uring->cq_head;
+  unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  if (uring->to_submit > 0 || head == tail) {
+    unsigned min_complete = timeout_ms != 0 ? 1 : 0;
+    if (uring_submit(uring, min_complete, timeout_ms) < 0) {
+      if (errno == ETIME) {
+        return 0;
+      }
+      return -1;
+    }
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  }
+
+  int count = 0;
+  for ( ; head != tail && count < max ; ++head) {
+    struct io_uring_cqe* cqe = &uring->cqes[head & uring->cq_mask];
+    uring_kind kind = USER_DATA_KIND(cqe->user_data);
+    int fd = USER_DATA_FD(cqe->user_data);
+
+    // Multishot requests stop when the kernel can't continue them.
+    int rearm = !(cqe->flags & IORING_CQE_F_MORE);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      // Every buffer goes back to the kernel next time, whether or not
+      // the completion is still wanted.
+      uring->lent[uring->lent_count++] =
+        (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+    if (kind == URING_CANCEL ||
+        fd >= uring->slots_capacity ||
+        uring->slots[fd].kind != kind ||
+        uring->slots[fd].generation !=
+          USER_DATA_GEN(cqe->user_data)) {
+      continue;  // This completion is for a descriptor that's been removed.
+    }
+
+    voyeur_loop_event* event = &events[count];
+    memset(event, 0, sizeof(voyeur_loop_event));
+    event->fd = fd;
+
+    switch (kind) {
+      case URING_POLL:
+        event->type = VOYEUR_LOOP_READY;
+        ++count;
+        break;
+
+      case URING_ACCEPT:
+        if (cqe->res >= 0) {
+          event->type = VOYEUR_LOOP_ACCEPTED;
+          event->client = cqe->res;
+          ++count;
+        }
+        break;
+
+      case URING_RECV:
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+          event->type = VOYEUR_LOOP_DATA;
+          event->data = uring->bufs +
+            (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE;
+          event->size = cqe->res;
+          ++count;
+        } else if (cqe->res == -ENOBUFS) {
+          // We ran out of buffers; try again once they've been returned.
+          rearm = 1;
+        } else {
+          event->type = VOYEUR_LOOP_CLOSED;
+          ++count;
+          rearm = 0;
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    if (rearm) {
+      uring_arm(uring, fd);
+    }
+  }
+
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+  return count;
+}
+
+#endif
+
+
+//////////////////////////////////////////////////
+// epoll backend.
+//////////////////////////////////////////////////
+
+#ifdef __linux__
+
+#define EPOLL_BATCH 256
+
+static int epoll_init(voyeur_loop* loop)
+{
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  return loop->epoll_fd < 0 ? -1 : 0;
+}
+
+static int epoll_add(voyeur_loop* loop, int fd)
+{
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void epoll_remove(voyeur_loop* loop, int fd)
+{
+  // Kernels before 2.6.9 require a non-NULL event here.
+  struct epoll_event event;
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, &event);
+}
+
+static int epoll_wait_ready(voyeur_loop* loop,
+                            voyeur_loop_event* events,
+                            int max,
+                            int timeout_ms)
+{
+  struct epoll_event ready[EPOLL_BATCH];
+  if (max > EPOLL_BATCH) {
+    max = EPOLL_BATCH;
+  }
+
+  int count = epoll_wait(loop->epoll_fd, ready, max, timeout_ms);
+  for (int i = 0 ; i < count ; ++i) {
+    // Hangups and errors are reported as input; the subsequent read
+    // will find them.
+    memset(&events[i], 0, sizeof(voyeur_loop_event));
+    events[i].type = VOYEUR_LOOP_READY;
+    events[i].fd = ready[i].data.fd;
+  }
+
+  return count;
+}
+
+#endif
+
+
+//////////////////////////////////////////////////
+// select backend.
+//////////////////////////////////////////////////
+
+static int select_add(voyeur_loop* loop, int fd)
+{
+  if (fd < 0 || fd >= FD_SETSIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  FD_SET(fd, &loop->active_fd_set);
+  if (fd > loop->max_fd) {
+    loop->max_fd = fd;
+  }
+
+  return 0;
+}
+
+static void select_remove(voyeur_loop* loop, int fd)
+{
+  if (fd < 0 || fd >= FD_SETSIZE) {
+    return;
+  }
+
+  FD_CLR(fd, &loop->active_fd_set);
+  while (loop->max_fd >= 0 && !FD_ISSET(loop->max_fd, &loop->active_fd_set)) {
+    --loop->max_fd;
+  }
+}
+
+static int select_wait_ready(voyeur_loop* loop,
+                             voyeur_loop_event* events,
+                             int max,
+                             int timeout_ms)
+{
+  struct timeval timeout;
+  struct timeval* timeout_ptr = NULL;
+  if (timeout_ms >= 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    timeout_ptr = &timeout;
+  }
+
+  fd_set read_fd_set = loop->active_fd_set;
+  fd_set error_fd_set = loop->active_fd_set;
+  if (select(loop->max_fd + 1, &read_fd_set, NULL,
+             &error_fd_set, timeout_ptr) < 0) {
+    return -1;
+  }
+
+  int count = 0;
+  for (int fd = 0 ; fd <= loop->max_fd && count < max ; ++fd) {
+    if (FD_ISSET(fd, &read_fd_set) || FD_ISSET(fd, &error_fd_set)) {
+      memset(&events[count], 0, sizeof(voyeur_loop_event));
+      events[count].type = VOYEUR_LOOP_READY;
+      events[count].fd = fd;
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+
+//////////////////////////////////////////////////
+// Public API.
+//////////////////////////////////////////////////
+
+voyeur_loop* voyeur_loop_create(int allow_io_uring)
+{
+  voyeur_loop* loop = calloc(1, sizeof(voyeur_loop));
+  if (!loop) {
+    return NULL;
+  }
+
+  loop->epoll_fd = -1;
+  loop->max_fd = -1;
+  FD_ZERO(&loop->active_fd_set);
+
+#ifdef HAVE_IO_URING
+  loop->uring.ring_fd = -1;
+  if (allow_io_uring && uring_init(&loop->uring) == 0) {
+    loop->backend = LOOP_IO_URING;
+    return loop;
+  }
+#endif
+
+#ifdef __linux__
+  if (epoll_init(loop) == 0) {
+    loop->backend = LOOP_EPOLL;
+    return loop;
+  }
+#endif
+
+  loop->backend = LOOP_SELECT;
+  return loop;
+}
+
+void voyeur_loop_destroy(voyeur_loop* loop)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING) {
+    uring_destroy(&loop->uring);
+  }
+#endif
+
+  if (loop->epoll_fd >= 0) {
+    close(loop->epoll_fd);
+  }
+
+  free(loop);
+}
+
+int voyeur_loop_add(voyeur_loop* loop, int fd)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING) {
+    return uring_add(&loop->uring, fd, URING_POLL);
+  }
+#endif
+
+#ifdef __linux__
+  if (loop->backend == LOOP_EPOLL) {
+    return epoll_add(loop, fd);
+  }
+#endif
+
+  return select_add(loop, fd);
+}
+
+int voyeur_loop_add_listener(voyeur_loop* loop, int fd)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING) {
+    return uring_add(&loop->uring, fd, URING_ACCEPT);
+  }
+#endif
+
+  return voyeur_loop_add(loop, fd);
+}
+
+int voyeur_loop_add_stream(voyeur_loop* loop, int fd)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING) {
+    return uring_add(&loop->uring, fd, URING_RECV);
+  }
+#endif
+
+  return voyeur_loop_add(loop, fd);
+}
+
+int voyeur_loop_fd(voyeur_loop* loop)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING) {
+    return loop->uring.ring_fd;
+  }
+#endif
+
+  // This is -1 for the select backend.
+  return loop->epoll_fd;
+}
+
+void voyeur_loop_flush(voyeur_loop* loop)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING && loop->uring.to_submit > 0) {
+    uring_submit(&loop->uring, 0, 0);
+  }
+#endif
+}
+
+void voyeur_loop_remove(voyeur_loop* loop, int fd)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING) {
+    uring_remove(&loop->uring, fd);
+    return;
+  }
+#endif
+
+#ifdef __linux__
+  if (loop->backend == LOOP_EPOLL) {
+    epoll_remove(loop, fd);
+    return;
+  }
+#endif
+
+  select_remove(loop, fd);
+}
+
+int voyeur_loop_wait(voyeur_loop* loop,
+                     voyeur_loop_event* events,
+                     int max,
+                     int timeout_ms)
+{
+#ifdef HAVE_IO_URING
+  if (loop->backend == LOOP_IO_URING) {
+    return uring_wait(&loop->uring, events, max, timeout_ms);
+  }
+#endif
+
+#ifdef __linux__
+  if (loop->backend == LOOP_EPOLL) {
+    return epoll_wait_ready(loop, events, max, timeout_ms);
+  }
+#endif
+
+  return select_wait_ready(loop, events, max, timeout_ms);
+}
@@ -0,0 +1,83 @@
+#ifndef VOYEUR_LOOP_H
+#define VOYEUR_LOOP_H
+
+#include <stddef.h>
+
+//////////////////////////////////////////////////
+// Waiting for input on many file descriptors.
+//////////////////////////////////////////////////
+
+// A voyeur_loop watches a set of file descriptors for input. There are
+// three backends:
+//
+//  - io_uring, used on Linux 6.0 or later unless it's disabled. The
+//    loop accepts connections and receives data itself, using
+//    multishot requests and a ring of provided buffers, so taking in
+//    events needs very few system calls.
+//  - epoll, used on other Linux systems. The cost of a wakeup depends
+//    on the number of descriptors that are ready rather than the
+//    number being watched.
+//  - select, used everywhere else. It can only watch descriptors below
+//    FD_SETSIZE.
+//
+// Callers should be prepared for any kind of event, since they can't
+// tell in advance which backend they'll get.
+
+typedef struct voyeur_loop voyeur_loop;
+
+typedef enum {
+  VOYEUR_LOOP_READY,     // 'fd' is readable, at end-of-file, or has an error.
+  VOYEUR_LOOP_ACCEPTED,  // Listener 'fd' accepted connection 'client'.
+  VOYEUR_LOOP_DATA,      // 'size' bytes at 'data' were received on 'fd'.
+  VOYEUR_LOOP_CLOSED     // 'fd' reached end-of-file or had an error.
+} voyeur_loop_event_type;
+
+typedef struct {
+  voyeur_loop_event_type type;
+  int fd;
+  int client;
+  const char* data;
+  size_t size;
+} voyeur_loop_event;
+
+// Returns NULL on failure. If 'allow_io_uring' is false, io_uring won't
+// be used even if it's available.
+voyeur_loop* voyeur_loop_create(int allow_io_uring);
+void voyeur_loop_destroy(voyeur_loop* loop);
+
+// Starts watching 'fd'. Returns -1 on failure.
+//
+// voyeur_loop_add reports only READY events.
+// voyeur_loop_add_listener reports READY or ACCEPTED events; after a
+// READY event, the caller should accept a connection itself.
+// voyeur_loop_add_stream reports READY events or DATA and CLOSED
+// events; after a READY event, the caller should read from 'fd' itself.
+int voyeur_loop_add(voyeur_loop* loop, int fd);
+int voyeur_loop_add_listener(voyeur_loop* loop, int fd);
+int voyeur_loop_add_stream(voyeur_loop* loop, int fd);
+
+// Returns a descriptor that becomes readable whenever
+// voyeur_loop_wait has events to report, so the loop can itself be
+// watched by another event loop. Returns -1 if the backend doesn't
+// provide one.
+int voyeur_loop_fd(voyeur_loop* loop);
+
+// Some backends queue up changes and apply them on the next call to
+// voyeur_loop_wait. If you're going to wait on voyeur_loop_fd instead,
+// call this first.
+void voyeur_loop_flush(voyeur_loop* loop);
+
+// Stops watching 'fd'. Remove 'fd' before closing it.
+void voyeur_loop_remove(voyeur_loop* loop, int fd);
+
+// Blocks until at least one event is available or until 'timeout_ms'
+// milliseconds have passed. A negative timeout waits forever. Stores up
+// to 'max' events in 'events' and returns how many there were, or -1 on
+// error with errno set. The data for DATA events remains valid until
+// the next call to voyeur_loop_wait.
+int voyeur_loop_wait(voyeur_loop* loop,
+                     voyeur_loop_event* events,
+                     int max,
+                     int timeout_ms);
+
+#endif
@@ -4,6 +4,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,79 +19,199 @@
 #include <bsd/bsd.h>
 #endif
 
+#include "env.h"
 #include "net.h"
 #include "util.h"
 
-int voyeur_create_server_socket(struct sockaddr_un* sockinfo)
+// The kernel caps this at its own limit (net.core.somaxconn on Linux),
+// so this just asks for as much as we're allowed. A deep backlog lets a
+// burst of new processes connect without waiting for the server.
+#define LISTEN_BACKLOG 65535
+
+// Fills in 'addr' for 'sockpath' and returns the length of the address.
+// A leading '@' stands for the null byte that begins a name in Linux's
+// abstract namespace, since the environment can't carry one.
+static socklen_t socket_address(const char* sockpath, struct sockaddr_un* addr)
+{
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+
+  if (sockpath[0] == '@') {
+    size_t len = strlcpy(addr->sun_path + 1, sockpath + 1,
+                         sizeof(addr->sun_path) - 1);
+    if (len > sizeof(addr->sun_path) - 2) {
+      len = sizeof(addr->sun_path) - 2;
+    }
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+  }
+
+  strlcpy(addr->sun_path, sockpath, sizeof(addr->sun_path));
+  return sizeof(struct sockaddr_un);
+}
+
+int voyeur_create_server_socket(char* sockpath, size_t size)
 {
+  int server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server_sock < 0) {
+    return -1;
+  }
+
+  struct sockaddr_un sockinfo;
+
+#ifdef __linux__
+
+  // Binding an address with no name asks the kernel to pick an unused
+  // one in the abstract namespace. Nothing touches the filesystem, and
+  // the name disappears along with the socket.
+  memset(&sockinfo, 0, sizeof(struct sockaddr_un));
+  sockinfo.sun_family = AF_UNIX;
+  RETURN_ERROR_ON_FAIL(bind, server_sock, (struct sockaddr*) &sockinfo,
+                                          sizeof(sa_family_t));
+
+  socklen_t socklen = sizeof(struct sockaddr_un);
+  RETURN_ERROR_ON_FAIL(getsockname, server_sock,
+                       (struct sockaddr*) &sockinfo, &socklen);
+
+  size_t namelen = socklen - offsetof(struct sockaddr_un, sun_path) - 1;
+  if (namelen + 2 > size) {
+    voyeur_close_socket(server_sock);
+    return -1;
+  }
+
+  sockpath[0] = '@';
+  memcpy(sockpath + 1, sockinfo.sun_path + 1, namelen);
+  sockpath[namelen + 1] = '\0';
+
+#else
+
   // Configure a unix domain socket at a temporary path.
   char sockdir[] = "/tmp/libvoyeur-XXXXXXXXX";
-  mkdtemp(sockdir);
-  
-  memset(sockinfo, 0, sizeof(struct sockaddr_un));
-  sockinfo->sun_family = AF_UNIX;
-  strlcpy(sockinfo->sun_path, sockdir, sizeof(sockinfo->sun_path));
-  strlcat(sockinfo->sun_path, "/socket", sizeof(sockinfo->sun_path));
-  unlink(sockinfo->sun_path);
+  if (!mkdtemp(sockdir)) {
+    voyeur_close_socket(server_sock);
+    return -1;
+  }
 
-  // Start the server.
-  int server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  RETURN_ERROR_ON_FAIL(bind, server_sock, (struct sockaddr*) sockinfo,
-                                          sizeof(struct sockaddr_un));
-  RETURN_ERROR_ON_FAIL(listen, server_sock, 200);
+  strlcpy(sockpath, sockdir, size);
+  strlcat(sockpath, "/socket", size);
 
-  //chmod(sockinfo->sun_path, 0777);
-  //fchmod(server_sock, 0777);
+  socklen_t socklen = socket_address(sockpath, &sockinfo);
+  RETURN_ERROR_ON_FAIL(bind, server_sock, (struct sockaddr*) &sockinfo,
+                                          socklen);
 
+#endif
+
+  RETURN_ERROR_ON_FAIL(listen, server_sock, LISTEN_BACKLOG);
+
+  // The server accepts connections until none are left, so it needs to
+  // find out when that happens without blocking.
   fcntl(server_sock, F_SETFD, FD_CLOEXEC);
+  fcntl(server_sock, F_SETFL, O_NONBLOCK);
   return server_sock;
 }
 
-#define CONNECT_RETRIES 20
-#define CONNECT_WAIT_MS 50
-#define CONNECT_DEVIATION_MS 20
+void voyeur_destroy_server_socket(int fd, char* sockpath)
+{
+  voyeur_close_socket(fd);
+
+  // Abstract names go away with the socket; anything else is a file in
+  // a directory of its own.
+  if (sockpath[0] == '@' || sockpath[0] == '\0') {
+    return;
+  }
+
+  if (unlink(sockpath) < 0) {
+    perror("unlink");
+  }
 
-int voyeur_create_client_socket(const char* sockpath)
+  char* last_slash = strrchr(sockpath, '/');
+  if (last_slash) {
+    *last_slash = '\0';
+    if (rmdir(sockpath) < 0) {
+      perror("rmdir");
+    }
+  }
+}
+
+int voyeur_create_client_socket(const char* sockpath, int job, char wait)
 {
   struct sockaddr_un sockinfo;
-
-  memset(&sockinfo, 0, sizeof(struct sockaddr_un));
-  sockinfo.sun_family = AF_UNIX;
-  strlcpy(sockinfo.sun_path, sockpath, sizeof(sockinfo.sun_path));
+  socklen_t socklen = socket_address(sockpath, &sockinfo);
 
   // Connect to the server.
   int client_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  int set = 1;
+  if (client_sock < 0) {
+    return -1;
+  }
+
+  fcntl(client_sock, F_SETFD, FD_CLOEXEC);
 
 #ifdef __APPLE__
+  int set = 1;
   setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
 #endif
 
-  unsigned try = 0;
-  int connect_status = connect(client_sock,
-                               (struct sockaddr*) &sockinfo,
-                               sizeof(struct sockaddr_un));
-  
-  while (connect_status < 0 && ++try < CONNECT_RETRIES) {
-    usleep(((CONNECT_WAIT_MS - CONNECT_DEVIATION_MS / 2) +
-            arc4random_uniform(CONNECT_DEVIATION_MS)) * 1000);
+  // A non-blocking connect fails with EAGAIN instead of waiting when the
+  // server's backlog is full.
+  if (!wait) {
+    fcntl(client_sock, F_SETFL, O_NONBLOCK);
+  }
+
+  int connect_status;
+  do {
     connect_status = connect(client_sock,
                              (struct sockaddr*) &sockinfo,
-                             sizeof(struct sockaddr_un));
+                             socklen);
+  } while (connect_status < 0 && errno == EINTR);
+
+  if (connect_status < 0) {
+    int connect_errno = errno;
+    voyeur_close_socket(client_sock);
+    errno = connect_errno;
+    return -1;
   }
 
-  fcntl(client_sock, F_SETFD, FD_CLOEXEC);
+  if (!wait) {
+    fcntl(client_sock, F_SETFL, 0);
+  }
+
+  voyeur_write_hello(client_sock, job, getpid());
+
   return client_sock;
 }
 
+int voyeur_send_once(voyeur_buf* buf, char keep)
+{
+  int sock = voyeur_create_client_socket(getenv("LIBVOYEUR_SOCKET"),
+                                         voyeur_environment_job(), 1);
+  if (sock >= 0 && keep) {
+    voyeur_buf_send(sock, buf);
+    return sock;
+  } else if (sock >= 0) {
+    voyeur_buf_begin_msg(buf, VOYEUR_MSG_DONE);
+    voyeur_buf_send(sock, buf);
+    voyeur_close_socket(sock);
+  }
+
+  return -1;
+}
+
+static __thread char closing_socket = 0;
+
 void voyeur_close_socket(int fd)
 {
+  closing_socket = 1;
   while (close(fd) < 0) {
     if (errno != EINTR) {
       // We really only want to keep spinning for EINTR.
       break;
     }
   }
+  closing_socket = 0;
+}
+
+int voyeur_closing_socket()
+{
+  return closing_socket;
 }
 
 #ifdef __linux__
@@ -149,105 +272,1105 @@ static int do_read(int fd, void* buf, size_t buf_size)
   return 0;
 }
   
-int voyeur_write_msg_type(int fd, voyeur_msg_type val)
+//////////////////////////////////////////////////
+// Unbuffered serialization.
+//////////////////////////////////////////////////
+
+int voyeur_write_int(int fd, int val)
 {
-  return do_write(fd, (void*) &val, sizeof(voyeur_msg_type));
+  // This is used with pipes, which send() doesn't support.
+  ssize_t out;
+  do {
+    out = write(fd, (void*) &val, sizeof(int));
+  } while (out < 0 && errno == EINTR);
+
+  return out == sizeof(int) ? 0 : -1;
 }
 
-int voyeur_read_msg_type(int fd, voyeur_msg_type* val)
+int voyeur_read_int(int fd, int* val)
 {
-  return do_read(fd, (void*) val, sizeof(voyeur_msg_type));
+  return do_read(fd, (void*) val, sizeof(int));
 }
 
-int voyeur_write_event_type(int fd, voyeur_event_type val)
+
+//////////////////////////////////////////////////
+// Buffered serialization.
+//////////////////////////////////////////////////
+
+// Every frame starts with the size of its payload, stored in
+// little-endian order.
+typedef uint32_t frame_header;
+
+static void put_frame_header(char* data, frame_header header)
 {
-  return do_write(fd, (void*) &val, sizeof(voyeur_event_type));
+  unsigned char* bytes = (unsigned char*) data;
+  bytes[0] = header;
+  bytes[1] = header >> 8;
+  bytes[2] = header >> 16;
+  bytes[3] = header >> 24;
 }
 
-int voyeur_read_event_type(int fd, voyeur_event_type* val)
+static frame_header get_frame_header(const char* data)
 {
-  return do_read(fd, (void*) val, sizeof(voyeur_event_type));
+  const unsigned char* bytes = (const unsigned char*) data;
+  return (frame_header) bytes[0] |
+         (frame_header) bytes[1] << 8 |
+         (frame_header) bytes[2] << 16 |
+         (frame_header) bytes[3] << 24;
 }
 
-int voyeur_write_byte(int fd, char val)
+// An upper bound on the size of a frame we're willing to receive, to
+// protect against garbage on the wire.
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+void voyeur_buf_init(voyeur_buf* buf)
 {
-  return do_write(fd, (void*) &val, sizeof(char));
+  buf->data = buf->inline_data;
+  buf->size = 0;
+  buf->capacity = VOYEUR_BUF_INLINE_SIZE;
+  buf->pos = 0;
+  buf->fixed = 0;
 }
 
-int voyeur_read_byte(int fd, char* val)
+void voyeur_buf_init_fixed(voyeur_buf* buf, char* data, size_t capacity)
 {
-  return do_read(fd, (void*) val, sizeof(char));
+  buf->data = data;
+  buf->size = 0;
+  buf->capacity = capacity;
+  buf->pos = 0;
+  buf->fixed = 1;
 }
 
-int voyeur_write_int(int fd, int val)
+void voyeur_buf_destroy(voyeur_buf* buf)
 {
-  return do_write(fd, (void*) &val, sizeof(int));
+  if (buf->data != buf->inline_data && buf->capacity > 0 && !buf->fixed) {
+    free(buf->data);
+  }
+
+  voyeur_buf_init(buf);
 }
 
-int voyeur_read_int(int fd, int* val)
+static int buf_reserve(voyeur_buf* buf, size_t size)
 {
-  return do_read(fd, (void*) val, sizeof(int));
+  if (buf->size + size <= buf->capacity) {
+    return 0;
+  }
+
+  size_t capacity = buf->capacity * 2;
+  while (capacity < buf->size + size) {
+    capacity *= 2;
+  }
+
+  char* data;
+  if (buf->capacity == 0) {
+    return -1;  // Borrowed buffers are read-only.
+  } else if (buf->fixed) {
+    return -1;
+  } else if (buf->data == buf->inline_data) {
+    data = malloc(capacity);
+    if (data) {
+      memcpy(data, buf->data, buf->size);
+    }
+  } else {
+    data = realloc(buf->data, capacity);
+  }
+
+  if (!data) {
+    return -1;
+  }
+
+  buf->data = data;
+  buf->capacity = capacity;
+  return 0;
 }
 
-int voyeur_write_size(int fd, size_t val)
+static int buf_write(voyeur_buf* buf, const void* val, size_t size)
 {
-  return do_write(fd, (void*) &val, sizeof(size_t));
+  if (buf_reserve(buf, size) < 0) {
+    return -1;
+  }
+
+  memcpy(buf->data + buf->size, val, size);
+  buf->size += size;
+  return 0;
 }
 
-int voyeur_read_size(int fd, size_t* val)
+static int buf_read(voyeur_buf* buf, void* val, size_t size)
 {
-  return do_read(fd, (void*) val, sizeof(size_t));
+  if (buf->size - buf->pos < size) {
+    return -1;
+  }
+
+  memcpy(val, buf->data + buf->pos, size);
+  buf->pos += size;
+  return 0;
 }
 
-int voyeur_write_pid(int fd, pid_t val)
+// The longest LEB128 encoding of a 64-bit value.
+#define MAX_VARINT_SIZE 10
+
+static int buf_write_varint(voyeur_buf* buf, uint64_t val)
 {
-  return do_write(fd, (void*) &val, sizeof(pid_t));
+  unsigned char bytes[MAX_VARINT_SIZE];
+  size_t size = 0;
+  do {
+    bytes[size] = val & 0x7f;
+    val >>= 7;
+    if (val) {
+      bytes[size] |= 0x80;
+    }
+    ++size;
+  } while (val);
+
+  return buf_write(buf, bytes, size);
+}
+
+static int buf_read_varint(voyeur_buf* buf, uint64_t* val)
+{
+  uint64_t result = 0;
+  for (int shift = 0 ; shift < 64 ; shift += 7) {
+    if (buf->pos >= buf->size) {
+      return -1;
+    }
+
+    unsigned char byte = buf->data[buf->pos++];
+    result |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *val = result;
+      return 0;
+    }
+  }
+
+  return -1;
 }
 
-int voyeur_read_pid(int fd, pid_t* val)
+static int buf_read_varint32(voyeur_buf* buf, uint32_t* val)
 {
-  return do_read(fd, (void*) val, sizeof(pid_t));
+  uint64_t result;
+  if (buf_read_varint(buf, &result) < 0 || result > UINT32_MAX) {
+    return -1;
+  }
+
+  *val = (uint32_t) result;
+  return 0;
 }
 
-int voyeur_write_string(int fd, const char* val, size_t len)
+void voyeur_buf_finish(voyeur_buf* buf)
+{
+  if (buf->size > buf->pos) {
+    put_frame_header(buf->data + buf->pos,
+                     buf->size - buf->pos - sizeof(frame_header));
+  }
+}
+
+int voyeur_buf_begin_msg(voyeur_buf* buf, voyeur_msg_type val)
+{
+  voyeur_buf_finish(buf);
+  buf->pos = buf->size;
+
+  // Reserve space for the header; it's filled in when the frame is finished.
+  frame_header header = 0;
+  if (buf_write(buf, &header, sizeof(frame_header)) < 0) {
+    return -1;
+  }
+
+  return voyeur_buf_write_byte(buf, (char) val);
+}
+
+int voyeur_buf_send(int fd, voyeur_buf* buf)
+{
+  voyeur_buf_finish(buf);
+  return do_write(fd, buf->data, buf->size);
+}
+
+ssize_t voyeur_buf_parse(voyeur_buf* buf, const char* data, size_t size)
+{
+  if (size < sizeof(frame_header)) {
+    return 0;
+  }
+
+  frame_header header = get_frame_header(data);
+  if (header > MAX_FRAME_SIZE) {
+    SHOULD_NOT_REACH("libvoyeur: frame of size %u is too large\n",
+                     (unsigned) header);
+    return -1;
+  }
+
+  if (size - sizeof(frame_header) < header) {
+    return 0;
+  }
+
+  buf->data = (char*) data + sizeof(frame_header);
+  buf->size = header;
+  buf->capacity = 0;
+  buf->pos = 0;
+  buf->fixed = 0;
+  return sizeof(frame_header) + header;
+}
+
+int voyeur_write_done(int fd)
+{
+  voyeur_buf buf;
+  voyeur_buf_init(&buf);
+  voyeur_buf_begin_msg(&buf, VOYEUR_MSG_DONE);
+  int retval = voyeur_buf_send(fd, &buf);
+  voyeur_buf_destroy(&buf);
+  return retval;
+}
+
+int voyeur_write_hello(int fd, int job, pid_t pid)
+{
+  voyeur_buf buf;
+  voyeur_buf_init(&buf);
+  voyeur_buf_begin_msg(&buf, VOYEUR_MSG_HELLO);
+  voyeur_buf_write_size(&buf, VOYEUR_PROTOCOL_VERSION);
+  voyeur_buf_write_int(&buf, job);
+  voyeur_buf_write_pid(&buf, pid);
+  int retval = voyeur_buf_send(fd, &buf);
+  voyeur_buf_destroy(&buf);
+  return retval;
+}
+
+int voyeur_buf_read_msg_type(voyeur_buf* buf, voyeur_msg_type* val)
+{
+  unsigned char byte;
+  if (buf_read(buf, (void*) &byte, sizeof(byte)) < 0) {
+    return -1;
+  }
+
+  *val = (voyeur_msg_type) byte;
+  return 0;
+}
+
+int voyeur_buf_write_event_type(voyeur_buf* buf, voyeur_event_type val)
+{
+  return voyeur_buf_write_byte(buf, (char) val);
+}
+
+int voyeur_buf_read_event_type(voyeur_buf* buf, voyeur_event_type* val)
+{
+  unsigned char byte;
+  if (buf_read(buf, (void*) &byte, sizeof(byte)) < 0) {
+    return -1;
+  }
+
+  *val = (voyeur_event_type) byte;
+  return 0;
+}
+
+int voyeur_buf_write_byte(voyeur_buf* buf, char val)
+{
+  return buf_write(buf, (void*) &val, sizeof(char));
+}
+
+int voyeur_buf_read_byte(voyeur_buf* buf, char* val)
+{
+  return buf_read(buf, (void*) val, sizeof(char));
+}
+
+int voyeur_buf_write_int(voyeur_buf* buf, int val)
+{
+  // Zigzag encoding interleaves negative and positive values, so -1
+  // takes a single byte rather than five.
+  uint32_t bits = (uint32_t) val;
+  return buf_write_varint(buf, (bits << 1) ^ (0 - (bits >> 31)));
+}
+
+int voyeur_buf_read_int(voyeur_buf* buf, int* val)
+{
+  uint32_t bits;
+  if (buf_read_varint32(buf, &bits) < 0) {
+    return -1;
+  }
+
+  *val = (int) ((bits >> 1) ^ (0 - (bits & 1)));
+  return 0;
+}
+
+int voyeur_buf_write_size(voyeur_buf* buf, size_t val)
+{
+  return buf_write_varint(buf, (uint64_t) val);
+}
+
+int voyeur_buf_read_size(voyeur_buf* buf, size_t* val)
+{
+  uint64_t result;
+  if (buf_read_varint(buf, &result) < 0 || result > SIZE_MAX) {
+    return -1;
+  }
+
+  *val = (size_t) result;
+  return 0;
+}
+
+int voyeur_buf_write_pid(voyeur_buf* buf, pid_t val)
+{
+  return buf_write_varint(buf, (uint32_t) val);
+}
+
+int voyeur_buf_read_pid(voyeur_buf* buf, pid_t* val)
+{
+  uint32_t bits;
+  if (buf_read_varint32(buf, &bits) < 0) {
+    return -1;
+  }
+
+  *val = (pid_t) bits;
+  return 0;
+}
+
+int voyeur_buf_write_string(voyeur_buf* buf, const char* val, size_t len)
 {
   if (val == NULL) {
+    val = "";
     len = 0;
   } else if (len == 0) {
     len = strnlen(val, VOYEUR_MAX_STRLEN);
   }
 
-  if (voyeur_write_size(fd, len) < 0) {
+  if (voyeur_buf_write_size(buf, len) < 0 ||
+      buf_reserve(buf, len + 1) < 0) {
     return -1;
   }
-  
-  return do_write(fd, (void*) val, len);
+
+  // Include a null terminator so readers can use the string in place.
+  memcpy(buf->data + buf->size, val, len);
+  buf->data[buf->size + len] = '\0';
+  buf->size += len + 1;
+  return 0;
 }
 
-int voyeur_read_string(int fd, char** val, size_t maxlen)
+int voyeur_buf_read_string(voyeur_buf* buf, const char** val)
 {
   size_t len;
-  if (voyeur_read_size(fd, &len) < 0) {
+  if (voyeur_buf_read_size(buf, &len) < 0) {
     return -1;
   }
 
-  if (maxlen == 0) {
-    *val = malloc(len + 1);
-  } else if (maxlen <= len) {
-    SHOULD_NOT_REACH("libvoyeur: string buffer of size %zu "
-                     "is too small for string of length %zu\n",
-                     maxlen,
-                     len);
+  if (len >= buf->size - buf->pos || buf->data[buf->pos + len] != '\0') {
+    SHOULD_NOT_REACH("libvoyeur: malformed string of length %zu\n", len);
     return -1;
   }
-  
-  if (do_read(fd, (void*) *val, len) < 0) {
-    if (maxlen == 0) {
-      free(*val);
+
+  *val = buf->data + buf->pos;
+  buf->pos += len + 1;
+  return 0;
+}
+
+//////////////////////////////////////////////////
+// Interned strings.
+//////////////////////////////////////////////////
+
+int voyeur_buf_write_interned(voyeur_buf* buf,
+                              size_t id,
+                              const char* val,
+                              size_t len)
+{
+  // Id 0 means the string follows.
+  if (voyeur_buf_write_size(buf, id) < 0) {
+    return -1;
+  }
+
+  return id == 0 ? voyeur_buf_write_string(buf, val, len) : 0;
+}
+
+// The table is stored in chunks that double in size, so it can grow
+// without moving the strings that worker threads may be reading.
+#define STRING_CHUNK_SIZE 16
+#define STRING_CHUNKS 13
+
+struct voyeur_string_table {
+  int refs;
+  size_t count;
+  char** chunks[STRING_CHUNKS];
+};
+
+voyeur_string_table* voyeur_string_table_create()
+{
+  voyeur_string_table* table = calloc(1, sizeof(voyeur_string_table));
+  if (table) {
+    table->refs = 1;
+  }
+  return table;
+}
+
+void voyeur_string_table_retain(voyeur_string_table* table)
+{
+  __atomic_fetch_add(&table->refs, 1, __ATOMIC_RELAXED);
+}
+
+void voyeur_string_table_release(voyeur_string_table* table)
+{
+  if (__atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
+  size_t size = STRING_CHUNK_SIZE;
+  size_t left = table->count;
+  for (int i = 0 ; i < STRING_CHUNKS && table->chunks[i] ; ++i) {
+    for (size_t j = 0 ; j < size && j < left ; ++j) {
+      free(table->chunks[i][j]);
+    }
+    left = left > size ? left - size : 0;
+    free(table->chunks[i]);
+    size *= 2;
+  }
+
+  free(table);
+}
+
+// Returns the slot for the string with the given index, allocating its
+// chunk if 'create' is set, or NULL.
+static char** string_slot(voyeur_string_table* table, size_t index, char create)
+{
+  size_t first = 0;
+  size_t size = STRING_CHUNK_SIZE;
+  int chunk = 0;
+  while (index >= first + size) {
+    first += size;
+    size *= 2;
+    if (++chunk == STRING_CHUNKS) {
+      return NULL;
+    }
+  }
+
+  if (!table->chunks[chunk]) {
+    if (!create) {
+      return NULL;
+    }
+    table->chunks[chunk] = calloc(size, sizeof(char*));
+    if (!table->chunks[chunk]) {
+      return NULL;
     }
+  }
+
+  return &table->chunks[chunk][index - first];
+}
+
+int voyeur_string_table_define(voyeur_string_table* table, voyeur_buf* buf)
+{
+  size_t id;
+  const char* val;
+  if (voyeur_buf_read_size(buf, &id) < 0 ||
+      voyeur_buf_read_string(buf, &val) < 0 ||
+      id != table->count + 1 ||
+      id > VOYEUR_MAX_INTERNED) {
+    return -1;
+  }
+
+  char** slot = string_slot(table, id - 1, 1);
+  if (!slot || !(*slot = strdup(val))) {
+    return -1;
+  }
+
+  // Events referring to the string are handed to workers later, so
+  // they'll see it.
+  __atomic_store_n(&table->count, id, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int voyeur_buf_read_interned(voyeur_buf* buf,
+                             voyeur_string_table* table,
+                             const char** val)
+{
+  size_t id;
+  if (voyeur_buf_read_size(buf, &id) < 0) {
+    return -1;
+  }
+
+  if (id == 0) {
+    return voyeur_buf_read_string(buf, val);
+  }
+
+  if (!table || id > __atomic_load_n(&table->count, __ATOMIC_ACQUIRE)) {
+    SHOULD_NOT_REACH("libvoyeur: unknown string id %zu\n", id);
+    return -1;
+  }
+
+  *val = *string_slot(table, id - 1, 0);
+  return 0;
+}
+
+//////////////////////////////////////////////////
+// Buffered receiving.
+//////////////////////////////////////////////////
+
+#define RECV_BUF_INITIAL_SIZE (64 * 1024)
+
+void voyeur_recv_buf_init(voyeur_recv_buf* buf)
+{
+  buf->data = NULL;
+  buf->start = 0;
+  buf->end = 0;
+  buf->capacity = 0;
+}
+
+void voyeur_recv_buf_destroy(voyeur_recv_buf* buf)
+{
+  free(buf->data);
+  voyeur_recv_buf_init(buf);
+}
+
+// Make room for at least 'size' more bytes after the data that's
+// already in the buffer.
+static int recv_buf_reserve(voyeur_recv_buf* buf, size_t size)
+{
+  // Discard the data that's already been parsed.
+  if (buf->start > 0) {
+    memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+    buf->end -= buf->start;
+    buf->start = 0;
+  }
+
+  if (buf->end + size <= buf->capacity) {
+    return 0;
+  }
+
+  size_t capacity = buf->capacity ? buf->capacity : RECV_BUF_INITIAL_SIZE;
+  while (capacity < buf->end + size) {
+    capacity *= 2;
+  }
+
+  char* data = realloc(buf->data, capacity);
+  if (!data) {
     return -1;
   }
 
-  (*val)[len] = '\0';
+  buf->data = data;
+  buf->capacity = capacity;
   return 0;
 }
+
+// Returns the number of bytes needed to hold the message at the start
+// of the buffer. This is all the state the parser needs to resume: if
+// the header hasn't arrived yet only its size is known, and otherwise
+// we know exactly how much of the payload is still missing.
+static size_t recv_buf_needed(voyeur_recv_buf* buf)
+{
+  if (buf->end - buf->start < sizeof(frame_header)) {
+    return sizeof(frame_header);
+  }
+
+  return sizeof(frame_header) + get_frame_header(buf->data + buf->start);
+}
+
+ssize_t voyeur_recv_buf_fill(int fd, voyeur_recv_buf* buf)
+{
+  // Always leave room for at least the rest of the current message, so
+  // large messages don't have to trickle in a little at a time.
+  size_t needed = recv_buf_needed(buf);
+  size_t available = buf->end - buf->start;
+  size_t want = needed > available ? needed - available : 0;
+  if (want < RECV_BUF_INITIAL_SIZE / 2) {
+    want = RECV_BUF_INITIAL_SIZE / 2;
+  }
+
+  if (needed > MAX_FRAME_SIZE + sizeof(frame_header) ||
+      recv_buf_reserve(buf, want) < 0) {
+    return -1;
+  }
+
+  while (1) {
+    ssize_t in = read(fd, buf->data + buf->end, buf->capacity - buf->end);
+    if (in < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (in > 0) {
+      buf->end += in;
+    }
+
+    return in;
+  }
+}
+
+int voyeur_recv_buf_append(voyeur_recv_buf* buf,
+                           const char* data,
+                           size_t size)
+{
+  if (recv_buf_needed(buf) > MAX_FRAME_SIZE + sizeof(frame_header) ||
+      recv_buf_reserve(buf, size) < 0) {
+    return -1;
+  }
+
+  memcpy(buf->data + buf->end, data, size);
+  buf->end += size;
+  return 0;
+}
+
+int voyeur_recv_buf_empty(voyeur_recv_buf* buf)
+{
+  return buf->start == buf->end;
+}
+
+int voyeur_recv_buf_next(voyeur_recv_buf* buf, voyeur_buf* msg)
+{
+  ssize_t used = voyeur_buf_parse(msg,
+                                  buf->data + buf->start,
+                                  buf->end - buf->start);
+  if (used <= 0) {
+    return (int) used;
+  }
+
+  buf->start += used;
+  return 1;
+}
+
+
+//////////////////////////////////////////////////
+// The process's connection.
+//////////////////////////////////////////////////
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pid_t pid;          // The process that owns 'fd'.
+  int fd;
+  char closed;        // Set once the process has said it's done.
+  char atfork;        // Set once the fork handlers are registered.
+  voyeur_buf spill;   // Messages waiting for a connection.
+
+  // The strings interned on the connection, in an open-addressed hash
+  // table.
+  struct interned_string* interned;
+  size_t interned_capacity;
+  size_t interned_count;
+} voyeur_connection_state;
+
+typedef struct interned_string {
+  char* val;          // NULL if the slot is empty.
+  size_t len;
+  size_t id;
+} interned_string;
+
+// This isn't static, so that every hook library in the process uses
+// the first one's copy.
+voyeur_connection_state voyeur_connection = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .fd = -1
+};
+
+// Once this much has been spilled, we wait for a connection after all.
+#define SPILL_LIMIT (1024 * 1024)
+
+static __thread pid_t vfork_parent = 0;
+
+void voyeur_connection_set_vfork_parent(pid_t parent)
+{
+  vfork_parent = parent;
+}
+
+int voyeur_in_vfork_child()
+{
+  return vfork_parent != 0 && vfork_parent != getpid();
+}
+
+// Discards any spilled messages.
+static void reset_spill(voyeur_connection_state* conn)
+{
+  if (conn->spill.data) {
+    voyeur_buf_destroy(&conn->spill);
+  }
+  voyeur_buf_init(&conn->spill);
+}
+
+// Forgets every interned string. The next connection starts over.
+static void reset_interned(voyeur_connection_state* conn)
+{
+  for (size_t i = 0 ; i < conn->interned_capacity ; ++i) {
+    free(conn->interned[i].val);
+  }
+  free(conn->interned);
+  conn->interned = NULL;
+  conn->interned_capacity = 0;
+  conn->interned_count = 0;
+}
+
+// Keeps the messages in 'buf' until there's a connection to send them on.
+static int spill(voyeur_connection_state* conn, voyeur_buf* buf)
+{
+  if (!conn->spill.data) {
+    voyeur_buf_init(&conn->spill);
+  }
+
+  voyeur_buf_finish(buf);
+  return buf_write(&conn->spill, buf->data, buf->size);
+}
+
+// Holding the mutex across fork() guarantees that the child never
+// inherits it locked, or inherits half of a message.
+static void connection_prepare_fork()
+{
+  pthread_mutex_lock(&voyeur_connection.mutex);
+}
+
+static void connection_parent_fork()
+{
+  pthread_mutex_unlock(&voyeur_connection.mutex);
+}
+
+// The child gets a connection of its own when it first needs one. Its
+// copy of the parent's connection has to go, but that's the parent's
+// stream, so we don't say we're done. Anything the parent spilled is
+// the parent's to send.
+static void connection_child_fork()
+{
+  voyeur_connection_state* conn = &voyeur_connection;
+  int stale = conn->fd;
+  conn->pid = getpid();
+  conn->fd = -1;
+  conn->closed = 0;
+  reset_spill(conn);
+  reset_interned(conn);
+  pthread_mutex_unlock(&conn->mutex);
+
+  if (stale >= 0) {
+    voyeur_close_socket(stale);
+  }
+}
+
+__attribute__((constructor)) void voyeur_init_connection()
+{
+  // Every hook library runs this, but the handlers must only be
+  // registered once, or preparing to fork would deadlock.
+  if (!voyeur_connection.atfork) {
+    voyeur_connection.atfork = 1;
+    pthread_atfork(connection_prepare_fork,
+                   connection_parent_fork,
+                   connection_child_fork);
+  }
+}
+
+// Connects if we aren't connected already, and sends anything that was
+// spilled. Unless 'wait' is set, this gives up right away if the
+// server's backlog is full. Must be called with the connection's mutex
+// held. Returns a descriptor the caller should close once it has
+// released the mutex, or -1.
+static int connect_process(voyeur_connection_state* conn, char wait)
+{
+  int stale = -1;
+  pid_t pid = getpid();
+
+  if (conn->pid != pid) {
+    // We're a child that was created without running the fork handlers,
+    // for example by calling clone() directly.
+    stale = conn->fd;
+    conn->pid = pid;
+    conn->fd = -1;
+    conn->closed = 0;
+    reset_spill(conn);
+    reset_interned(conn);
+  }
+
+  if (conn->fd < 0 && !conn->closed) {
+    // Use the connection we inherited across exec, if there is one. The
+    // strings interned before the exec are gone, so we start a new table.
+    conn->fd = voyeur_environment_fd();
+    if (conn->fd >= 0) {
+      fcntl(conn->fd, F_SETFD, FD_CLOEXEC);
+      voyeur_write_hello(conn->fd, voyeur_environment_job(), pid);
+    } else {
+      conn->fd = voyeur_create_client_socket(getenv("LIBVOYEUR_SOCKET"),
+                                             voyeur_environment_job(),
+                                             wait);
+    }
+
+    if (conn->fd < 0 && (wait || (errno != EAGAIN && errno != EWOULDBLOCK))) {
+      // The server is gone, so there's no point in trying again.
+      conn->closed = 1;
+      reset_spill(conn);
+    }
+  }
+
+  if (conn->fd >= 0 && conn->spill.size > 0) {
+    do_write(conn->fd, conn->spill.data, conn->spill.size);
+    reset_spill(conn);
+  }
+
+  return stale;
+}
+
+// Sends 'buf' if we're connected, or spills it. Must be called with the
+// connection's mutex held, after connect_process.
+static int send_locked(voyeur_connection_state* conn, voyeur_buf* buf)
+{
+  int retval = -1;
+  if (conn->fd >= 0) {
+    retval = voyeur_buf_send(conn->fd, buf);
+  } else if (!conn->closed) {
+    // The server's backlog is full. Rather than wait for it, we keep the
+    // event and try to connect again when the next one comes along.
+    retval = spill(conn, buf);
+    if (conn->spill.size > SPILL_LIMIT) {
+      connect_process(conn, 1);
+    }
+  }
+
+  return retval;
+}
+
+int voyeur_connection_send(voyeur_buf* buf)
+{
+  if (voyeur_in_vfork_child()) {
+    return -1;
+  }
+
+  voyeur_connection_state* conn = &voyeur_connection;
+  pthread_mutex_lock(&conn->mutex);
+
+  int stale = connect_process(conn, 0);
+  int retval = send_locked(conn, buf);
+
+  pthread_mutex_unlock(&conn->mutex);
+
+  if (stale >= 0) {
+    voyeur_close_socket(stale);
+  }
+
+  return retval;
+}
+
+static size_t hash_string(const char* val, size_t len)
+{
+  // FNV-1a.
+  size_t hash = 2166136261u;
+  for (size_t i = 0 ; i < len ; ++i) {
+    hash = (hash ^ (unsigned char) val[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Returns the slot that holds 'val', or the empty slot where it belongs,
+// growing the table if necessary. Returns NULL if it can't grow.
+static interned_string* find_interned(voyeur_connection_state* conn,
+                                      const char* val,
+                                      size_t len)
+{
+  if ((conn->interned_count + 1) * 2 > conn->interned_capacity) {
+    size_t capacity = conn->interned_capacity ? conn->interned_capacity * 2
+                                              : 64;
+    interned_string* interned = calloc(capacity, sizeof(interned_string));
+    if (!interned) {
+      return NULL;
+    }
+
+    for (size_t i = 0 ; i < conn->interned_capacity ; ++i) {
+      interned_string* entry = &conn->interned[i];
+      if (entry->val) {
+        size_t j = hash_string(entry->val, entry->len) & (capacity - 1);
+        while (interned[j].val) {
+          j = (j + 1) & (capacity - 1);
+        }
+        interned[j] = *entry;
+      }
+    }
+
+    free(conn->interned);
+    conn->interned = interned;
+    conn->interned_capacity = capacity;
+  }
+
+  size_t mask = conn->interned_capacity - 1;
+  size_t i = hash_string(val, len) & mask;
+  while (conn->interned[i].val &&
+         (conn->interned[i].len != len ||
+          memcmp(conn->interned[i].val, val, len) != 0)) {
+    i = (i + 1) & mask;
+  }
+
+  return &conn->interned[i];
+}
+
+size_t voyeur_connection_intern(const char* val, size_t len)
+{
+  if (!val || voyeur_in_vfork_child()) {
+    return 0;
+  }
+
+  if (len == 0) {
+    len = strnlen(val, VOYEUR_MAX_STRLEN);
+    if (len == 0) {
+      return 0;
+    }
+  }
+
+  voyeur_connection_state* conn = &voyeur_connection;
+  pthread_mutex_lock(&conn->mutex);
+
+  int stale = connect_process(conn, 0);
+  size_t id = 0;
+  interned_string* entry = NULL;
+  if (!conn->closed && conn->interned_count < VOYEUR_MAX_INTERNED) {
+    entry = find_interned(conn, val, len);
+  }
+
+  if (entry && entry->val) {
+    id = entry->id;
+  } else if (entry) {
+    // Define the string before anything can refer to it.
+    voyeur_buf buf;
+    voyeur_buf_init(&buf);
+    char* copy = malloc(len);
+    if (copy &&
+        voyeur_buf_begin_msg(&buf, VOYEUR_MSG_STRING) == 0 &&
+        voyeur_buf_write_size(&buf, conn->interned_count + 1) == 0 &&
+        voyeur_buf_write_string(&buf, val, len) == 0 &&
+        send_locked(conn, &buf) == 0) {
+      memcpy(copy, val, len);
+      entry->val = copy;
+      entry->len = len;
+      entry->id = ++conn->interned_count;
+      id = entry->id;
+    } else {
+      free(copy);
+    }
+    voyeur_buf_destroy(&buf);
+  }
+
+  pthread_mutex_unlock(&conn->mutex);
+
+  if (stale >= 0) {
+    voyeur_close_socket(stale);
+  }
+
+  return id;
+}
+
+int voyeur_connection_get()
+{
+  if (voyeur_in_vfork_child()) {
+    return -1;
+  }
+
+  voyeur_connection_state* conn = &voyeur_connection;
+  pthread_mutex_lock(&conn->mutex);
+  int stale = connect_process(conn, 1);
+  int fd = conn->fd;
+  pthread_mutex_unlock(&conn->mutex);
+
+  if (stale >= 0) {
+    voyeur_close_socket(stale);
+  }
+
+  return fd;
+}
+
+void voyeur_connection_flush()
+{
+  if (voyeur_in_vfork_child()) {
+    return;
+  }
+
+  voyeur_connection_state* conn = &voyeur_connection;
+  pthread_mutex_lock(&conn->mutex);
+  int stale = conn->spill.size > 0 ? connect_process(conn, 1) : -1;
+  pthread_mutex_unlock(&conn->mutex);
+
+  if (stale >= 0) {
+    voyeur_close_socket(stale);
+  }
+}
+
+void voyeur_connection_close()
+{
+  if (voyeur_in_vfork_child()) {
+    return;
+  }
+
+  voyeur_connection_state* conn = &voyeur_connection;
+  pthread_mutex_lock(&conn->mutex);
+
+  // Anything we spilled must be delivered before we're done.
+  int stale = -1;
+  if (conn->spill.size > 0) {
+    stale = connect_process(conn, 1);
+  }
+
+  // A forked child never sends anything on its parent's connection.
+  int fd = conn->fd;
+  char done = conn->pid == getpid();
+  conn->pid = getpid();
+  conn->fd = -1;
+  conn->closed = 1;
+
+  pthread_mutex_unlock(&conn->mutex);
+
+  if (stale >= 0) {
+    voyeur_close_socket(stale);
+  }
+
+  if (fd >= 0 && done) {
+    voyeur_write_done(fd);
+  }
+
+  if (fd >= 0) {
+    voyeur_close_socket(fd);
+  }
+}
+
+#define MAX_EXIT_HANDLERS 8
+
+typedef struct {
+  pthread_mutex_t mutex;
+  void (*handlers[MAX_EXIT_HANDLERS])();
+  int count;
+  pid_t ran;          // The last process that ran the handlers.
+} voyeur_exit_handler_list;
+
+// Not static, for the same reason as voyeur_connection.
+voyeur_exit_handler_list voyeur_exit_handlers = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+int voyeur_at_exit(void (*handler)())
+{
+  voyeur_exit_handler_list* list = &voyeur_exit_handlers;
+  pthread_mutex_lock(&list->mutex);
+  int status = -1;
+  if (list->count < MAX_EXIT_HANDLERS) {
+    list->handlers[list->count++] = handler;
+    status = 0;
+  }
+  pthread_mutex_unlock(&list->mutex);
+  return status;
+}
+
+void voyeur_run_exit_handlers()
+{
+  // A vforked child would be running its parent's handlers.
+  if (voyeur_in_vfork_child()) {
+    return;
+  }
+
+  // A forked child runs the handlers again for itself, but otherwise
+  // each process only runs them once.
+  voyeur_exit_handler_list* list = &voyeur_exit_handlers;
+  pthread_mutex_lock(&list->mutex);
+  pid_t pid = getpid();
+  int count = list->ran == pid ? 0 : list->count;
+  list->ran = pid;
+  pthread_mutex_unlock(&list->mutex);
+
+  for (int i = 0 ; i < count ; ++i) {
+    list->handlers[i]();
+  }
+}
+
+void voyeur_rearm_exit_handlers()
+{
+  voyeur_exit_handler_list* list = &voyeur_exit_handlers;
+  pthread_mutex_lock(&list->mutex);
+  if (list->ran == getpid()) {
+    list->ran = 0;
+  }
+  pthread_mutex_unlock(&list->mutex);
+}
+
+__attribute__((destructor)) void voyeur_cleanup_connection()
+{
+  voyeur_run_exit_handlers();
+
+  // Every hook library runs this, but only the first call does anything.
+  if (voyeur_connection.fd >= 0 || voyeur_connection.spill.size > 0) {
+    voyeur_connection_close();
+  }
+}
@@ -11,33 +11,127 @@
 // Sock creation and connection.
 //////////////////////////////////////////////////
 
-// Creates a socket and starts listening on it. The caller must
-// provided an uninitialized sockaddr_un struct. After
-// create_server_socket returns, the socket path will be available
-// in sockinfo->sun_path.
-int voyeur_create_server_socket(struct sockaddr_un* sockinfo);
+// Creates a socket and starts listening on it, and writes the path
+// clients should connect to into the 'size' bytes at 'sockpath'. On
+// Linux the socket has a name in the abstract namespace, which is
+// written with a leading '@'; elsewhere it lives in a new temporary
+// directory. Returns -1 on failure.
+int voyeur_create_server_socket(char* sockpath, size_t size);
 
-// Creates a socket and connects to the provided socket path on it.
-int voyeur_create_client_socket(const char* sockpath);
+// Closes a socket created by voyeur_create_server_socket and removes
+// anything it left in the filesystem. 'sockpath' is modified.
+void voyeur_destroy_server_socket(int fd, char* sockpath);
+
+// Creates a socket and connects to the provided socket path on it, and
+// sends the HELLO message that identifies the calling process and the
+// job it belongs to. If the server's backlog is full, this waits for
+// the server to accept the connection if 'wait' is set, and otherwise
+// fails right away with errno set to EAGAIN. Returns -1 on failure.
+int voyeur_create_client_socket(const char* sockpath, int job, char wait);
+
+// Sends the messages in 'buf' on a new connection of their own, for
+// callers that can't use the process's connection, such as a vforked
+// child, whose connection state belongs to its parent. Nothing here
+// touches the heap. The connection is closed afterwards unless 'keep' is
+// set, in which case it's returned so it can be passed on across exec;
+// otherwise -1 is returned.
+struct voyeur_buf;
+int voyeur_send_once(struct voyeur_buf* buf, char keep);
 
 // Closes the provided socket (or pipe) safely.
 void voyeur_close_socket(int fd);
 
+// Returns nonzero while the calling thread is in voyeur_close_socket,
+// so that the close hook can ignore libvoyeur's own sockets.
+int voyeur_closing_socket();
+
+// Every hook library in an observed process shares a single
+// connection to libvoyeur, created the first time an event needs one.
+// Connecting never waits for the server: if its backlog is full, events
+// are kept in memory and sent once a later attempt to connect succeeds,
+// or at the latest when the process exits.
+// (Each hook library links in its own copy of this code, but the
+// dynamic linker binds them all to the first copy's state.) A forked
+// child gets its own connection instead of sharing its parent's, and
+// sends are serialized so that events sent by different threads never
+// interleave.
+
+// Sends the messages in 'buf' on this process's connection. Returns -1
+// if there's no connection or it was closed by voyeur_connection_close.
+struct voyeur_buf;
+int voyeur_connection_send(struct voyeur_buf* buf);
+
+// Returns this process's connection, creating it if necessary, or -1.
+int voyeur_connection_get();
+
+// Returns the id of 'val' in this process's table of interned strings,
+// adding it and sending its definition on the connection the first
+// time it's seen. Because the definition is sent first, any event sent
+// with voyeur_connection_send afterwards may refer to the string by id.
+// Returns 0 if the string can't be interned, in which case it should
+// be sent as is. 'len' works as in voyeur_buf_write_string.
+size_t voyeur_connection_intern(const char* val, size_t len);
+
+// Sends any events that are being kept in memory, waiting for the
+// server if necessary. This is for processes that are about to exit
+// without running destructors.
+void voyeur_connection_flush();
+
+// Tells libvoyeur that this process is done and closes its connection.
+// Events sent afterwards are dropped. This happens automatically at
+// exit, but the exit hook does it as soon as it has sent its event.
+void voyeur_connection_close();
+
+// A vforked child shares its parent's memory, including the state of
+// the parent's connection, so it must never use the connection. The
+// vfork hook records the parent's pid for the calling thread until the
+// child has exec'd or exited, and then clears it by passing 0.
+void voyeur_connection_set_vfork_parent(pid_t parent);
+
+// Returns nonzero if this process is a vforked child.
+int voyeur_in_vfork_child();
+
+// Registers a function that sends whatever a hook library has saved up
+// to report when the process exits. Like the connection, the list is
+// shared by every hook library in the process. Returns -1 if it's full.
+int voyeur_at_exit(void (*handler)());
+
+// Runs the registered handlers, unless this process already has. The
+// exit hook calls this before it reports the exit, and it happens
+// automatically at exit if the exit hook isn't loaded. The exec hook
+// calls it too, since the program that saved things up is about to be
+// replaced.
+void voyeur_run_exit_handlers();
+
+// Lets the handlers run again in this process. The exec hook calls this
+// if the exec fails, so handlers should forget whatever they've sent.
+void voyeur_rearm_exit_handlers();
+
 
 //////////////////////////////////////////////////
 // Message serialization.
 //////////////////////////////////////////////////
 
-// Every libvoyeur network message starts with a message type.
+// Every libvoyeur network message starts with a message type. Every
+// connection starts with a HELLO message, which carries the protocol
+// version and the pid and job of the process on the other end; events
+// on that connection don't repeat them.
+
+#define VOYEUR_PROTOCOL_VERSION 2
 
 typedef enum {
   VOYEUR_MSG_EVENT,
-  VOYEUR_MSG_DONE
+  VOYEUR_MSG_DONE,
+  VOYEUR_MSG_HELLO,
+  VOYEUR_MSG_STRING
 } voyeur_msg_type;
 
-// Reader and writer for message types.
-int voyeur_write_msg_type(int fd, voyeur_msg_type val);
-int voyeur_read_msg_type(int fd, voyeur_msg_type* val);
+// Tell the server that no more messages will be sent on this socket.
+int voyeur_write_done(int fd);
+
+// Tell the server which process and job the messages on this socket
+// come from. This must be the first message sent.
+int voyeur_write_hello(int fd, int job, pid_t pid);
 
 //////////////////////////////////////////////////
 // Event serialization.
@@ -46,56 +140,199 @@ int voyeur_read_msg_type(int fd, voyeur_msg_type* val);
 // All libvoyeur events consist of an event type followed by a
 // sequence of bytes, integers, and strings particular to the event.
 //
+// Events are serialized into a voyeur_buf and then sent as a single
+// frame, consisting of a 32-bit little-endian payload size followed by
+// the payload, so that writing an event costs one send() no matter how
+// many fields it has. On the reading side, data is received in large
+// chunks and the fields are parsed out of memory.
+//
+// The encoding is compact and doesn't depend on the host: message and
+// event types are a single byte, integers, sizes, and pids are LEB128
+// varints (integers zigzag-encoded first, so small negative values stay
+// small), and strings are a varint length followed by the bytes and a
+// null terminator.
+//
 // A typical sequence of calls for a writer:
-//   voyeur_write_msg_type(fd, VOYEUR_MSG_EVENT);
-//   voyeur_write_event_type(fd, VOYEUR_EVENT_XXX);
-//   voyeur_write_string(fd, file, strlen(file));
-//   voyeur_write_int(fd, flags);
+//   voyeur_buf_init(&buf);
+//   voyeur_buf_begin_msg(&buf, VOYEUR_MSG_EVENT);
+//   voyeur_buf_write_event_type(&buf, VOYEUR_EVENT_XXX);
+//   voyeur_buf_write_string(&buf, file, strlen(file));
+//   voyeur_buf_write_int(&buf, flags);
+//   voyeur_buf_send(fd, &buf);
+//   voyeur_buf_destroy(&buf);
 //
 // A matching sequence of calls for a reader:
-//   voyeur_read_msg_type(fd, &msgtype);
+//   voyeur_recv_buf_fill(fd, &recv_buf);
+//   voyeur_recv_buf_next(&recv_buf, &buf);
+//   voyeur_buf_read_msg_type(&buf, &msgtype);
 //   /* dispatch to handler for VOYEUR_MSG_EVENT */
-//   voyeur_read_event_type(fd, &type);
+//   voyeur_buf_read_event_type(&buf, &type);
 //   /* dispatch to handler for VOYEUR_EVENT_XXX */
-//   voyeur_read_string(fd, &file, &len);
-//   voyeur_read_int(fd, &flags);
+//   voyeur_buf_read_string(&buf, &file);
+//   voyeur_buf_read_int(&buf, &flags);
 //
 // Every read/write function returns 0 on success and -1 on error.
 
-// Reader and writer for event types.
-int voyeur_write_event_type(int fd, voyeur_event_type val);
-int voyeur_read_event_type(int fd, voyeur_event_type* val);
+// Small events are serialized into inline storage, so building them
+// doesn't require any allocation.
+#define VOYEUR_BUF_INLINE_SIZE 1024
 
-// Reader and writer for bytes.
-int voyeur_write_byte(int fd, char val);
-int voyeur_read_byte(int fd, char* val);
+typedef struct voyeur_buf {
+  char* data;
+  size_t size;
+  size_t capacity;      // 0 if the data is borrowed from someone else.
+  size_t pos;           // Read position, or the start of the current frame
+                        // when writing.
+  char fixed;           // Set if the data belongs to the caller.
+  char inline_data[VOYEUR_BUF_INLINE_SIZE];
+} voyeur_buf;
 
-// Reader and writer for integers.
-int voyeur_write_int(int fd, int val);
-int voyeur_read_int(int fd, int* val);
+void voyeur_buf_init(voyeur_buf* buf);
+
+// Initializes a buffer that writes into 'capacity' bytes at 'data'
+// instead of allocating memory. Writes that don't fit fail.
+void voyeur_buf_init_fixed(voyeur_buf* buf, char* data, size_t capacity);
+void voyeur_buf_destroy(voyeur_buf* buf);
 
-// Reader and writer for size_t.
-int voyeur_write_size(int fd, size_t val);
-int voyeur_read_size(int fd, size_t* val);
+// Start a new message. A buffer may hold several messages, which are
+// all sent together by voyeur_buf_send.
+int voyeur_buf_begin_msg(voyeur_buf* buf, voyeur_msg_type val);
 
-// Reader and writer for pid_t.
-int voyeur_write_pid(int fd, pid_t val);
-int voyeur_read_pid(int fd, pid_t* val);
+// Fill in the framing for the last message, so that the contents of
+// the buffer are ready to be delivered. voyeur_buf_send does this
+// automatically.
+void voyeur_buf_finish(voyeur_buf* buf);
+
+// Send every message in the buffer with a single write.
+int voyeur_buf_send(int fd, voyeur_buf* buf);
+
+// Parse the next message out of 'size' bytes of memory at 'data',
+// which may hold several messages back to back. On success, 'buf'
+// refers to the message in place and the number of bytes it occupied
+// is returned. Returns 0 if 'data' doesn't contain a complete message
+// and -1 if it's malformed.
+ssize_t voyeur_buf_parse(voyeur_buf* buf, const char* data, size_t size);
+
+// Writers for the fields of an event.
+int voyeur_buf_write_event_type(voyeur_buf* buf, voyeur_event_type val);
+int voyeur_buf_write_byte(voyeur_buf* buf, char val);
+int voyeur_buf_write_int(voyeur_buf* buf, int val);
+int voyeur_buf_write_size(voyeur_buf* buf, size_t val);
+int voyeur_buf_write_pid(voyeur_buf* buf, pid_t val);
 
 #define VOYEUR_MAX_STRLEN 4096
 
 // Write a string. If 'len' is 0, the length is determined by calling
 // strnlen(val, VOYEUR_MAX_STRLEN).
-int voyeur_write_string(int fd, const char* val, size_t len);
+int voyeur_buf_write_string(voyeur_buf* buf, const char* val, size_t len);
 
-// Read a string. If 'maxlen' is 0, voyeur_read_string will allocate a
-// buffer large enough to hold the string, which the caller is
-// responsible for freeing. Otherwise, voyeur_read_string will use the
-// buffer provided by the caller.
-//
-// Note that if you use a maximum length when reading, you must make
-// sure to use the same limit when writing. If there isn't enough
-// space in the buffer, voyeur_read_string will report an error.
-int voyeur_read_string(int fd, char** val, size_t maxlen);
+// Readers for the message type and the fields of an event.
+int voyeur_buf_read_msg_type(voyeur_buf* buf, voyeur_msg_type* val);
+int voyeur_buf_read_event_type(voyeur_buf* buf, voyeur_event_type* val);
+int voyeur_buf_read_byte(voyeur_buf* buf, char* val);
+int voyeur_buf_read_int(voyeur_buf* buf, int* val);
+int voyeur_buf_read_size(voyeur_buf* buf, size_t* val);
+int voyeur_buf_read_pid(voyeur_buf* buf, pid_t* val);
+
+// Read a string. Strings are null-terminated on the wire, so the
+// result points directly into the buffer and remains valid until the
+// buffer is reused or destroyed.
+int voyeur_buf_read_string(voyeur_buf* buf, const char** val);
+
+
+//////////////////////////////////////////////////
+// Interned strings.
+//////////////////////////////////////////////////
+
+// Strings that an event is likely to repeat, like the current
+// directory, may be interned. A STRING message defines the next id in
+// the connection's table, and afterwards events refer to the string by
+// that id. Each HELLO starts a new table. The ring has no tables, so
+// events sent through it always contain the strings themselves.
+
+// The most strings a table may hold.
+#define VOYEUR_MAX_INTERNED 65536
+
+// Write a string that may be interned: a reference to 'id' if it's
+// nonzero, and otherwise the string itself.
+int voyeur_buf_write_interned(voyeur_buf* buf,
+                              size_t id,
+                              const char* val,
+                              size_t len);
+
+// The server's copy of a connection's table. Strings are never removed
+// or moved, so a string remains valid as long as the table does. Each
+// event queued for later holds a reference to its table.
+typedef struct voyeur_string_table voyeur_string_table;
+
+voyeur_string_table* voyeur_string_table_create();
+void voyeur_string_table_retain(voyeur_string_table* table);
+void voyeur_string_table_release(voyeur_string_table* table);
+
+// Reads the body of a STRING message into 'table'. Only the thread that
+// receives messages may call this. Returns -1 if it's malformed or
+// doesn't define the next id.
+int voyeur_string_table_define(voyeur_string_table* table, voyeur_buf* buf);
+
+// Read a string that may be interned, looking it up in 'table' if
+// necessary. 'table' may be NULL if no strings are interned.
+int voyeur_buf_read_interned(voyeur_buf* buf,
+                             voyeur_string_table* table,
+                             const char** val);
+
+
+//////////////////////////////////////////////////
+// Buffered receiving.
+//////////////////////////////////////////////////
+
+// A voyeur_recv_buf accumulates the data arriving on a connection, so
+// that the server can receive many messages with a single read and
+// then parse them out of memory. Messages that have only partly
+// arrived stay in the buffer, and parsing resumes where it left off
+// once the rest is received; this means a client that stalls in the
+// middle of a message never blocks the server.
+typedef struct {
+  char* data;
+  size_t start;      // The first byte that hasn't been parsed yet.
+  size_t end;        // One past the last byte received.
+  size_t capacity;
+} voyeur_recv_buf;
+
+void voyeur_recv_buf_init(voyeur_recv_buf* buf);
+void voyeur_recv_buf_destroy(voyeur_recv_buf* buf);
+
+// Performs a single read of as much data as is available. Returns the
+// number of bytes read, 0 on EOF, and -1 on error. If 'fd' is
+// non-blocking and no data is available, returns -1 with errno set to
+// EAGAIN or EWOULDBLOCK.
+ssize_t voyeur_recv_buf_fill(int fd, voyeur_recv_buf* buf);
+
+// Copies data that was received some other way into the buffer.
+// Returns -1 if the buffer can't hold it.
+int voyeur_recv_buf_append(voyeur_recv_buf* buf,
+                           const char* data,
+                           size_t size);
+
+// Returns true if the buffer holds no unparsed data.
+int voyeur_recv_buf_empty(voyeur_recv_buf* buf);
+
+// Parses the next message out of the buffer. On success, 'msg' refers
+// to the message in place and 1 is returned; the message is valid
+// until the buffer is next filled or appended to. Returns 0 if the buffer
+// doesn't hold a complete message and -1 if the data is malformed.
+int voyeur_recv_buf_next(voyeur_recv_buf* buf, voyeur_buf* msg);
+
+
+//////////////////////////////////////////////////
+// Unbuffered serialization.
+//////////////////////////////////////////////////
+
+// These write or read a single value directly on a file descriptor.
+// They're used for simple side channels, like the pipe that reports
+// the exit status of the child process.
+
+// Reader and writer for integers.
+int voyeur_write_int(int fd, int val);
+int voyeur_read_int(int fd, int* val);
 
 #endif
@@ -0,0 +1,505 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ring.h"
+#include "util.h"
+
+#ifdef __linux__
+
+#define RING_MAGIC 0x52594f56
+#define RING_MAX_SIZE (1 << 30)
+#define CACHE_LINE 64
+
+// How long a producer waits for space before checking that the server
+// is still alive.
+#define WAIT_TIMEOUT_MS 100
+
+// How long a producer waits without the server making any progress
+// before it gives up on the ring and falls back to the socket.
+#define STALL_TIMEOUT_MS 2000
+
+// The ring header lives at the start of the shared mapping, followed
+// by the ring itself. Positions are 64-bit counters that only ever
+// increase; they're reduced modulo the capacity to find an offset.
+typedef struct {
+  uint32_t magic;
+  pid_t server_pid;
+  uint64_t capacity;
+
+  // The next position to be reserved. Written by producers.
+  uint64_t head __attribute__((aligned(CACHE_LINE)));
+
+  // The next position to be consumed. Written by the server.
+  uint64_t tail __attribute__((aligned(CACHE_LINE)));
+  uint32_t tail_seq;  // A futex that's bumped whenever 'tail' advances.
+
+  // Used to decide whether anyone needs to be woken up.
+  uint32_t consumer_sleeping __attribute__((aligned(CACHE_LINE)));
+  uint32_t producers_waiting;
+} ring_header;
+
+// Every record in the ring starts with a record header. The record is
+// committed when its size becomes nonzero; until then the space is
+// zero-filled, except that right after reserving it the producer stores
+// its pid and the size it reserved in 'pid' and 'length'. If the
+// producer dies before committing, that's how the server finds out how
+// much space to skip. Records never wrap around the end of the ring;
+// instead a padding record with no messages fills the leftover space.
+typedef struct {
+  uint32_t size;     // Total size of the record, including this header.
+  uint32_t length;   // Size of the messages it holds.
+  int32_t job;       // The job of the process that wrote it.
+  int32_t pid;       // The process that wrote it.
+} record_header;
+
+// Records are aligned to the size of their header, so that there's
+// always room for a padding record at the end of the ring.
+#define RECORD_ALIGN sizeof(record_header)
+
+struct voyeur_ring {
+  ring_header* header;
+  char* data;
+  size_t mapping_size;
+  int memfd;
+  int eventfd;
+  int job;
+  char name[32];
+
+  // Producer side: the tail at which this process gave up waiting for
+  // the server, if it has.
+  char stalled;
+  uint64_t stalled_tail;
+};
+
+static int futex_wait(uint32_t* addr, uint32_t val, long timeout_ms)
+{
+  struct timespec timeout = { timeout_ms / 1000,
+                              (timeout_ms % 1000) * 1000000 };
+  return syscall(SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t* addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static voyeur_ring* map_ring(int memfd, int eventfd, size_t mapping_size)
+{
+  void* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, memfd, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  voyeur_ring* ring = calloc(1, sizeof(voyeur_ring));
+  ring->header = (ring_header*) mapping;
+  ring->data = (char*) mapping + sizeof(ring_header);
+  ring->mapping_size = mapping_size;
+  ring->memfd = memfd;
+  ring->eventfd = eventfd;
+  snprintf(ring->name, sizeof(ring->name), "%d:%d", memfd, eventfd);
+  return ring;
+}
+
+voyeur_ring* voyeur_ring_create(size_t size)
+{
+  size_t capacity = VOYEUR_RING_MIN_SIZE;
+  while (capacity < size && capacity < RING_MAX_SIZE) {
+    capacity *= 2;
+  }
+
+  // These descriptors are deliberately not close-on-exec, since the
+  // child processes need to inherit them.
+  int memfd = memfd_create("libvoyeur-ring", 0);
+  if (memfd < 0) {
+    return NULL;
+  }
+
+  int eventfd_fd = eventfd(0, EFD_NONBLOCK);
+  if (eventfd_fd < 0) {
+    voyeur_close_socket(memfd);
+    return NULL;
+  }
+
+  size_t mapping_size = sizeof(ring_header) + capacity;
+  voyeur_ring* ring = NULL;
+  if (ftruncate(memfd, mapping_size) == 0) {
+    ring = map_ring(memfd, eventfd_fd, mapping_size);
+  }
+
+  if (!ring) {
+    voyeur_close_socket(memfd);
+    voyeur_close_socket(eventfd_fd);
+    return NULL;
+  }
+
+  ring->header->server_pid = getpid();
+  ring->header->capacity = capacity;
+
+  // The server may wait on the eventfd before it ever drains the ring,
+  // so the first message always wakes it.
+  ring->header->consumer_sleeping = 1;
+
+  ring->header->magic = RING_MAGIC;
+  return ring;
+}
+
+void voyeur_ring_destroy(voyeur_ring* ring)
+{
+  munmap(ring->header, ring->mapping_size);
+  voyeur_close_socket(ring->memfd);
+  voyeur_close_socket(ring->eventfd);
+  free(ring);
+}
+
+const char* voyeur_ring_name(voyeur_ring* ring)
+{
+  return ring->name;
+}
+
+int voyeur_ring_fd(voyeur_ring* ring)
+{
+  return ring->eventfd;
+}
+
+static record_header* record_at(voyeur_ring* ring, uint64_t pos)
+{
+  return (record_header*)
+    (ring->data + (pos & (ring->header->capacity - 1)));
+}
+
+int voyeur_ring_prepare_to_wait(voyeur_ring* ring)
+{
+  ring_header* header = ring->header;
+
+  // Producers check this flag after committing a record, so either
+  // they'll see it and wake us, or we'll see their record here.
+  __atomic_store_n(&header->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+  record_header* record = record_at(ring, header->tail);
+  if (__atomic_load_n(&record->size, __ATOMIC_SEQ_CST) != 0) {
+    __atomic_store_n(&header->consumer_sleeping, 0, __ATOMIC_SEQ_CST);
+    return -1;
+  }
+
+  return 0;
+}
+
+void voyeur_ring_drain(voyeur_ring* ring,
+                       voyeur_ring_handler handler,
+                       void* userdata)
+{
+  ring_header* header = ring->header;
+
+  // Reset the eventfd so we don't wake up again for the same records.
+  uint64_t count;
+  while (read(ring->eventfd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    // Retry.
+  }
+
+  uint64_t tail = header->tail;
+  uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  while (tail < head) {
+    record_header* record = record_at(ring, tail);
+    uint32_t size = __atomic_load_n(&record->size, __ATOMIC_ACQUIRE);
+    size_t remaining = record->length;
+    if (size == 0) {
+      // This record is reserved but not committed yet. If the producer
+      // died before committing it, nobody ever will, so we skip it.
+      pid_t owner = __atomic_load_n(&record->pid, __ATOMIC_ACQUIRE);
+      size = record->length;
+      if (owner <= 0 || size == 0 || size > head - tail ||
+          kill(owner, 0) == 0 || errno != ESRCH) {
+        break;
+      }
+      remaining = 0;
+    }
+
+    const char* msg = (const char*) (record + 1);
+    while (remaining > 0) {
+      voyeur_buf buf;
+      ssize_t used = voyeur_buf_parse(&buf, msg, remaining);
+      if (used <= 0) {
+        break;
+      }
+
+      handler(&buf, record->job, record->pid, userdata);
+      msg += used;
+      remaining -= used;
+    }
+
+    // Release the space. It must be zeroed before it can be reused.
+    memset(record, 0, size);
+    tail += size;
+    __atomic_store_n(&header->tail, tail, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&header->tail_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->producers_waiting, __ATOMIC_SEQ_CST)) {
+      futex_wake(&header->tail_seq);
+    }
+  }
+}
+
+// Makes sure the descriptors we inherited are still the ones the
+// server created; the process may have closed and reused them. Stores
+// the size of the ring's memory in 'size'.
+static int check_descriptors(int memfd, int eventfd_fd, off_t* size)
+{
+  char procpath[64];
+  char target[64];
+  snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", eventfd_fd);
+  ssize_t len = readlink(procpath, target, sizeof(target) - 1);
+  if (len < 0) {
+    return -1;
+  }
+  target[len] = '\0';
+  if (strcmp(target, "anon_inode:[eventfd]") != 0) {
+    return -1;
+  }
+
+  struct stat info;
+  if (fstat(memfd, &info) < 0 ||
+      info.st_size < (off_t) (sizeof(ring_header) + VOYEUR_RING_MIN_SIZE)) {
+    return -1;
+  }
+
+  *size = info.st_size;
+  return 0;
+}
+
+voyeur_ring* voyeur_ring_attach(const char* name, int job)
+{
+  int memfd, eventfd_fd;
+  if (!name || sscanf(name, "%d:%d", &memfd, &eventfd_fd) != 2) {
+    return NULL;
+  }
+
+  off_t size;
+  if (check_descriptors(memfd, eventfd_fd, &size) < 0) {
+    return NULL;
+  }
+
+  voyeur_ring* ring = map_ring(memfd, eventfd_fd, size);
+  if (!ring) {
+    return NULL;
+  }
+
+  if (ring->header->magic != RING_MAGIC ||
+      sizeof(ring_header) + ring->header->capacity != (size_t) size) {
+    voyeur_ring_detach(ring);
+    return NULL;
+  }
+
+  ring->job = job;
+  return ring;
+}
+
+void voyeur_ring_detach(voyeur_ring* ring)
+{
+  munmap(ring->header, ring->mapping_size);
+  free(ring);
+}
+
+int voyeur_ring_check(voyeur_ring* ring)
+{
+  off_t size;
+  if (check_descriptors(ring->memfd, ring->eventfd, &size) < 0 ||
+      (size_t) size != ring->mapping_size) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void wake_consumer(voyeur_ring* ring)
+{
+  if (__atomic_exchange_n(&ring->header->consumer_sleeping, 0,
+                          __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    while (write(ring->eventfd, &one, sizeof(one)) < 0 && errno == EINTR) {
+      // Retry.
+    }
+  }
+}
+
+// Waits for the server to release some space. 'waited' is how long
+// this write has already waited without the server making progress.
+// Returns -1 if the server is gone, or if it hasn't released anything
+// for STALL_TIMEOUT_MS; it may be stuck behind a producer that was
+// stopped before committing its record.
+static int wait_for_space(voyeur_ring* ring, long* waited)
+{
+  ring_header* header = ring->header;
+
+  uint32_t seq = __atomic_load_n(&header->tail_seq, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&header->producers_waiting, 1, __ATOMIC_SEQ_CST);
+  wake_consumer(ring);
+  int status = futex_wait(&header->tail_seq, seq, WAIT_TIMEOUT_MS);
+  int wait_errno = errno;
+  __atomic_fetch_sub(&header->producers_waiting, 1, __ATOMIC_SEQ_CST);
+
+  if (status < 0 && wait_errno == ETIMEDOUT) {
+    if (kill(header->server_pid, 0) < 0 && errno == ESRCH) {
+      // Nobody is ever going to drain the ring.
+      return -1;
+    }
+
+    *waited += WAIT_TIMEOUT_MS;
+    if (*waited >= STALL_TIMEOUT_MS) {
+      ring->stalled = 1;
+      ring->stalled_tail = __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST);
+      return -1;
+    }
+  } else {
+    *waited = 0;
+  }
+
+  return 0;
+}
+
+static void reserve_record(voyeur_ring* ring, uint64_t pos, uint32_t size)
+{
+  record_header* record = record_at(ring, pos);
+  record->length = size;
+  __atomic_store_n(&record->pid, getpid(), __ATOMIC_RELEASE);
+}
+
+static void commit_record(voyeur_ring* ring, uint64_t pos, uint32_t size,
+                          const char* msg, uint32_t length)
+{
+  record_header* record = record_at(ring, pos);
+  record->length = length;
+  record->job = ring->job;
+  record->pid = length > 0 ? getpid() : 0;
+  if (length > 0) {
+    memcpy(record + 1, msg, length);
+  }
+  __atomic_store_n(&record->size, size, __ATOMIC_SEQ_CST);
+}
+
+int voyeur_ring_write(voyeur_ring* ring, voyeur_buf* buf)
+{
+  ring_header* header = ring->header;
+  uint64_t capacity = header->capacity;
+  voyeur_buf_finish(buf);
+
+  // Limiting records to half the ring guarantees that a record and any
+  // padding before it always fit in an empty ring.
+  uint64_t size = (sizeof(record_header) + buf->size + RECORD_ALIGN - 1)
+                & ~(uint64_t) (RECORD_ALIGN - 1);
+  if (size > capacity / 2) {
+    return -1;
+  }
+
+  uint64_t head, padding;
+  long waited = 0;
+  while (1) {
+    head = __atomic_load_n(&header->head, __ATOMIC_SEQ_CST);
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST);
+    uint64_t offset = head & (capacity - 1);
+    padding = offset + size > capacity ? capacity - offset : 0;
+
+    if (head + padding + size - tail > capacity) {
+      // Once we've given up on a stuck ring, we don't wait for it again
+      // until it moves.
+      if (ring->stalled && ring->stalled_tail == tail) {
+        return -1;
+      }
+      ring->stalled = 0;
+
+      if (wait_for_space(ring, &waited) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    if (__atomic_compare_exchange_n(&header->head, &head,
+                                    head + padding + size, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      break;
+    }
+  }
+
+  // Say who owns the space before anything else, in case we die before
+  // committing it.
+  reserve_record(ring, head + padding, size);
+  if (padding) {
+    reserve_record(ring, head, padding);
+    commit_record(ring, head, padding, NULL, 0);
+  }
+
+  commit_record(ring, head + padding, size, buf->data, buf->size);
+  wake_consumer(ring);
+  return 0;
+}
+
+#else
+
+voyeur_ring* voyeur_ring_create(size_t size)
+{
+  return NULL;
+}
+
+void voyeur_ring_destroy(voyeur_ring* ring)
+{
+}
+
+const char* voyeur_ring_name(voyeur_ring* ring)
+{
+  return NULL;
+}
+
+int voyeur_ring_fd(voyeur_ring* ring)
+{
+  return -1;
+}
+
+int voyeur_ring_prepare_to_wait(voyeur_ring* ring)
+{
+  return 0;
+}
+
+void voyeur_ring_drain(voyeur_ring* ring,
+                       voyeur_ring_handler handler,
+                       void* userdata)
+{
+}
+
+voyeur_ring* voyeur_ring_attach(const char* name, int job)
+{
+  return NULL;
+}
+
+void voyeur_ring_detach(voyeur_ring* ring)
+{
+}
+
+int voyeur_ring_check(voyeur_ring* ring)
+{
+  return -1;
+}
+
+int voyeur_ring_write(voyeur_ring* ring, voyeur_buf* buf)
+{
+  return -1;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef VOYEUR_RING_H
+#define VOYEUR_RING_H
+
+#include <stddef.h>
+
+#include "net.h"
+
+//////////////////////////////////////////////////
+// Shared memory event transport.
+//////////////////////////////////////////////////
+
+// A voyeur_ring is a multi-producer, single-consumer ring buffer in
+// shared memory. Hooked processes reserve space in it with atomic
+// operations and copy their messages in directly, so delivering an
+// event doesn't require a system call unless the server is asleep.
+//
+// The ring is backed by a memfd and the server is woken through an
+// eventfd. Both are inherited by child processes, which find them
+// through LIBVOYEUR_RING. This is only supported on Linux; elsewhere
+// voyeur_ring_create and voyeur_ring_attach always fail and events
+// are sent over the socket.
+
+typedef struct voyeur_ring voyeur_ring;
+
+// The smallest ring we'll create. It's large enough that any open,
+// close, or exit event fits; larger exec events may not.
+#define VOYEUR_RING_MIN_SIZE (64 * 1024)
+
+// Server side.
+
+// Creates a ring with room for at least 'size' bytes of messages.
+// Returns NULL on failure.
+voyeur_ring* voyeur_ring_create(size_t size);
+void voyeur_ring_destroy(voyeur_ring* ring);
+
+// The value of LIBVOYEUR_RING that child processes should receive.
+const char* voyeur_ring_name(voyeur_ring* ring);
+
+// A file descriptor that becomes readable when messages are available.
+int voyeur_ring_fd(voyeur_ring* ring);
+
+// Call before blocking on voyeur_ring_fd. Returns 0 if it's safe to
+// block, or -1 if messages arrived in the meantime and the ring should
+// be drained first.
+int voyeur_ring_prepare_to_wait(voyeur_ring* ring);
+
+// Passes each message in the ring to 'handler', along with the pid and
+// job of the process that wrote it, and releases the space it occupied.
+// The message is only valid until 'handler' returns.
+typedef void (*voyeur_ring_handler)(voyeur_buf* buf,
+                                    int job,
+                                    pid_t pid,
+                                    void* userdata);
+void voyeur_ring_drain(voyeur_ring* ring,
+                       voyeur_ring_handler handler,
+                       void* userdata);
+
+// Client side.
+
+// Attaches to the ring described by 'name', which should be the value
+// of LIBVOYEUR_RING. Messages written to the ring are tagged with
+// 'job' and with the pid of the process writing them, which may be a
+// child that inherited the attachment. Returns NULL if 'name' is NULL
+// or the ring isn't usable in this process.
+voyeur_ring* voyeur_ring_attach(const char* name, int job);
+
+// Releases the resources acquired by voyeur_ring_attach. The inherited
+// descriptors are left open for child processes.
+void voyeur_ring_detach(voyeur_ring* ring);
+
+// Checks that an attached ring's descriptors are still usable, in case
+// they were closed since voyeur_ring_attach. Returns -1 if they aren't.
+// This doesn't allocate memory, so it's safe to call in a vforked child.
+int voyeur_ring_check(voyeur_ring* ring);
+
+// Copies every message in 'buf' into the ring, blocking if the ring is
+// full. Returns -1 if the messages can never fit or the server has gone
+// away; the caller should fall back to the socket in that case.
+int voyeur_ring_write(voyeur_ring* ring, voyeur_buf* buf);
+
+#endif
@@ -2,6 +2,7 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -13,67 +14,71 @@
 #include "dyld.h"
 #include "env.h"
 #include "net.h"
+#include "ring.h"
 
 typedef int (*close_fptr_t)(int);
 VOYEUR_STATIC_DECLARE_NEXT(close_fptr_t, close)
 
-static pthread_mutex_t voyeur_close_mutex = PTHREAD_MUTEX_INITIALIZER;
-static char voyeur_close_initialized = 0;
-static char voyeur_close_finalized = 0;
+static pthread_once_t voyeur_close_once = PTHREAD_ONCE_INIT;
 static uint8_t voyeur_close_opts = 0;
-static int voyeur_close_sock = 0;
+static voyeur_ring* voyeur_close_ring = NULL;
 
-__attribute__((destructor)) void voyeur_cleanup_close()
+static void voyeur_init_close()
 {
-  pthread_mutex_lock(&voyeur_close_mutex);
-
-  voyeur_close_finalized = 1;
-
-  if (voyeur_close_initialized) {
-    if (voyeur_close_sock >= 0) {
-      voyeur_write_msg_type(voyeur_close_sock, VOYEUR_MSG_DONE);
-      voyeur_close_socket(voyeur_close_sock);
-      voyeur_close_sock = -1;
-    }
-    
-    voyeur_close_initialized = 0;
-  }
-
-  pthread_mutex_unlock(&voyeur_close_mutex);
+  voyeur_close_opts = voyeur_decode_options(getenv("LIBVOYEUR_OPTS"),
+                                            VOYEUR_EVENT_CLOSE);
+  voyeur_close_ring = voyeur_ring_attach(getenv("LIBVOYEUR_RING"),
+                                         voyeur_environment_job());
+  VOYEUR_LOOKUP_NEXT(close_fptr_t, close);
 }
 
 int VOYEUR_FUNC(close)(int fildes)
 {
-  if (voyeur_close_finalized) {
-    // We're in the process of shutting down, so just forward to the real close.
-    return VOYEUR_CALL_NEXT(close, fildes);
-  }
-
-  pthread_mutex_lock(&voyeur_close_mutex);
-
-  if (!voyeur_close_initialized) {
-    const char* voyeur_close_sockpath = getenv("LIBVOYEUR_SOCKET");
-    voyeur_close_opts = voyeur_decode_options(getenv("LIBVOYEUR_OPTS"),
-                                              VOYEUR_EVENT_CLOSE);
-    voyeur_close_sock = voyeur_create_client_socket(voyeur_close_sockpath);
-    VOYEUR_LOOKUP_NEXT(close_fptr_t, close);
-    voyeur_close_initialized = 1;
-  }
+  pthread_once(&voyeur_close_once, voyeur_init_close);
 
   // Pass through the call to the real close.
   int retval = VOYEUR_CALL_NEXT(close, fildes);
+  int error = errno;
+
+  if (voyeur_closing_socket()) {
+    // This is one of libvoyeur's own sockets.
+    return retval;
+  }
 
-  // Write the event to the socket.
-  if (voyeur_close_sock >= 0) {
-    voyeur_write_msg_type(voyeur_close_sock, VOYEUR_MSG_EVENT);
-    voyeur_write_event_type(voyeur_close_sock, VOYEUR_EVENT_CLOSE);
-    voyeur_write_int(voyeur_close_sock, fildes);
-    voyeur_write_int(voyeur_close_sock, retval);
-    voyeur_write_pid(voyeur_close_sock, getpid());
+  // Write the event. It's small enough to fit in 'data', which a
+  // vforked child needs, since it can't grow a buffer on its parent's
+  // heap.
+  char data[64];
+  voyeur_buf buf;
+  if (voyeur_in_vfork_child()) {
+    voyeur_buf_init_fixed(&buf, data, sizeof(data));
+  } else {
+    voyeur_buf_init(&buf);
+  }
+  voyeur_buf_begin_msg(&buf, VOYEUR_MSG_EVENT);
+  voyeur_buf_write_event_type(&buf, VOYEUR_EVENT_CLOSE);
+  voyeur_buf_write_int(&buf, fildes);
+  voyeur_buf_write_int(&buf, retval);
+
+  if (voyeur_in_vfork_child()) {
+    // A vforked child can't use its parent's connection, so it sends
+    // on one of its own. It may also have just closed one of the
+    // ring's descriptors.
+    voyeur_ring* ring = voyeur_close_ring;
+    if (!ring || voyeur_ring_check(ring) < 0 ||
+        voyeur_ring_write(ring, &buf) < 0) {
+      voyeur_send_once(&buf, 0);
+    }
+  } else if (!voyeur_close_ring ||
+             voyeur_ring_write(voyeur_close_ring, &buf) < 0) {
+    voyeur_connection_send(&buf);
   }
 
-  pthread_mutex_unlock(&voyeur_close_mutex);
+  voyeur_buf_destroy(&buf);
 
+  // Sending the event may have tried to connect, but the caller should
+  // see the real close's errno.
+  errno = error;
   return retval;
 }
 
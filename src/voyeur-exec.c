@@ -2,80 +2,408 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <spawn.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <alloca.h>
+#include <sys/syscall.h>
+#endif
+
 #include "dyld.h"
 #include "env.h"
 #include "net.h"
+#include "ring.h"
 #include "util.h"
 
 
+//////////////////////////////////////////////////
+// vfork() support.
+//////////////////////////////////////////////////
+
+// A vforked child borrows our memory until it calls exec, so the exec
+// hooks mustn't touch the heap there: another thread may hold the
+// allocator's locks, and anything the child allocated would leak in the
+// parent anyway. On x86_64 Linux our vfork() notes which process is the
+// parent before the real vfork, the child takes the memory it needs
+// straight from the kernel, and the parent unmaps it once the child has
+// exec'd or exited. Elsewhere vfork() is still replaced with fork().
+
+typedef struct vfork_chunk {
+  struct vfork_chunk* next;
+  size_t size;
+} vfork_chunk;
+
+// The memory mapped by a vforked child. The child runs on the parent's
+// thread, so it sees the same list.
+static __thread vfork_chunk* voyeur_vfork_chunks = NULL;
+
+// Allocates memory for an exec hook. We never free it, since we need it
+// until the exec call and we have no way of freeing it after that.
+static void* exec_alloc(size_t size)
+{
+  if (!voyeur_in_vfork_child()) {
+    return malloc(size);
+  }
+
+  size_t mapping_size = sizeof(vfork_chunk) + size;
+  vfork_chunk* chunk = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) {
+    return NULL;
+  }
+
+  chunk->size = mapping_size;
+  chunk->next = voyeur_vfork_chunks;
+  voyeur_vfork_chunks = chunk;
+  return chunk + 1;
+}
+
+
 //////////////////////////////////////////////////
 // Shared code for all exec*() functions.
 //////////////////////////////////////////////////
 
-static void write_exec_event(int sock, uint8_t options, const char* path,
-                             char* const argv[], char* const envp[],
-                             pid_t pid, pid_t ppid)
+typedef int (*execve_fptr_t)(const char*, char* const[], char* const []);
+typedef int (*execvpe_fptr_t)(const char*, char* const [], char* const []);
+
+static pthread_once_t voyeur_exec_once = PTHREAD_ONCE_INIT;
+static voyeur_ring* voyeur_exec_ring = NULL;
+static voyeur_env_snapshot* voyeur_exec_env = NULL;
+VOYEUR_STATIC_DECLARE_NEXT(execve_fptr_t, execve);
+#ifdef __linux__
+VOYEUR_STATIC_DECLARE_NEXT(execvpe_fptr_t, execvpe);
+#endif
+
+typedef void (*exit_fptr_t)(int);
+
+static pthread_once_t voyeur_exit_once = PTHREAD_ONCE_INIT;
+VOYEUR_STATIC_DECLARE_NEXT(exit_fptr_t, _exit);
+VOYEUR_STATIC_DECLARE_NEXT(exit_fptr_t, _Exit);
+
+// A vforked child whose exec fails exits instead, and it can't look up
+// the real exit functions itself either.
+static void voyeur_init_exit_functions()
+{
+  VOYEUR_LOOKUP_NEXT(exit_fptr_t, _exit);
+  VOYEUR_LOOKUP_NEXT(exit_fptr_t, _Exit);
+}
+
+// Looks up everything a vforked child will need, since it can't do it
+// itself. The ring and the environment snapshot stay attached for the
+// life of the process.
+static void voyeur_init_exec()
+{
+  VOYEUR_LOOKUP_NEXT(execve_fptr_t, execve);
+#ifdef __linux__
+  VOYEUR_LOOKUP_NEXT(execvpe_fptr_t, execvpe);
+#endif
+  voyeur_exec_ring = voyeur_ring_attach(getenv("LIBVOYEUR_RING"),
+                                        voyeur_environment_job());
+
+  uint8_t options = voyeur_decode_options(getenv("LIBVOYEUR_OPTS"),
+                                          VOYEUR_EVENT_EXEC);
+  if (options & OBSERVE_EXEC_ENV) {
+    voyeur_exec_env = voyeur_env_snapshot_attach(getenv("LIBVOYEUR_ENV"));
+  }
+}
+
+// Returns nonzero if an exec of 'path' should be reported.
+static int exec_is_reported(uint8_t options, const char* path)
 {
   if (options & OBSERVE_EXEC_SILENT) {
     // We're just here to propagate libvoyeur instrumentation.
-    return;
+    return 0;
   }
 
   if (!(options & OBSERVE_EXEC_NOACCESS)) {
     // Make sure this exec() call could succeed before reporting the event.
     if (access(path, X_OK) < 0) {
-      return;
+      return 0;
     }
   }
 
-  voyeur_write_msg_type(sock, VOYEUR_MSG_EVENT);
-  voyeur_write_event_type(sock, VOYEUR_EVENT_EXEC);
-  voyeur_write_string(sock, path, 0);
+  return 1;
+}
+
+static size_t string_size(const char* val)
+{
+  return sizeof(size_t) + (val ? strnlen(val, VOYEUR_MAX_STRLEN) : 0) + 1;
+}
+
+// An upper bound on the size of the messages send_exec_event writes.
+static size_t exec_event_size(uint8_t options, const char* path,
+                              char* const argv[], char* const envp[])
+{
+  // Frame headers, message and event types, counts, and pids.
+  size_t size = 64 + string_size(path);
+
+  for (int i = 0 ; argv[i] ; ++i) {
+    size += string_size(argv[i]);
+  }
+
+  if (options & OBSERVE_EXEC_ENV) {
+    // Leave room for the operations of an environment delta, too.
+    for (int i = 0 ; envp[i] ; ++i) {
+      size += string_size(envp[i]) + 2 * sizeof(size_t);
+    }
+  }
+
+  if (options & OBSERVE_EXEC_PATH) {
+    size += string_size(getenv("PATH"));
+  }
+
+  if (options & OBSERVE_EXEC_CWD) {
+    size += sizeof(size_t) + PATH_MAX + 1;
+  }
+
+  return size;
+}
+
+// Serializes an exec event into 'buf'. The caller should check
+// exec_is_reported first.
+static void write_exec_event(voyeur_buf* buf, uint8_t options,
+                             const char* path, char* const argv[],
+                             char* const envp[], pid_t pid, pid_t ppid)
+{
+  voyeur_buf_begin_msg(buf, VOYEUR_MSG_EVENT);
+  voyeur_buf_write_event_type(buf, VOYEUR_EVENT_EXEC);
+  voyeur_buf_write_pid(buf, pid);
+  voyeur_buf_write_pid(buf, ppid);
+  voyeur_buf_write_string(buf, path, 0);
 
   int argc = 0;
   while (argv[argc]) {
     ++argc;
   }
-  voyeur_write_int(sock, argc);
+  voyeur_buf_write_int(buf, argc);
   for (int i = 0 ; i < argc ; ++i) {
-    voyeur_write_string(sock, argv[i], 0);
+    voyeur_buf_write_string(buf, argv[i], 0);
   }
 
   if (options & OBSERVE_EXEC_ENV) {
-    int envc = 0;
-    while (envp[envc]) {
-      ++envc;
-    }
-    voyeur_write_int(sock, envc);
-    for (int i = 0 ; i < envc ; ++i) {
-      voyeur_write_string(sock, envp[i], 0);
-    }
+    voyeur_buf_write_env(buf, voyeur_exec_env, envp);
   }
 
   if (options & OBSERVE_EXEC_PATH) {
-    voyeur_write_string(sock, getenv("PATH"), 0);
+    voyeur_buf_write_string(buf, getenv("PATH"), 0);
   }
 
   if (options & OBSERVE_EXEC_CWD) {
-    voyeur_write_string(sock, getcwd(NULL, 0), 0);
+    char cwd[PATH_MAX];
+    voyeur_buf_write_string(buf, getcwd(cwd, sizeof(cwd)), 0);
+  }
+}
+
+// Sends the messages in 'buf' through the ring if there is one, or
+// otherwise on this process's connection. A vforked child can't use
+// the connection, so it sends with voyeur_send_once instead, and returns
+// what that does.
+static int send_exec_buf(voyeur_buf* buf, char keep)
+{
+  // The ring's descriptors may have been closed since it was attached.
+  voyeur_ring* ring = voyeur_exec_ring;
+  if (ring && voyeur_ring_check(ring) == 0 &&
+      voyeur_ring_write(ring, buf) == 0) {
+    return -1;
   }
 
-  voyeur_write_pid(sock, pid);
-  voyeur_write_pid(sock, ppid);
+  if (!voyeur_in_vfork_child()) {
+    // Anything we couldn't send yet would be lost by the exec.
+    voyeur_connection_send(buf);
+    voyeur_connection_flush();
+    return -1;
+  }
+
+  return voyeur_send_once(buf, keep);
+}
+
+// Reports an exec event for the current process, and returns the
+// connection voyeur_send_once opened for the new program to inherit, if any.
+static int send_exec_event(uint8_t options,
+                           const char* path, char* const argv[],
+                           char* const envp[], char inherit)
+{
+  // We only bother connecting if there's actually something to report.
+  if (!exec_is_reported(options, path)) {
+    return -1;
+  }
+
+  voyeur_buf buf;
+  voyeur_buf_init(&buf);
+
+  if (voyeur_in_vfork_child()) {
+    // The buffer must never need to grow.
+    size_t size = exec_event_size(options, path, argv, envp);
+    char* data = exec_alloc(size);
+    if (!data) {
+      return -1;
+    }
+    voyeur_buf_init_fixed(&buf, data, size);
+  }
+
+  write_exec_event(&buf, options, path, argv, envp, getpid(), getppid());
+  int sock = send_exec_buf(&buf, inherit);
+  voyeur_buf_destroy(&buf);
+  return sock;
+}
+
+// Reports an exec of 'path' and returns the environment to pass on to
+// the real exec function. In the case of exec we don't bother caching
+// anything, since exec will wipe out this whole process image anyway.
+// If a connection is passed on to the new program, it's stored in
+// 'inherited', and otherwise -1 is.
+static char** prepare_exec(const char* path, char* const argv[],
+                           char* const envp[], int* inherited)
+{
+  const char* libs = getenv("LIBVOYEUR_LIBS");
+  const char* opts = getenv("LIBVOYEUR_OPTS");
+  uint8_t options = voyeur_decode_options(opts, VOYEUR_EVENT_EXEC);
+  const char* sockpath = getenv("LIBVOYEUR_SOCKET");
+  const char* ring = getenv("LIBVOYEUR_RING");
+  const char* job = getenv("LIBVOYEUR_JOB");
+  const char* fd = getenv("LIBVOYEUR_FD");
+  const char* env = getenv("LIBVOYEUR_ENV");
+  const char* filter = getenv("LIBVOYEUR_FILTER");
+
+  if (!voyeur_in_vfork_child()) {
+    pthread_once(&voyeur_exec_once, voyeur_init_exec);
+
+    // Whatever the other hook libraries have saved up to report at exit
+    // would be lost with this process image, so send it now.
+    voyeur_run_exit_handlers();
+    voyeur_connection_flush();
+  }
+
+  // Write the event.
+  *inherited = -1;
+  int sock = send_exec_event(options, path, argv, envp, fd != NULL);
+
+  // If connections are inherited, pass ours on to the new program.
+  char fd_value[32];
+  if (fd) {
+    if (sock < 0) {
+      sock = voyeur_connection_get();
+    }
+
+    if (sock >= 0) {
+      fcntl(sock, F_SETFD, 0);
+      *inherited = sock;
+      snprintf(fd_value, sizeof(fd_value), "%d:%d", sock, (int) getpid());
+      fd = fd_value;
+    } else {
+      fd = "-1";
+    }
+  }
+
+  // Add libvoyeur-specific environment variables.
+  if (voyeur_in_vfork_child()) {
+    void* mem = exec_alloc(voyeur_augment_environment_size(envp));
+    if (!mem) {
+      return (char**) envp;
+    }
+    return voyeur_augment_environment_in(envp, libs, opts, sockpath,
+                                         ring, job, fd, env, filter, mem);
+  }
+
+  void* buf;
+  return voyeur_augment_environment(envp, libs, opts, sockpath,
+                                    ring, job, fd, env, filter, &buf);
+}
+
+// Called when the real exec function returns, which means it failed. The
+// connection we meant to pass on stays ours, so later children mustn't
+// inherit it, and we'll exit after all.
+static void fail_exec(int inherited)
+{
+  int error = errno;
+  if (inherited >= 0) {
+    fcntl(inherited, F_SETFD, FD_CLOEXEC);
+  }
+
+  // The exit handlers ran in prepare_exec, but we're not gone yet.
+  if (!voyeur_in_vfork_child()) {
+    voyeur_rearm_exit_handlers();
+  }
+  errno = error;
 }
 
 
 //////////////////////////////////////////////////
-// Replace vfork() with fork()
+// vfork
 //////////////////////////////////////////////////
 
+#if defined(__linux__) && defined(__x86_64__)
+
+__attribute__((visibility("hidden"), used)) void voyeur_prepare_vfork()
+{
+  pthread_once(&voyeur_exec_once, voyeur_init_exec);
+  pthread_once(&voyeur_exit_once, voyeur_init_exit_functions);
+  voyeur_vfork_chunks = NULL;
+  voyeur_connection_set_vfork_parent(getpid());
+}
+
+__attribute__((visibility("hidden"), used)) long voyeur_finish_vfork(long result)
+{
+  // The child has exec'd or exited, so the memory it used is ours again.
+  vfork_chunk* chunk = voyeur_vfork_chunks;
+  while (chunk) {
+    vfork_chunk* next = chunk->next;
+    munmap(chunk, chunk->size);
+    chunk = next;
+  }
+
+  voyeur_vfork_chunks = NULL;
+  voyeur_connection_set_vfork_parent(0);
+
+  if (result < 0) {
+    errno = (int) -result;
+    return -1;
+  }
+
+  return result;
+}
+
+#define VOYEUR_STRINGIFY_(_x) #_x
+#define VOYEUR_STRINGIFY(_x) VOYEUR_STRINGIFY_(_x)
+
+// This can't be written in C: the child returns from vfork() and then
+// keeps running on the parent's stack, so anything vfork() left in its
+// stack frame, including the return address, may be gone by the time
+// the parent resumes. Like glibc's version, we keep the return address
+// in a register across the system call.
+__asm__(".text\n"
+        ".globl vfork\n"
+        ".type vfork, @function\n"
+        "vfork:\n"
+        "  sub $8, %rsp\n"
+        "  call voyeur_prepare_vfork\n"
+        "  add $8, %rsp\n"
+        "  pop %rdi\n"
+        "  mov $" VOYEUR_STRINGIFY(SYS_vfork) ", %eax\n"
+        "  syscall\n"
+        "  push %rdi\n"
+        "  test %rax, %rax\n"
+        "  jz 1f\n"
+        "  mov %rax, %rdi\n"
+        "  sub $8, %rsp\n"
+        "  call voyeur_finish_vfork\n"
+        "  add $8, %rsp\n"
+        "1:\n"
+        "  ret\n"
+        ".size vfork, .-vfork\n");
+
+#else
+
 typedef pid_t (*vfork_fptr_t)();
 
 pid_t VOYEUR_FUNC(vfork)(void)
@@ -85,45 +413,61 @@ pid_t VOYEUR_FUNC(vfork)(void)
 
 VOYEUR_INTERPOSE(vfork)
 
+#endif
+
 
 //////////////////////////////////////////////////
-// execve
+// _exit, _Exit
 //////////////////////////////////////////////////
 
-typedef int (*execve_fptr_t)(const char*, char* const[], char* const []);
+// This library is always loaded, so it makes sure that events which
+// couldn't be sent yet aren't lost when a process exits without running
+// destructors, as forked children often do.
 
-int VOYEUR_FUNC(execve)(const char* path, char* const argv[], char* const envp[])
+void VOYEUR_FUNC(_exit)(int status)
 {
-  // In the case of exec we don't bother caching anything, since exec
-  // will wipe out this whole process image anyway.
-  const char* libs = getenv("LIBVOYEUR_LIBS");
-  const char* opts = getenv("LIBVOYEUR_OPTS");
-  uint8_t options = voyeur_decode_options(opts, VOYEUR_EVENT_EXEC);
-  const char* sockpath = getenv("LIBVOYEUR_SOCKET");
+  if (!voyeur_in_vfork_child()) {
+    pthread_once(&voyeur_exit_once, voyeur_init_exit_functions);
+  }
+
+  voyeur_connection_flush();
+
+  // Pass through the call to the real _exit.
+  VOYEUR_CALL_NEXT(_exit, status);
+  __builtin_unreachable();
+}
 
-  // Write the event to the socket.
-  int sock = voyeur_create_client_socket(sockpath);
-  if (sock >= 0) {
-    write_exec_event(sock, options, path, argv, envp, getpid(), getppid());
+VOYEUR_INTERPOSE(_exit)
 
-    // We might as well close the socket since there's no chance we'll
-    // ever be called a second time by the same process. (Even if the
-    // exec fails, generally the fork'd process will just bail.)
-    voyeur_write_msg_type(sock, VOYEUR_MSG_DONE);
-    voyeur_close_socket(sock);
+void VOYEUR_FUNC(_Exit)(int status)
+{
+  if (!voyeur_in_vfork_child()) {
+    pthread_once(&voyeur_exit_once, voyeur_init_exit_functions);
   }
 
-  // Add libvoyeur-specific environment variables. (We don't bother
-  // freeing 'buf' since we need it until the execve call and we have
-  // no way of freeing it after that.)
-  void* buf;
-  char** voyeur_envp =
-    voyeur_augment_environment(envp, libs, opts, sockpath, &buf);
+  voyeur_connection_flush();
+
+  // Pass through the call to the real _Exit.
+  VOYEUR_CALL_NEXT(_Exit, status);
+  __builtin_unreachable();
+}
+
+VOYEUR_INTERPOSE(_Exit)
+
+
+//////////////////////////////////////////////////
+// execve
+//////////////////////////////////////////////////
+
+int VOYEUR_FUNC(execve)(const char* path, char* const argv[], char* const envp[])
+{
+  int inherited;
+  char** voyeur_envp = prepare_exec(path, argv, envp, &inherited);
 
   // Pass through the call to the real execve.
-  VOYEUR_DECLARE_NEXT(execve_fptr_t, execve);
-  VOYEUR_LOOKUP_NEXT(execve_fptr_t, execve);
-  return VOYEUR_CALL_NEXT(execve, path, argv, voyeur_envp);
+  int retval = VOYEUR_CALL_NEXT(execve, path, argv, voyeur_envp);
+  fail_exec(inherited);
+  return retval;
 }
 
 VOYEUR_INTERPOSE(execve)
@@ -140,47 +484,54 @@ typedef int (*posix_spawn_fptr_t)(pid_t* restrict,
                                   char* const[restrict],
                                   char* const[restrict]);
 
-static pthread_mutex_t voyeur_posix_spawn_mutex = PTHREAD_MUTEX_INITIALIZER;
-static char voyeur_posix_spawn_initialized = 0;
+static pthread_once_t voyeur_posix_spawn_once = PTHREAD_ONCE_INIT;
 static char* voyeur_posix_spawn_libs = NULL;
 static char* voyeur_posix_spawn_opts = NULL;
 static uint8_t voyeur_posix_spawn_options = 0;
 static char* voyeur_posix_spawn_sockpath = NULL;
-static int voyeur_posix_spawn_sock = 0;
+static char* voyeur_posix_spawn_ring_name = NULL;
+static char* voyeur_posix_spawn_job = NULL;
+static char* voyeur_posix_spawn_fd = NULL;
+static char* voyeur_posix_spawn_env = NULL;
+static char* voyeur_posix_spawn_filter = NULL;
+static voyeur_ring* voyeur_posix_spawn_ring = NULL;
 VOYEUR_STATIC_DECLARE_NEXT(posix_spawn_fptr_t, posix_spawn);
 VOYEUR_STATIC_DECLARE_NEXT(posix_spawn_fptr_t, posix_spawnp);
 
-__attribute__((destructor)) void voyeur_cleanup_posix_spawn()
+static void send_posix_spawn_event(voyeur_buf* buf)
 {
-  pthread_mutex_lock(&voyeur_posix_spawn_mutex);
-
-  if (voyeur_posix_spawn_initialized) {
-    if (voyeur_posix_spawn_sock >= 0) {
-      voyeur_write_msg_type(voyeur_posix_spawn_sock, VOYEUR_MSG_DONE);
-      voyeur_close_socket(voyeur_posix_spawn_sock);
-      voyeur_posix_spawn_sock = -1;
-    }
-
-    voyeur_posix_spawn_initialized = 0;
+  // Events that don't fit in the ring go over the socket.
+  if (!voyeur_posix_spawn_ring ||
+      voyeur_ring_write(voyeur_posix_spawn_ring, buf) < 0) {
+    voyeur_connection_send(buf);
   }
-
-  pthread_mutex_unlock(&voyeur_posix_spawn_mutex);
 }
 
+// Nothing here changes after initialization, so once it's done,
+// posix_spawn calls on different threads can proceed in parallel.
 static void voyeur_init_posix_spawn()
 {
-  if (!voyeur_posix_spawn_initialized) {
-    voyeur_posix_spawn_libs = getenv("LIBVOYEUR_LIBS");
-    voyeur_posix_spawn_opts = getenv("LIBVOYEUR_OPTS");
-    voyeur_posix_spawn_options =
-      voyeur_decode_options(voyeur_posix_spawn_opts, VOYEUR_EVENT_EXEC);
-    voyeur_posix_spawn_sockpath = getenv("LIBVOYEUR_SOCKET");
-    voyeur_posix_spawn_sock =
-      voyeur_create_client_socket(voyeur_posix_spawn_sockpath);
-    VOYEUR_LOOKUP_NEXT(posix_spawn_fptr_t, posix_spawn);
-    VOYEUR_LOOKUP_NEXT(posix_spawn_fptr_t, posix_spawnp);
-    voyeur_posix_spawn_initialized = 1;
-  }
+  voyeur_posix_spawn_libs = getenv("LIBVOYEUR_LIBS");
+  voyeur_posix_spawn_opts = getenv("LIBVOYEUR_OPTS");
+  voyeur_posix_spawn_options =
+    voyeur_decode_options(voyeur_posix_spawn_opts, VOYEUR_EVENT_EXEC);
+  voyeur_posix_spawn_sockpath = getenv("LIBVOYEUR_SOCKET");
+  voyeur_posix_spawn_ring_name = getenv("LIBVOYEUR_RING");
+  voyeur_posix_spawn_job = getenv("LIBVOYEUR_JOB");
+
+  // Spawned processes don't inherit our connection, but their own
+  // children may inherit theirs.
+  voyeur_posix_spawn_fd = getenv("LIBVOYEUR_FD") ? "-1" : NULL;
+  voyeur_posix_spawn_env = getenv("LIBVOYEUR_ENV");
+  voyeur_posix_spawn_filter = getenv("LIBVOYEUR_FILTER");
+  voyeur_posix_spawn_ring =
+    voyeur_ring_attach(voyeur_posix_spawn_ring_name,
+                       voyeur_environment_job());
+  VOYEUR_LOOKUP_NEXT(posix_spawn_fptr_t, posix_spawn);
+  VOYEUR_LOOKUP_NEXT(posix_spawn_fptr_t, posix_spawnp);
+
+  // Attach the environment snapshot, which write_exec_event uses.
+  pthread_once(&voyeur_exec_once, voyeur_init_exec);
 }
 
 int VOYEUR_FUNC(posix_spawn)(pid_t* pid,
@@ -190,9 +541,7 @@ int VOYEUR_FUNC(posix_spawn)(pid_t* pid,
                              char* const argv[restrict],
                              char* const envp[restrict])
 {
-  pthread_mutex_lock(&voyeur_posix_spawn_mutex);
-
-  voyeur_init_posix_spawn();
+  pthread_once(&voyeur_posix_spawn_once, voyeur_init_posix_spawn);
 
   // Add libvoyeur-specific environment variables.
   void* buf;
@@ -201,6 +550,11 @@ int VOYEUR_FUNC(posix_spawn)(pid_t* pid,
                                voyeur_posix_spawn_libs,
                                voyeur_posix_spawn_opts,
                                voyeur_posix_spawn_sockpath,
+                               voyeur_posix_spawn_ring_name,
+                               voyeur_posix_spawn_job,
+                               voyeur_posix_spawn_fd,
+                               voyeur_posix_spawn_env,
+                               voyeur_posix_spawn_filter,
                                &buf);
 
   // Pass through the call to the real posix_spawn.
@@ -209,16 +563,16 @@ int VOYEUR_FUNC(posix_spawn)(pid_t* pid,
                                 file_actions, attrp,
                                 argv, voyeur_envp);
 
-  // Write the event to the socket.
-  if (voyeur_posix_spawn_sock >= 0) {
-    write_exec_event(voyeur_posix_spawn_sock,
-                     voyeur_posix_spawn_options,
-                     path, argv, envp,
-                     child_pid, getpid());
+  // Write the event.
+  if (exec_is_reported(voyeur_posix_spawn_options, path)) {
+    voyeur_buf event_buf;
+    voyeur_buf_init(&event_buf);
+    write_exec_event(&event_buf, voyeur_posix_spawn_options,
+                     path, argv, envp, child_pid, getpid());
+    send_posix_spawn_event(&event_buf);
+    voyeur_buf_destroy(&event_buf);
   }
 
-  pthread_mutex_unlock(&voyeur_posix_spawn_mutex);
-
   // Free the resources we allocated.
   free(voyeur_envp);
   free(buf);
@@ -259,7 +613,7 @@ VOYEUR_INTERPOSE(posix_spawn)
     length += 2;                                         \
                                                          \
     /* Create an appropriately sized _argv. */           \
-    _argv = malloc(sizeof(const char*) * length);        \
+    _argv = alloca(sizeof(const char*) * length);        \
     _argv[0] = (char *) _path;                           \
                                                          \
     /* Copy. */                                          \
@@ -313,35 +667,20 @@ VOYEUR_INTERPOSE(execv)
 // execlp, execvp, execvpe
 //////////////////////////////////////////////////
 
-typedef int (*execvpe_fptr_t)(const char*, char* const [], char* const []);
+// These all need to pass through to execvpe, since we need to provide
+// an environment.
 
 int VOYEUR_FUNC(execlp)(const char* path, const char* start, ...)
 {
-  const char* libs = getenv("LIBVOYEUR_LIBS");
-  const char* opts = getenv("LIBVOYEUR_OPTS");
-  uint8_t options = voyeur_decode_options(opts, VOYEUR_EVENT_EXEC);
-  const char* sockpath = getenv("LIBVOYEUR_SOCKET");
-
   char** argv;
   char** dummy_envp;
   VARARGS_TO_ARGV(start, path, argv, dummy_envp);
-  char** envp = environ;
-
-  int sock = voyeur_create_client_socket(sockpath);
-  if (sock >= 0) {
-    write_exec_event(sock, options, path, argv, envp, getpid(), getppid());
-    voyeur_write_msg_type(sock, VOYEUR_MSG_DONE);
-    voyeur_close_socket(sock);
-  }
-
-  void* buf;
-  char** voyeur_envp =
-    voyeur_augment_environment(envp, libs, opts, sockpath, &buf);
 
-  // Need to pass through to execvpe since we need to provide an environment.
-  VOYEUR_DECLARE_NEXT(execvpe_fptr_t, execvpe);
-  VOYEUR_LOOKUP_NEXT(execvpe_fptr_t, execvpe);
-  return VOYEUR_CALL_NEXT(execvpe, path, argv, voyeur_envp);
+  int inherited;
+  char** voyeur_envp = prepare_exec(path, argv, environ, &inherited);
+  int retval = VOYEUR_CALL_NEXT(execvpe, path, argv, voyeur_envp);
+  fail_exec(inherited);
+  return retval;
 }
 
 VOYEUR_INTERPOSE(execlp)
@@ -349,28 +688,11 @@ VOYEUR_INTERPOSE(execlp)
 
 int VOYEUR_FUNC(execvp)(const char* path, char* const argv[])
 {
-  const char* libs = getenv("LIBVOYEUR_LIBS");
-  const char* opts = getenv("LIBVOYEUR_OPTS");
-  uint8_t options = voyeur_decode_options(opts, VOYEUR_EVENT_EXEC);
-  const char* sockpath = getenv("LIBVOYEUR_SOCKET");
-
-  char** envp = environ;
-
-  int sock = voyeur_create_client_socket(sockpath);
-  if (sock >= 0) {
-    write_exec_event(sock, options, path, argv, envp, getpid(), getppid());
-    voyeur_write_msg_type(sock, VOYEUR_MSG_DONE);
-    voyeur_close_socket(sock);
-  }
-
-  void* buf;
-  char** voyeur_envp =
-    voyeur_augment_environment(envp, libs, opts, sockpath, &buf);
-
-  // Need to pass through to execvpe since we need to provide an environment.
-  VOYEUR_DECLARE_NEXT(execvpe_fptr_t, execvpe);
-  VOYEUR_LOOKUP_NEXT(execvpe_fptr_t, execvpe);
-  return VOYEUR_CALL_NEXT(execvpe, path, argv, voyeur_envp);
+  int inherited;
+  char** voyeur_envp = prepare_exec(path, argv, environ, &inherited);
+  int retval = VOYEUR_CALL_NEXT(execvpe, path, argv, voyeur_envp);
+  fail_exec(inherited);
+  return retval;
 }
 
 VOYEUR_INTERPOSE(execvp)
@@ -378,26 +700,11 @@ VOYEUR_INTERPOSE(execvp)
 
 int VOYEUR_FUNC(execvpe)(const char* path, char* const argv[], char* const envp[])
 {
-  const char* libs = getenv("LIBVOYEUR_LIBS");
-  const char* opts = getenv("LIBVOYEUR_OPTS");
-  uint8_t options = voyeur_decode_options(opts, VOYEUR_EVENT_EXEC);
-  const char* sockpath = getenv("LIBVOYEUR_SOCKET");
-
-  int sock = voyeur_create_client_socket(sockpath);
-  if (sock >= 0) {
-    write_exec_event(sock, options, path, argv, envp, getpid(), getppid());
-    voyeur_write_msg_type(sock, VOYEUR_MSG_DONE);
-    voyeur_close_socket(sock);
-  }
-
-  void* buf;
-  char** voyeur_envp =
-    voyeur_augment_environment(envp, libs, opts, sockpath, &buf);
-
-  // Pass through the call to the real execvpe.
-  VOYEUR_DECLARE_NEXT(execvpe_fptr_t, execvpe);
-  VOYEUR_LOOKUP_NEXT(execvpe_fptr_t, execvpe);
-  return VOYEUR_CALL_NEXT(execvpe, path, argv, voyeur_envp);
+  int inherited;
+  char** voyeur_envp = prepare_exec(path, argv, envp, &inherited);
+  int retval = VOYEUR_CALL_NEXT(execvpe, path, argv, voyeur_envp);
+  fail_exec(inherited);
+  return retval;
 }
 
 VOYEUR_INTERPOSE(execvpe)
@@ -414,9 +721,7 @@ int VOYEUR_FUNC(posix_spawnp)(pid_t* pid,
                               char* const argv[restrict],
                               char* const envp[restrict])
 {
-  pthread_mutex_lock(&voyeur_posix_spawn_mutex);
-
-  voyeur_init_posix_spawn();
+  pthread_once(&voyeur_posix_spawn_once, voyeur_init_posix_spawn);
 
   void* buf;
   char** voyeur_envp =
@@ -424,6 +729,11 @@ int VOYEUR_FUNC(posix_spawnp)(pid_t* pid,
                                voyeur_posix_spawn_libs,
                                voyeur_posix_spawn_opts,
                                voyeur_posix_spawn_sockpath,
+                               voyeur_posix_spawn_ring_name,
+                               voyeur_posix_spawn_job,
+                               voyeur_posix_spawn_fd,
+                               voyeur_posix_spawn_env,
+                               voyeur_posix_spawn_filter,
                                &buf);
 
   // Pass through the call to the real posix_spawnp.
@@ -432,15 +742,15 @@ int VOYEUR_FUNC(posix_spawnp)(pid_t* pid,
                                 file_actions, attrp,
                                 argv, voyeur_envp);
 
-  if (voyeur_posix_spawn_sock >= 0) {
-    write_exec_event(voyeur_posix_spawn_sock,
-                     voyeur_posix_spawn_options,
-                     path, argv, envp,
-                     child_pid, getpid());
+  if (exec_is_reported(voyeur_posix_spawn_options, path)) {
+    voyeur_buf event_buf;
+    voyeur_buf_init(&event_buf);
+    write_exec_event(&event_buf, voyeur_posix_spawn_options,
+                     path, argv, envp, child_pid, getpid());
+    send_posix_spawn_event(&event_buf);
+    voyeur_buf_destroy(&event_buf);
   }
 
-  pthread_mutex_unlock(&voyeur_posix_spawn_mutex);
-
   free(voyeur_envp);
   free(buf);
 
@@ -3,42 +3,122 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "dyld.h"
 #include "env.h"
+#include "event.h"
 #include "net.h"
+#include "ring.h"
+
+typedef void (*exit_fptr_t)(int);
+VOYEUR_STATIC_DECLARE_NEXT(exit_fptr_t, exit);
+VOYEUR_STATIC_DECLARE_NEXT(exit_fptr_t, _exit);
+VOYEUR_STATIC_DECLARE_NEXT(exit_fptr_t, _Exit);
+#ifdef __linux__
+VOYEUR_STATIC_DECLARE_NEXT(exit_fptr_t, exit_group);
+#endif
 
 static char did_exit_already = 0;
+static uint8_t voyeur_exit_opts = 0;
+static voyeur_ring* voyeur_exit_ring = NULL;
+
+// The vforked child, if any, that has reported its exit.
+static pid_t voyeur_vfork_exited = 0;
 
 //////////////////////////////////////////////////
 // Shared code for all exit*() functions.
 //////////////////////////////////////////////////
 
+// A vforked child shares our memory until it execs or exits, so when an
+// exec fails and the child exits instead, it mustn't touch our
+// connection, our heap, or did_exit_already, which would keep us from
+// ever reporting our own exit. It reports its exit through the ring, or
+// on a connection of its own, just as its exec would have been
+// reported. The only thing it records is its pid, since exit() would
+// otherwise report it a second time from the exit handler.
+static void write_vfork_exit_event(int status)
+{
+  pid_t pid = getpid();
+  if ((voyeur_exit_opts & OBSERVE_EXIT_SILENT) ||
+      voyeur_vfork_exited == pid) {
+    return;
+  }
+  voyeur_vfork_exited = pid;
+
+  // The event is small enough that the buffer never needs the heap.
+  voyeur_buf buf;
+  voyeur_buf_init(&buf);
+  voyeur_buf_begin_msg(&buf, VOYEUR_MSG_EVENT);
+  voyeur_buf_write_event_type(&buf, VOYEUR_EVENT_EXIT);
+  voyeur_buf_write_int(&buf, status);
+  voyeur_buf_write_pid(&buf, getppid());
+
+  // The ring's descriptors may have been closed since it was attached.
+  voyeur_ring* ring = voyeur_exit_ring;
+  if (!ring || voyeur_ring_check(ring) < 0 ||
+      voyeur_ring_write(ring, &buf) < 0) {
+    voyeur_send_once(&buf, 0);
+  }
+
+  voyeur_buf_destroy(&buf);
+}
+
 static void write_exit_event(int status)
 {
+  if (voyeur_in_vfork_child()) {
+    write_vfork_exit_event(status);
+    return;
+  }
+
   if (!did_exit_already) {
     did_exit_already = 1;
 
+    // Let the other hook libraries send what they've saved up first.
+    voyeur_run_exit_handlers();
+
+    if (voyeur_exit_opts & OBSERVE_EXIT_SILENT) {
+      voyeur_connection_close();
+      return;
+    }
+
     // In the case of exit we don't bother caching anything; we are about to exit,
     // after all!
-    const char* sockpath = getenv("LIBVOYEUR_SOCKET");
-    int sock = voyeur_create_client_socket(sockpath);
-    if (sock >= 0) {
-      voyeur_write_msg_type(sock, VOYEUR_MSG_EVENT);
-      voyeur_write_event_type(sock, VOYEUR_EVENT_EXIT);
-      voyeur_write_int(sock, status);
-      voyeur_write_pid(sock, getpid());
-      voyeur_write_pid(sock, getppid());
-
-      // We might as well close the socket since there's no chance we'll
-      // ever be called a second time by the same process.
-      voyeur_write_msg_type(sock, VOYEUR_MSG_DONE);
-      voyeur_close_socket(sock);
+    voyeur_buf buf;
+    voyeur_buf_init(&buf);
+    voyeur_buf_begin_msg(&buf, VOYEUR_MSG_EVENT);
+    voyeur_buf_write_event_type(&buf, VOYEUR_EVENT_EXIT);
+    voyeur_buf_write_int(&buf, status);
+    voyeur_buf_write_pid(&buf, getppid());
+
+    if (!voyeur_exit_ring || voyeur_ring_write(voyeur_exit_ring, &buf) < 0) {
+      // There's no chance we'll ever be called a second time by the same
+      // process, so we can tell libvoyeur we're done right away.
+      voyeur_connection_send(&buf);
+      voyeur_connection_close();
     }
+
+    voyeur_buf_destroy(&buf);
   }
 }
 
+// Looks everything up ahead of time, since a vforked child can't do it
+// itself.
+__attribute__((constructor)) void voyeur_init_exit()
+{
+  voyeur_exit_opts = voyeur_decode_options(getenv("LIBVOYEUR_OPTS"),
+                                           VOYEUR_EVENT_EXIT);
+  voyeur_exit_ring = voyeur_ring_attach(getenv("LIBVOYEUR_RING"),
+                                        voyeur_environment_job());
+  VOYEUR_LOOKUP_NEXT(exit_fptr_t, exit);
+  VOYEUR_LOOKUP_NEXT(exit_fptr_t, _exit);
+  VOYEUR_LOOKUP_NEXT(exit_fptr_t, _Exit);
+#ifdef __linux__
+  VOYEUR_LOOKUP_NEXT(exit_fptr_t, exit_group);
+#endif
+}
+
 
 //////////////////////////////////////////////////
 // exit*() variants.
@@ -48,15 +128,11 @@ static void write_exit_event(int status)
 // reliable, especially on Linux. We are still likely to miss the case where a
 // process gets signaled, unfortunately.
 
-typedef void (*exit_fptr_t)(int);
-
 void VOYEUR_FUNC(exit)(int status)
 {
   write_exit_event(status);
 
   // Pass through the call to the real exit.
-  VOYEUR_DECLARE_NEXT(exit_fptr_t, exit);
-  VOYEUR_LOOKUP_NEXT(exit_fptr_t, exit);
   return VOYEUR_CALL_NEXT(exit, status);
 }
 
@@ -67,8 +143,6 @@ void VOYEUR_FUNC(_exit)(int status)
   write_exit_event(status);
 
   // Pass through the call to the real _exit.
-  VOYEUR_DECLARE_NEXT(exit_fptr_t, _exit);
-  VOYEUR_LOOKUP_NEXT(exit_fptr_t, _exit);
   return VOYEUR_CALL_NEXT(_exit, status);
 }
 
@@ -79,8 +153,6 @@ void VOYEUR_FUNC(_Exit)(int status)
   write_exit_event(status);
 
   // Pass through the call to the real _Exit.
-  VOYEUR_DECLARE_NEXT(exit_fptr_t, _Exit);
-  VOYEUR_LOOKUP_NEXT(exit_fptr_t, _Exit);
   return VOYEUR_CALL_NEXT(_Exit, status);
 }
 
@@ -93,8 +165,6 @@ void VOYEUR_FUNC(exit_group)(int status)
   write_exit_event(status);
 
   // Pass through the call to the real exit_group.
-  VOYEUR_DECLARE_NEXT(exit_fptr_t, exit_group);
-  VOYEUR_LOOKUP_NEXT(exit_fptr_t, exit_group);
   return VOYEUR_CALL_NEXT(exit_group, status);
 }
 
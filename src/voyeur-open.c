@@ -2,57 +2,408 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "dyld.h"
 #include "env.h"
+#include "filter.h"
 #include "net.h"
+#include "ring.h"
 
 typedef int (*open_fptr_t)(const char*, int, ...);
 VOYEUR_STATIC_DECLARE_NEXT(open_fptr_t, open)
 
-static pthread_mutex_t voyeur_open_mutex = PTHREAD_MUTEX_INITIALIZER;
-static char voyeur_open_initialized = 0;
+static pthread_once_t voyeur_open_once = PTHREAD_ONCE_INIT;
 static uint8_t voyeur_open_opts = 0;
-static int voyeur_open_sock = 0;
+static voyeur_ring* voyeur_open_ring = NULL;
+static voyeur_filter* voyeur_open_filter = NULL;
 
-__attribute__((destructor)) void voyeur_cleanup_open()
+
+//////////////////////////////////////////////////
+// Tables of open() calls.
+//////////////////////////////////////////////////
+
+// With OBSERVE_OPEN_UNIQUE, the calls this process has reported, and
+// for summaries, the paths it has opened, in an open-addressed hash
+// table. Each key is a byte holding the kind of call, followed by the
+// path, a NUL, and, for relative paths, the working directory if it's
+// known. For OBSERVE_OPEN_UNIQUE the kind is the access mode and
+// whether the call succeeded; summaries just use 0, and collect the
+// kinds of access in 'access'.
+typedef struct {
+  size_t hash;
+  size_t len;
+  char* key;     // NULL if the slot is empty.
+  uint8_t access;
+} seen_open;
+
+static pthread_mutex_t voyeur_seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static seen_open* voyeur_seen = NULL;
+static size_t voyeur_seen_capacity = 0;
+static size_t voyeur_seen_count = 0;
+
+static size_t hash_bytes(size_t hash, const char* val, size_t len)
 {
-  pthread_mutex_lock(&voyeur_open_mutex);
+  // FNV-1a.
+  for (size_t i = 0 ; i < len ; ++i) {
+    hash ^= (unsigned char) val[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
 
-  if (voyeur_open_initialized) {
-    if (voyeur_open_sock >= 0) {
-      voyeur_write_msg_type(voyeur_open_sock, VOYEUR_MSG_DONE);
-      voyeur_close_socket(voyeur_open_sock);
-      voyeur_open_sock = -1;
+static void reset_seen()
+{
+  for (size_t i = 0 ; i < voyeur_seen_capacity ; ++i) {
+    free(voyeur_seen[i].key);
+  }
+  free(voyeur_seen);
+  voyeur_seen = NULL;
+  voyeur_seen_capacity = 0;
+  voyeur_seen_count = 0;
+}
+
+// Returns -1, leaving the table as it was, if there's no memory for a
+// bigger one.
+static int grow_seen()
+{
+  size_t capacity = voyeur_seen_capacity ? voyeur_seen_capacity * 2 : 256;
+  seen_open* seen = calloc(capacity, sizeof(seen_open));
+  if (!seen) {
+    return -1;
+  }
+
+  for (size_t i = 0 ; i < voyeur_seen_capacity ; ++i) {
+    if (voyeur_seen[i].key) {
+      size_t slot = voyeur_seen[i].hash & (capacity - 1);
+      while (seen[slot].key) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      seen[slot] = voyeur_seen[i];
     }
+  }
 
-    voyeur_open_initialized = 0;
+  free(voyeur_seen);
+  voyeur_seen = seen;
+  voyeur_seen_capacity = capacity;
+  return 0;
+}
+
+// Finds the entry for a call, adding it and setting 'added' if it's
+// new. Returns NULL if a new entry can't be allocated. Must be called
+// with the table's mutex held.
+static seen_open* find_seen(char kind, const char* path, const char* cwd,
+                            char* added)
+{
+  size_t path_len = strnlen(path, VOYEUR_MAX_STRLEN);
+  if (path[0] == '/' || !cwd) {
+    cwd = "";
+  }
+  size_t cwd_len = strnlen(cwd, VOYEUR_MAX_STRLEN);
+  size_t len = 1 + path_len + 1 + cwd_len;
+
+  size_t hash = hash_bytes(2166136261u, &kind, 1);
+  hash = hash_bytes(hash, path, path_len + 1);
+  hash = hash_bytes(hash, cwd, cwd_len);
+
+  // Keep the table at most half full.
+  if (2 * (voyeur_seen_count + 1) > voyeur_seen_capacity &&
+      grow_seen() < 0) {
+    return NULL;
+  }
+
+  size_t mask = voyeur_seen_capacity - 1;
+  size_t slot = hash & mask;
+  for ( ; voyeur_seen[slot].key ; slot = (slot + 1) & mask) {
+    seen_open* entry = &voyeur_seen[slot];
+    if (entry->hash == hash && entry->len == len &&
+        entry->key[0] == kind &&
+        memcmp(entry->key + 1, path, path_len + 1) == 0 &&
+        memcmp(entry->key + 2 + path_len, cwd, cwd_len) == 0) {
+      *added = 0;
+      return entry;
+    }
+  }
+
+  char* key = malloc(len);
+  if (!key) {
+    return NULL;
   }
+  key[0] = kind;
+  memcpy(key + 1, path, path_len);
+  key[1 + path_len] = '\0';
+  memcpy(key + 2 + path_len, cwd, cwd_len);
+
+  seen_open* entry = &voyeur_seen[slot];
+  entry->hash = hash;
+  entry->len = len;
+  entry->key = key;
+  entry->access = 0;
+  voyeur_seen_count++;
 
-  pthread_mutex_unlock(&voyeur_open_mutex);
+  *added = 1;
+  return entry;
 }
 
-int VOYEUR_FUNC(open)(const char* path, int oflag, ...)
+// Returns nonzero, and remembers the call, if no call like it has been
+// reported before. A call that can't be remembered is always reported.
+static int first_open(const char* path, int oflag, int retval,
+                      const char* cwd)
 {
-  pthread_mutex_lock(&voyeur_open_mutex);
-  
-  if (!voyeur_open_initialized) {
-    const char* voyeur_open_sockpath = getenv("LIBVOYEUR_SOCKET");
-    voyeur_open_opts = voyeur_decode_options(getenv("LIBVOYEUR_OPTS"),
-                                             VOYEUR_EVENT_OPEN);
-    voyeur_open_sock = voyeur_create_client_socket(voyeur_open_sockpath);
-    VOYEUR_LOOKUP_NEXT(open_fptr_t, open);
-    voyeur_open_initialized = 1;
+  char kind = (char) ((oflag & O_ACCMODE) | (retval >= 0 ? 4 : 0));
+  char added;
+  pthread_mutex_lock(&voyeur_seen_mutex);
+  seen_open* entry = find_seen(kind, path, cwd, &added);
+  pthread_mutex_unlock(&voyeur_seen_mutex);
+  return !entry || added;
+}
+
+// Returns the kinds of access a call adds to the summary, or 0 if it
+// isn't summarized at all.
+static uint8_t open_access(int oflag, int retval, int error)
+{
+  uint8_t access = 0;
+  if (retval >= 0) {
+    int mode = oflag & O_ACCMODE;
+    if (mode == O_RDONLY || mode == O_RDWR) {
+      access |= VOYEUR_ACCESS_READ;
+    }
+    if (mode == O_WRONLY || mode == O_RDWR) {
+      access |= VOYEUR_ACCESS_WRITE;
+    }
+  } else if (error == ENOENT || error == ENOTDIR) {
+    access |= VOYEUR_ACCESS_MISSING;
+  }
+  return access;
+}
+
+// Adds a call to the summary. If there's no memory for a new entry, the
+// call is left out.
+static void summarize_open(const char* path, uint8_t access, const char* cwd)
+{
+  char added;
+  pthread_mutex_lock(&voyeur_seen_mutex);
+  seen_open* entry = find_seen(0, path, cwd, &added);
+  if (entry) {
+    entry->access |= access;
+  }
+  pthread_mutex_unlock(&voyeur_seen_mutex);
+}
+
+// A forked child is a new process as far as the server is concerned, so
+// it starts with nothing seen.
+static void seen_prepare_fork()
+{
+  pthread_mutex_lock(&voyeur_seen_mutex);
+}
+
+static void seen_parent_fork()
+{
+  pthread_mutex_unlock(&voyeur_seen_mutex);
+}
+
+static void seen_child_fork()
+{
+  reset_seen();
+  pthread_mutex_unlock(&voyeur_seen_mutex);
+}
+
+
+//////////////////////////////////////////////////
+// open()
+//////////////////////////////////////////////////
+
+// The most an open event can take up: a directory, a name, and a
+// working directory, plus a few numbers.
+#define OPEN_EVENT_MAX (3 * VOYEUR_MAX_STRLEN + 64)
+
+// Sends an event through the ring if there is one and it takes the
+// event, or otherwise on this process's connection. A vforked child
+// can't use the connection, so it sends on one of its own.
+static void send_event_buf(voyeur_buf* buf)
+{
+  if (voyeur_open_ring && voyeur_ring_write(voyeur_open_ring, buf) == 0) {
+    return;
+  } else if (voyeur_in_vfork_child()) {
+    voyeur_send_once(buf, 0);
+  } else {
+    voyeur_connection_send(buf);
+  }
+}
+
+// Writes a string that's likely to repeat. Events that go over the
+// connection refer to it by id after the first time.
+static void write_repeated_string(voyeur_buf* buf, const char* val, size_t len)
+{
+  size_t id = voyeur_open_ring ? 0 : voyeur_connection_intern(val, len);
+  voyeur_buf_write_interned(buf, id, val, len);
+}
+
+// Writes an ordinary open event.
+static void write_open_event(voyeur_buf* buf, const char* path, int oflag,
+                             mode_t mode, int retval, const char* cwd)
+{
+  voyeur_buf_begin_msg(buf, VOYEUR_MSG_EVENT);
+  voyeur_buf_write_event_type(buf, VOYEUR_EVENT_OPEN);
+
+  // A process tends to open many files in the same few directories, so
+  // the directory is sent separately from the rest of the path.
+  const char* name = path;
+  size_t len = strnlen(name, VOYEUR_MAX_STRLEN);
+  while (len > 0 && name[len - 1] != '/') {
+    --len;
+  }
+  if (len > 0) {
+    write_repeated_string(buf, name, len);
+    name += len;
+  } else {
+    voyeur_buf_write_interned(buf, 0, "", 0);
+  }
+  voyeur_buf_write_string(buf, name, 0);
+  voyeur_buf_write_int(buf, oflag);
+
+  if (oflag & O_CREAT) {
+    voyeur_buf_write_int(buf, (int) mode);
+  } else {
+    voyeur_buf_write_int(buf, 0);
+  }
+
+  voyeur_buf_write_int(buf, retval);
+
+  if (voyeur_open_opts & OBSERVE_OPEN_CWD) {
+    write_repeated_string(buf, cwd, 0);
+  }
+}
+
+// Writes one path of a summary. Relative paths are joined to the
+// working directory they were opened in, and paths are split like those
+// of ordinary open events.
+static void write_summary_entry(voyeur_buf* buf, const char* path,
+                                const char* cwd, uint8_t access)
+{
+  char joined[2 * VOYEUR_MAX_STRLEN + 2];
+  if (cwd && *cwd && path[0] != '/') {
+    snprintf(joined, sizeof(joined), "%s/%s", cwd, path);
+    path = joined;
+  }
+
+  const char* name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  if (name > path) {
+    write_repeated_string(buf, path, name - path);
+  } else {
+    voyeur_buf_write_interned(buf, 0, "", 0);
+  }
+  voyeur_buf_write_string(buf, name, 0);
+  voyeur_buf_write_byte(buf, (char) access);
+}
+
+// Sends the summary of the paths this process has opened as a single
+// open event. The table starts over afterwards, in case the summary was
+// sent for an exec that fails.
+static void send_open_summary()
+{
+  pthread_mutex_lock(&voyeur_seen_mutex);
+  if (voyeur_seen_count == 0) {
+    pthread_mutex_unlock(&voyeur_seen_mutex);
+    return;
+  }
+
+  voyeur_buf buf;
+  voyeur_buf_init(&buf);
+  voyeur_buf_begin_msg(&buf, VOYEUR_MSG_EVENT);
+  voyeur_buf_write_event_type(&buf, VOYEUR_EVENT_OPEN);
+  voyeur_buf_write_size(&buf, voyeur_seen_count);
+
+  for (size_t i = 0 ; i < voyeur_seen_capacity ; ++i) {
+    seen_open* entry = &voyeur_seen[i];
+    if (entry->key) {
+      const char* path = entry->key + 1;
+      const char* cwd = path + strlen(path) + 1;
+      write_summary_entry(&buf, path, cwd, entry->access);
+    }
   }
 
+  reset_seen();
+  pthread_mutex_unlock(&voyeur_seen_mutex);
+
+  if (!voyeur_open_ring || voyeur_ring_write(voyeur_open_ring, &buf) < 0) {
+    voyeur_connection_send(&buf);
+  }
+
+  voyeur_buf_destroy(&buf);
+}
+
+// A vforked child can't add to its parent's summary, so it sends a
+// summary of its own for each call.
+//
+// It can't grow a buffer on its parent's heap either, so the vfork
+// functions build their events in a fixed buffer on the stack. That
+// buffer is big, so they're kept out of line, where ordinary calls don't
+// pay for it.
+__attribute__((noinline)) static void send_vfork_summary(const char* path,
+                                                         uint8_t access,
+                                                         const char* cwd)
+{
+  char data[OPEN_EVENT_MAX];
+  voyeur_buf buf;
+  voyeur_buf_init_fixed(&buf, data, sizeof(data));
+  voyeur_buf_begin_msg(&buf, VOYEUR_MSG_EVENT);
+  voyeur_buf_write_event_type(&buf, VOYEUR_EVENT_OPEN);
+  voyeur_buf_write_size(&buf, 1);
+  write_summary_entry(&buf, path, cwd, access);
+  send_event_buf(&buf);
+  voyeur_buf_destroy(&buf);
+}
+
+// Sends an ordinary open event from a vforked child.
+__attribute__((noinline)) static void send_vfork_open_event(const char* path,
+                                                            int oflag,
+                                                            mode_t mode,
+                                                            int retval,
+                                                            const char* cwd)
+{
+  char data[OPEN_EVENT_MAX];
+  voyeur_buf buf;
+  voyeur_buf_init_fixed(&buf, data, sizeof(data));
+  write_open_event(&buf, path, oflag, mode, retval, cwd);
+  send_event_buf(&buf);
+  voyeur_buf_destroy(&buf);
+}
+
+static void voyeur_init_open()
+{
+  voyeur_open_opts = voyeur_decode_options(getenv("LIBVOYEUR_OPTS"),
+                                           VOYEUR_EVENT_OPEN);
+  voyeur_open_ring = voyeur_ring_attach(getenv("LIBVOYEUR_RING"),
+                                        voyeur_environment_job());
+  voyeur_open_filter = voyeur_filter_create(getenv("LIBVOYEUR_FILTER"));
+  VOYEUR_LOOKUP_NEXT(open_fptr_t, open);
+
+  if (voyeur_open_opts & (OBSERVE_OPEN_UNIQUE | OBSERVE_OPEN_SUMMARY)) {
+    pthread_atfork(seen_prepare_fork, seen_parent_fork, seen_child_fork);
+  }
+
+  if (voyeur_open_opts & OBSERVE_OPEN_SUMMARY) {
+    voyeur_at_exit(send_open_summary);
+  }
+}
+
+int VOYEUR_FUNC(open)(const char* path, int oflag, ...)
+{
+  pthread_once(&voyeur_open_once, voyeur_init_open);
+
   // Extract the mode argument if necessary.
-  mode_t mode;
+  mode_t mode = 0;
   if (oflag & O_CREAT) {
     va_list args;
     va_start(args, oflag);
@@ -70,33 +421,56 @@ int VOYEUR_FUNC(open)(const char* path, int oflag, ...)
   } else {
     retval = VOYEUR_CALL_NEXT(open, path, oflag);
   }
+  // Reporting the call may connect or look up the working directory, but
+  // the caller should see the real open's errno.
+  int error = errno;
 
-  // Write the event to the socket.
-  if (voyeur_open_sock >= 0) {
-    voyeur_write_msg_type(voyeur_open_sock, VOYEUR_MSG_EVENT);
-    voyeur_write_event_type(voyeur_open_sock, VOYEUR_EVENT_OPEN);
-    voyeur_write_string(voyeur_open_sock, path, 0);
-    voyeur_write_int(voyeur_open_sock, oflag);
-
-    if (oflag & O_CREAT) {
-      voyeur_write_int(voyeur_open_sock, (int) mode);
-    } else {
-      voyeur_write_int(voyeur_open_sock, 0);
-    }
+  if (voyeur_open_filter && !voyeur_filter_match(voyeur_open_filter, path)) {
+    errno = error;
+    return retval;
+  }
 
-    voyeur_write_int(voyeur_open_sock, retval);
+  // getcwd() into a buffer on the stack doesn't allocate, and unlike a
+  // cache, it can't go stale when the directory changes behind our back.
+  char cwd_buf[PATH_MAX];
+  const char* cwd = NULL;
+  if ((voyeur_open_opts & OBSERVE_OPEN_CWD) ||
+      ((voyeur_open_opts & OBSERVE_OPEN_SUMMARY) && path[0] != '/')) {
+    cwd = getcwd(cwd_buf, sizeof(cwd_buf));
+  }
 
-    if (voyeur_open_opts & OBSERVE_OPEN_CWD) {
-      char* cwd = getcwd(NULL, 0);
-      voyeur_write_string(voyeur_open_sock, cwd, 0);
-      free(cwd);
+  // Summarized calls are only reported when the process exits.
+  if (voyeur_open_opts & OBSERVE_OPEN_SUMMARY) {
+    uint8_t access = open_access(oflag, retval, error);
+    if (access && voyeur_in_vfork_child()) {
+      send_vfork_summary(path, access, cwd);
+    } else if (access) {
+      summarize_open(path, access, cwd);
     }
+    errno = error;
+    return retval;
+  }
 
-    voyeur_write_pid(voyeur_open_sock, getpid());
+  // The table, and the heap it lives on, belong to a vforked child's
+  // parent, so the child reports all of its calls.
+  if ((voyeur_open_opts & OBSERVE_OPEN_UNIQUE) && !voyeur_in_vfork_child() &&
+      !first_open(path, oflag, retval, cwd)) {
+    errno = error;
+    return retval;
   }
 
-  pthread_mutex_unlock(&voyeur_open_mutex);
+  // Write the event.
+  if (voyeur_in_vfork_child()) {
+    send_vfork_open_event(path, oflag, mode, retval, cwd);
+  } else {
+    voyeur_buf buf;
+    voyeur_buf_init(&buf);
+    write_open_event(&buf, path, oflag, mode, retval, cwd);
+    send_event_buf(&buf);
+    voyeur_buf_destroy(&buf);
+  }
 
+  errno = error;
   return retval;
 }
 
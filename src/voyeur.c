@@ -3,12 +3,15 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -20,15 +23,84 @@
 #include <voyeur.h>
 #include "env.h"
 #include "event.h"
+#include "executor.h"
+#include "filter.h"
+#include "loop.h"
 #include "net.h"
+#include "ring.h"
 #include "util.h"
 
+// Per-connection state, indexed by file descriptor. The table grows as
+// needed, so there's no limit on the number of connections.
 typedef struct {
-  struct sockaddr_un sockinfo;
+  voyeur_recv_buf* recv_bufs;
+
+  // The process on the other end of each connection, as described by
+  // its HELLO message.
+  voyeur_sender* senders;
+  char* active;
+  int capacity;
+} connection_table;
+
+// Tracks a child process using a descriptor that becomes readable when
+// it exits. That's a pidfd where the kernel supports them; otherwise,
+// a helper thread waits for the child and writes its exit status to a
+// pipe.
+typedef struct {
+  pid_t pid;
+  int fd;
+  char is_pidfd;
+} child_watch;
+
+// A child process started by voyeur_spawn.
+typedef struct {
+  child_watch child;
+  char exited;
+  char reported;
+  int status;
+  voyeur_env_snapshot* env;
+} job_info;
+
+typedef struct {
+  char sockpath[sizeof(((struct sockaddr_un*) 0)->sun_path)];
   int server_sock;
+  voyeur_ring* ring;
   void* env_buf;
+  voyeur_env_snapshot* env;
+
+  // If the user asked for one, callbacks run on the executor's threads
+  // instead of the server's.
+  voyeur_executor* executor;
+
+  // The event loop watches the server socket, the ring, every
+  // connection, and, once we've started, the child process.
+  voyeur_loop* loop;
+  connection_table connections;
+  child_watch child;
+  char started;
+  char child_exited;
+  int child_status;
+
+  // Jobs started by voyeur_spawn. Job ids start at 1, so job 'id' is
+  // stored at jobs[id - 1]. A context is used either for voyeur_spawn
+  // or for voyeur_start, never both.
+  char spawning;
+  job_info* jobs;
+  int job_count;
+  int job_capacity;
+  int jobs_unreported;
+
+  // Set once the child has exited and every event has been handled.
+  char done;
+  int result;
+
+  // The number of events dispatched to callbacks or to the executor,
+  // which voyeur_process_events reports.
+  int dispatched;
 } server_state;
 
+static void close_server(server_state* state);
+
 voyeur_context_t voyeur_context_create()
 {
   voyeur_context* ctx = calloc(1, sizeof(voyeur_context));
@@ -43,9 +115,28 @@ void voyeur_context_destroy(voyeur_context_t ctx)
     free(context->resource_path);
   }
 
+  free(context->open_filter);
+
   if (context->server_state) {
     server_state* state = (server_state*) context->server_state;
+    close_server(state);
+    if (state->executor) {
+      voyeur_executor_destroy(state->executor);
+    }
+    if (state->ring) {
+      voyeur_ring_destroy(state->ring);
+    }
+    // The executor is gone, so nothing refers to the snapshots.
+    if (state->env) {
+      voyeur_env_snapshot_destroy(state->env);
+    }
+    for (int i = 0 ; i < state->job_count ; ++i) {
+      if (state->jobs[i].env) {
+        voyeur_env_snapshot_destroy(state->jobs[i].env);
+      }
+    }
     free(state->env_buf);
+    free(state->jobs);
     free(state);
   }
   
@@ -60,6 +151,55 @@ void voyeur_set_resource_path(voyeur_context_t ctx,
   strlcat(context->resource_path, path, 4096);
 }
 
+void voyeur_filter_open(voyeur_context_t ctx,
+                        const char* const include[],
+                        const char* const exclude[])
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  free(context->open_filter);
+  context->open_filter = voyeur_filter_encode(include, exclude);
+}
+
+void voyeur_set_ring_size(voyeur_context_t ctx, size_t size)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  context->ring_size = size;
+}
+
+void voyeur_set_io_uring(voyeur_context_t ctx, char enabled)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  context->io_uring_disabled = !enabled;
+}
+
+void voyeur_set_inherit_connection(voyeur_context_t ctx, char enabled)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  context->inherit_connection = enabled;
+}
+
+void voyeur_set_executor(voyeur_context_t ctx,
+                         int threads,
+                         size_t queue_size,
+                         voyeur_backpressure policy)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  context->executor_threads = threads;
+  context->executor_queue_size = queue_size;
+  context->executor_drop = policy == VOYEUR_BACKPRESSURE_DROP;
+}
+
+size_t voyeur_dropped_events(voyeur_context_t ctx)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  server_state* state = (server_state*) context->server_state;
+  if (!state || !state->executor) {
+    return 0;
+  }
+
+  return voyeur_executor_dropped(state->executor);
+}
+
 typedef struct {
   pid_t child_pid;
   int child_pipe_input;
@@ -98,6 +238,65 @@ static int start_waitpid_thread(pid_t child_pid)
   return waitpid_pipe[0];
 }
 
+// Starts tracking 'child_pid'. Returns -1 on failure.
+static int watch_child(child_watch* watch, pid_t child_pid)
+{
+  watch->pid = child_pid;
+  watch->is_pidfd = 0;
+
+#ifdef SYS_pidfd_open
+  // A pidfd lets the event loop wait for the child directly, so we
+  // don't need a thread and a pipe for each one.
+  watch->fd = syscall(SYS_pidfd_open, child_pid, 0);
+  if (watch->fd >= 0) {
+    watch->is_pidfd = 1;
+    return 0;
+  }
+#endif
+
+  watch->fd = start_waitpid_thread(child_pid);
+  return watch->fd;
+}
+
+// Stops tracking a child once its descriptor is readable, and stores
+// its exit status in 'status'.
+static void reap_child(voyeur_loop* loop, child_watch* watch, int* status)
+{
+  if (watch->is_pidfd) {
+    while (waitpid(watch->pid, status, 0) < 0 && errno == EINTR) {
+      continue;
+    }
+  } else {
+    voyeur_read_int(watch->fd, status);
+  }
+
+  voyeur_loop_remove(loop, watch->fd);
+  voyeur_close_socket(watch->fd);
+  watch->fd = -1;
+}
+
+// Kills and reaps a child we couldn't start tracking, so it doesn't
+// outlive a failed voyeur_spawn.
+static void abandon_child(child_watch* watch)
+{
+  kill(watch->pid, SIGKILL);
+
+  if (watch->fd >= 0 && !watch->is_pidfd) {
+    // The waitpid thread reaps the child for us.
+    int status;
+    voyeur_read_int(watch->fd, &status);
+  } else {
+    while (waitpid(watch->pid, NULL, 0) < 0 && errno == EINTR) {
+      continue;
+    }
+  }
+
+  if (watch->fd >= 0) {
+    voyeur_close_socket(watch->fd);
+    watch->fd = -1;
+  }
+}
+
 static int accept_connection(int server_sock)
 {
   struct sockaddr_un client_info;
@@ -105,15 +304,43 @@ static int accept_connection(int server_sock)
 
   int client_sock =
     accept(server_sock, (struct sockaddr *) &client_info, &client_info_len);
-  WARN_ON_FAIL_VALUE(client_sock, "accept");
-  
+  if (client_sock < 0) {
+    // The server socket is non-blocking, so this is how we find out
+    // that every pending connection has been accepted.
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      WARN_ON_FAIL_VALUE(client_sock, "accept");
+    }
+    return -1;
+  }
+
+  // Client sockets are non-blocking, so that a client that stops in the
+  // middle of a message can't stall the server.
+  fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL) | O_NONBLOCK);
+
   return client_sock;
 }
 
-static int handle_message(voyeur_context* context, int sock)
+// Returns the snapshot of the environment 'job' started with, if any.
+static const voyeur_env_snapshot* job_environment(server_state* state,
+                                                  int job)
+{
+  if (job == 0) {
+    return state->env;
+  } else if (job > 0 && job <= state->job_count) {
+    return state->jobs[job - 1].env;
+  }
+
+  return NULL;
+}
+
+// Handles a single message from 'sender'. A HELLO message fills it in.
+static int handle_frame(voyeur_context* context,
+                        voyeur_sender* sender,
+                        voyeur_buf* buf)
 {
   voyeur_msg_type msgtype;
-  if (voyeur_read_msg_type(sock, &msgtype) < 0) {
+  if (voyeur_buf_read_msg_type(buf, &msgtype) < 0) {
+    // The message was malformed.
     return -1;
   }
 
@@ -122,13 +349,49 @@ static int handle_message(voyeur_context* context, int sock)
     return -1;
   } else if (msgtype == VOYEUR_MSG_EVENT) {
     voyeur_event_type type;
-    if (voyeur_read_event_type(sock, &type) < 0) {
+    if (voyeur_buf_read_event_type(buf, &type) < 0) {
       return -1;
     }
 
-    // Got a voyeur event; dispatch to the appropriate handler.
-    voyeur_handle_event(context, type, sock);
+    // Got a voyeur event; dispatch to the appropriate handler, or hand
+    // it off to the executor if there is one.
+    server_state* state = (server_state*) context->server_state;
+    state->dispatched++;
+    if (state->executor) {
+      voyeur_executor_submit(state->executor, type, sender, buf);
+    } else {
+      voyeur_handle_event(context, type, sender, buf);
+    }
     return 0;
+  } else if (msgtype == VOYEUR_MSG_HELLO) {
+    // The client is telling us who it is.
+    size_t version;
+    if (voyeur_buf_read_size(buf, &version) < 0 ||
+        version != VOYEUR_PROTOCOL_VERSION) {
+      voyeur_log("Unsupported protocol version\n");
+      return -1;
+    }
+
+    if (voyeur_buf_read_int(buf, &sender->job) < 0 ||
+        voyeur_buf_read_pid(buf, &sender->pid) < 0) {
+      return -1;
+    }
+
+    server_state* state = (server_state*) context->server_state;
+    sender->env = job_environment(state, sender->job);
+
+    // Each HELLO starts a new table of interned strings.
+    if (sender->strings) {
+      voyeur_string_table_release(sender->strings);
+    }
+    sender->strings = voyeur_string_table_create();
+    return sender->strings ? 0 : -1;
+  } else if (msgtype == VOYEUR_MSG_STRING) {
+    // The client is interning a string.
+    if (!sender->strings) {
+      return -1;
+    }
+    return voyeur_string_table_define(sender->strings, buf);
   } else {
     // Got an unknown message type.
     voyeur_log("Unknown message type\n");
@@ -136,94 +399,509 @@ static int handle_message(voyeur_context* context, int sock)
   }
 }
 
-static int run_server(voyeur_context* context,
-                      int server_sock,
-                      int child_pipe_output)
+// Handles every complete message in a connection's buffer. Any partial
+// message at the end stays buffered until the rest of it arrives.
+// Returns -1 if the connection should be closed.
+static int handle_buffered_input(voyeur_context* context,
+                                 voyeur_sender* sender,
+                                 voyeur_recv_buf* recv_buf)
 {
-  fd_set active_fd_set, read_fd_set, error_fd_set;
-  FD_ZERO(&active_fd_set);
-  FD_SET(server_sock, &active_fd_set);
-  FD_SET(child_pipe_output, &active_fd_set);
-  
-  int child_exited = 0;
-  int child_status = 0;
-  
-  while (!child_exited) {
-    // Block until input arrives.
-    read_fd_set = active_fd_set;
-    error_fd_set = active_fd_set;
-    if (select(FD_SETSIZE, &read_fd_set, NULL, &error_fd_set, NULL) < 0) {
-      if (errno == EAGAIN || errno == EINTR) {
-        continue;  // This is a temporary error.
-      } else {
-        perror("select");
-        break;     // This is unrecoverable.
+  int status;
+  voyeur_buf buf;
+  while ((status = voyeur_recv_buf_next(recv_buf, &buf)) > 0) {
+    if (handle_frame(context, sender, &buf) < 0) {
+      return -1;
+    }
+  }
+
+  return status;
+}
+
+// Reads whatever input is available on a connection and handles every
+// complete message it contains. Returns -1 if the connection should be
+// closed.
+static int handle_input(voyeur_context* context,
+                        int sock,
+                        voyeur_sender* sender,
+                        voyeur_recv_buf* recv_buf)
+{
+  ssize_t in = voyeur_recv_buf_fill(sock, recv_buf);
+  if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;  // Spurious wakeup.
+  } else if (in <= 0) {
+    return -1;
+  }
+
+  return handle_buffered_input(context, sender, recv_buf);
+}
+
+// Handles data that the event loop received on a connection. Returns
+// -1 if the connection should be closed.
+static int handle_data(voyeur_context* context,
+                       const char* data,
+                       size_t size,
+                       voyeur_sender* sender,
+                       voyeur_recv_buf* recv_buf)
+{
+  if (voyeur_recv_buf_empty(recv_buf)) {
+    // Handle complete messages in place, and only copy what's left.
+    ssize_t used;
+    voyeur_buf buf;
+    while ((used = voyeur_buf_parse(&buf, data, size)) > 0) {
+      if (handle_frame(context, sender, &buf) < 0) {
+        return -1;
+      }
+      data += used;
+      size -= used;
+    }
+
+    if (used < 0) {
+      return -1;
+    }
+  }
+
+  if (size == 0) {
+    return 0;
+  }
+
+  if (voyeur_recv_buf_append(recv_buf, data, size) < 0) {
+    return -1;
+  }
+
+  return handle_buffered_input(context, sender, recv_buf);
+}
+
+static void handle_ring_message(voyeur_buf* buf,
+                                int job,
+                                pid_t pid,
+                                void* context)
+{
+  // Messages in the ring aren't associated with a connection, so
+  // there's nothing to do if they fail.
+  server_state* state =
+    (server_state*) ((voyeur_context*) context)->server_state;
+  voyeur_sender sender = { job, pid, NULL, job_environment(state, job) };
+  handle_frame((voyeur_context*) context, &sender, buf);
+}
+
+static int add_connection(connection_table* table, int fd)
+{
+  if (fd >= table->capacity) {
+    int capacity = table->capacity ? table->capacity : 64;
+    while (capacity <= fd) {
+      capacity *= 2;
+    }
+
+    voyeur_recv_buf* recv_bufs =
+      realloc(table->recv_bufs, capacity * sizeof(voyeur_recv_buf));
+    if (!recv_bufs) {
+      return -1;
+    }
+    table->recv_bufs = recv_bufs;
+
+    voyeur_sender* senders =
+      realloc(table->senders, capacity * sizeof(voyeur_sender));
+    if (!senders) {
+      return -1;
+    }
+    table->senders = senders;
+
+    char* active = realloc(table->active, capacity);
+    if (!active) {
+      return -1;
+    }
+    table->active = active;
+
+    memset(table->recv_bufs + table->capacity, 0,
+           (capacity - table->capacity) * sizeof(voyeur_recv_buf));
+    memset(table->active + table->capacity, 0, capacity - table->capacity);
+    table->capacity = capacity;
+  }
+
+  voyeur_recv_buf_init(&table->recv_bufs[fd]);
+  table->senders[fd].job = 0;
+  table->senders[fd].pid = 0;
+  table->senders[fd].strings = NULL;
+  table->senders[fd].env = NULL;
+  table->active[fd] = 1;
+  return 0;
+}
+
+// Starts watching a newly accepted connection.
+static void watch_connection(connection_table* table,
+                             voyeur_loop* loop,
+                             int fd)
+{
+  if (add_connection(table, fd) < 0) {
+    voyeur_log("Couldn't allocate state for new connection\n");
+    voyeur_close_socket(fd);
+  } else if (voyeur_loop_add_stream(loop, fd) < 0) {
+    voyeur_log("Couldn't watch new connection\n");
+    voyeur_close_socket(fd);
+    voyeur_recv_buf_destroy(&table->recv_bufs[fd]);
+    table->active[fd] = 0;
+  }
+}
+
+static void close_connection(connection_table* table,
+                             voyeur_loop* loop,
+                             int fd)
+{
+  voyeur_loop_remove(loop, fd);
+  voyeur_close_socket(fd);
+  voyeur_recv_buf_destroy(&table->recv_bufs[fd]);
+  table->active[fd] = 0;
+
+  // Events still queued for the executor keep their own reference.
+  if (table->senders[fd].strings) {
+    voyeur_string_table_release(table->senders[fd].strings);
+    table->senders[fd].strings = NULL;
+  }
+}
+
+// If 'fd' announces that a job has exited, records its exit status and
+// returns 1. Otherwise, returns 0.
+static int handle_job_exit(server_state* state, int fd)
+{
+  for (int i = 0 ; i < state->job_count ; ++i) {
+    job_info* job = &state->jobs[i];
+    if (job->child.fd == fd) {
+      job->exited = 1;
+      reap_child(state->loop, &job->child, &job->status);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+#define MAX_EVENTS 64
+#define VOYEUR_DEFAULT_QUEUE_SIZE 1024
+
+// Waits for at most 'timeout_ms' milliseconds for input and handles up
+// to 'max' events. Returns the number of events handled, plus one if
+// the ring still has messages waiting, or -1 if an unrecoverable error
+// occurred.
+static int handle_events(voyeur_context* context,
+                         server_state* state,
+                         int timeout_ms,
+                         int max)
+{
+  connection_table* connections = &state->connections;
+  int ring_fd = state->ring ? voyeur_ring_fd(state->ring) : -1;
+
+  // Don't block if messages are already waiting in the ring.
+  int ring_pending = 0;
+  if (state->ring) {
+    voyeur_ring_drain(state->ring, handle_ring_message, context);
+    if (voyeur_ring_prepare_to_wait(state->ring) < 0) {
+      ring_pending = 1;
+      timeout_ms = 0;
+    }
+  }
+
+  // Block until input arrives.
+  voyeur_loop_event events[MAX_EVENTS];
+  if (max <= 0 || max > MAX_EVENTS) {
+    max = MAX_EVENTS;
+  }
+  int count = voyeur_loop_wait(state->loop, events, max, timeout_ms);
+  if (count < 0) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return ring_pending;  // This is a temporary error.
+    } else {
+      perror("voyeur_loop_wait");
+      return -1;            // This is unrecoverable.
+    }
+  }
+
+  for (int i = 0 ; i < count ; ++i) {
+    voyeur_loop_event* event = &events[i];
+    int fd = event->fd;
+    int is_connection = fd < connections->capacity && connections->active[fd];
+
+    if (event->type == VOYEUR_LOOP_ACCEPTED) {
+      watch_connection(connections, state->loop, event->client);
+    } else if (event->type == VOYEUR_LOOP_DATA) {
+      if (is_connection &&
+          handle_data(context, event->data, event->size,
+                      &connections->senders[fd],
+                      &connections->recv_bufs[fd]) < 0) {
+        close_connection(connections, state->loop, fd);
+      }
+    } else if (event->type == VOYEUR_LOOP_CLOSED) {
+      if (is_connection) {
+        close_connection(connections, state->loop, fd);
+      }
+    } else if (fd == ring_fd) {
+      // The ring is drained at the top of the loop.
+      continue;
+    } else if (fd == state->server_sock) {
+      // Accept everything that's waiting, so that a burst of new
+      // processes isn't admitted one per trip around the loop.
+      int client_sock;
+      while ((client_sock = accept_connection(state->server_sock)) >= 0) {
+        watch_connection(connections, state->loop, client_sock);
+      }
+    } else if (fd == state->child.fd) {
+      state->child_exited = 1;
+      reap_child(state->loop, &state->child, &state->child_status);
+    } else if (is_connection) {
+      if (handle_input(context, fd, &connections->senders[fd],
+                       &connections->recv_bufs[fd]) < 0) {
+        close_connection(connections, state->loop, fd);
       }
+    } else {
+      handle_job_exit(state, fd);
     }
+  }
+
+  return count + ring_pending;
+}
 
-    for (int fd = 0 ; fd < FD_SETSIZE ; ++fd) {
-      if (FD_ISSET(fd, &error_fd_set)) {
-        voyeur_log("Closed file descriptor due to error\n");
+// Releases the event loop, the connections, and the server socket.
+// It's safe to call this more than once.
+static void close_server(server_state* state)
+{
+  if (state->loop) {
+    connection_table* connections = &state->connections;
+    for (int fd = 0 ; fd < connections->capacity ; ++fd) {
+      if (connections->active[fd]) {
+        close_connection(connections, state->loop, fd);
+      }
+    }
+    free(connections->recv_bufs);
+    free(connections->senders);
+    free(connections->active);
+    memset(connections, 0, sizeof(connection_table));
+
+    if (state->child.fd >= 0) {
+      voyeur_loop_remove(state->loop, state->child.fd);
+      voyeur_close_socket(state->child.fd);
+      state->child.fd = -1;
+    }
+
+    for (int i = 0 ; i < state->job_count ; ++i) {
+      int fd = state->jobs[i].child.fd;
+      if (fd >= 0) {
+        voyeur_loop_remove(state->loop, fd);
         voyeur_close_socket(fd);
-        FD_CLR(fd, &active_fd_set);
-      } else if (FD_ISSET(fd, &read_fd_set)) {
-        if (fd == server_sock) {
-          int client_sock = accept_connection(server_sock);
-          if (client_sock >= 0) {
-            FD_SET(client_sock, &active_fd_set);
-          }
-        } else if (fd == child_pipe_output) {
-          child_exited = 1;
-          voyeur_read_int(fd, &child_status);
-          voyeur_close_socket(fd);
-          FD_CLR(fd, &active_fd_set);
-        } else if (handle_message(context, fd) < 0) {
-          voyeur_close_socket(fd);
-          FD_CLR(fd, &active_fd_set);
-        }
+        state->jobs[i].child.fd = -1;
       }
     }
+
+    voyeur_loop_remove(state->loop, state->server_sock);
+    voyeur_loop_destroy(state->loop);
+    state->loop = NULL;
+  }
+
+  if (state->server_sock >= 0) {
+    voyeur_destroy_server_socket(state->server_sock, state->sockpath);
+    state->server_sock = -1;
+  }
+}
+
+// Handles everything that's pending without blocking. After a child
+// exits, this picks up anything it sent that hasn't been handled yet,
+// including connections that were only just accepted. If there's an
+// executor, this waits for it to run the callbacks as well.
+static void drain_events(voyeur_context* context, server_state* state)
+{
+  while (handle_events(context, state, 0, MAX_EVENTS) > 0) {
+    continue;
+  }
+
+  if (state->executor) {
+    voyeur_executor_drain(state->executor);
+  }
+}
+
+// Converts a status from waitpid into the exit status we report.
+static int exit_status(int status)
+{
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
   }
 
-  voyeur_close_socket(server_sock);
+  fprintf(stderr, "libvoyeur: child process did not terminate normally\n");
+  return -1;
+}
+
+// Handles whatever input remains after the child has exited (or after
+// an unrecoverable error) and shuts the server down.
+static void finish_server(voyeur_context* context, server_state* state)
+{
+  drain_events(context, state);
+
+  close_server(state);
+  state->done = 1;
+  state->result = state->child_exited ? exit_status(state->child_status) : -1;
+}
 
-  // Clean up any stragglers.
-  for (int fd = 0 ; fd < FD_SETSIZE ; ++fd) {
-    if (FD_ISSET(fd, &active_fd_set)) {
-      voyeur_close_socket(fd);
+// Prepares for the caller to wait on our descriptor.
+static void settle_server(voyeur_context* context, server_state* state)
+{
+  // If we stopped with messages still in the ring, we have to catch up
+  // before returning, since nothing will wake our descriptor for them.
+  if (!state->done && state->ring) {
+    while (voyeur_ring_prepare_to_wait(state->ring) < 0) {
+      voyeur_ring_drain(state->ring, handle_ring_message, context);
     }
   }
-  
-  if (WIFEXITED(child_status)) {
-    return WEXITSTATUS(child_status);
-  } else {
-    fprintf(stderr, "libvoyeur: child process did not terminate normally\n");
-    return -1;
+
+  if (state->loop) {
+    voyeur_loop_flush(state->loop);
   }
 }
 
-char** voyeur_prepare(voyeur_context_t ctx, char* const envp[])
+// Runs one iteration of the server. This is shared by voyeur_start and
+// voyeur_process_events. Returns the same thing as handle_events.
+static int step_server(voyeur_context* context,
+                       server_state* state,
+                       int timeout_ms,
+                       int max)
+{
+  if (state->child_exited) {
+    finish_server(context, state);
+    return 0;
+  }
+
+  int count = handle_events(context, state, timeout_ms, max);
+  if (count < 0) {
+    finish_server(context, state);
+  }
+
+  return count;
+}
+
+// Creates the server socket, the ring, and the event loop. Returns
+// NULL on failure.
+static server_state* create_server(voyeur_context* context)
 {
-  voyeur_context* context = (voyeur_context*) ctx;
   server_state* state = calloc(1, sizeof(server_state));
   context->server_state = (void*) state;
 
+  state->child.fd = -1;
+  state->server_sock = voyeur_create_server_socket(state->sockpath,
+                                                  sizeof(state->sockpath));
+  if (state->server_sock < 0) {
+    return NULL;
+  }
+
+  // Set up the ring, if requested. If that fails, we'll just use the
+  // socket.
+  if (context->ring_size > 0) {
+    state->ring = voyeur_ring_create(context->ring_size);
+  }
+
+  // Set up the event loop.
+  state->loop = voyeur_loop_create(!context->io_uring_disabled);
+  if (!state->loop) {
+    perror("voyeur_loop_create");
+    return NULL;
+  }
+
+  voyeur_loop_add_listener(state->loop, state->server_sock);
+  if (state->ring) {
+    voyeur_loop_add(state->loop, voyeur_ring_fd(state->ring));
+  }
+
+  // Set up the executor, if requested. If that fails, callbacks will
+  // just run on the server's thread.
+  if (context->executor_threads > 0) {
+    state->executor =
+      voyeur_executor_create(context,
+                             context->executor_threads,
+                             context->executor_queue_size
+                               ? context->executor_queue_size
+                               : VOYEUR_DEFAULT_QUEUE_SIZE,
+                             context->executor_drop);
+  }
+
+  return state;
+}
+
+// Creates the environment for a child process. 'job' may be NULL. If
+// exec events include the environment, the new environment is stored
+// in a snapshot, which is returned in 'env_out', so that the job's
+// processes can send only what they've changed; otherwise 'env_out' is
+// set to NULL.
+static char** create_environment(voyeur_context* context,
+                                 server_state* state,
+                                 char* const envp[],
+                                 const char* job,
+                                 void** buf_out,
+                                 voyeur_env_snapshot** env_out)
+{
+  voyeur_env_snapshot* env = NULL;
+  if (context->exec_opts & OBSERVE_EXEC_ENV) {
+    env = voyeur_env_snapshot_create();
+  }
+
+  char* libs = voyeur_requested_libs(context);
+  char* opts = voyeur_requested_opts(context);
+  char** newenvp =
+    voyeur_augment_environment(envp, libs, opts,
+                               state->sockpath,
+                               state->ring ? voyeur_ring_name(state->ring)
+                                           : NULL,
+                               job,
+                               context->inherit_connection ? "-1" : NULL,
+                               env ? voyeur_env_snapshot_name(env) : NULL,
+                               context->open_filter,
+                               buf_out);
+
+  // Without a snapshot, the job's processes send their whole
+  // environment.
+  if (env && voyeur_env_snapshot_fill(env, newenvp) < 0) {
+    voyeur_env_snapshot_destroy(env);
+    env = NULL;
+  }
+
+  *env_out = env;
+  return newenvp;
+}
+
+char** voyeur_prepare(voyeur_context_t ctx, char* const envp[])
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  if (context->server_state) {
+    return NULL;
+  }
+
   // Prepare the server. We need to do this in advance both to avoid
   // racing and so that we can include the socket path in the
   // environment variables.
-  state->server_sock = voyeur_create_server_socket(&state->sockinfo);
-  if (state->server_sock < 0) {
+  server_state* state = create_server(context);
+  if (!state) {
     return NULL;
   }
-  
+
   // Add libvoyeur-specific environment variables.
-  char* libs = voyeur_requested_libs(context);
-  char* opts = voyeur_requested_opts(context);
-  char** voyeur_envp = voyeur_augment_environment(envp, libs, opts,
-                                                  state->sockinfo.sun_path,
-                                                  &state->env_buf);
+  // The snapshot's memfd stays open until the context is destroyed,
+  // since we don't know when the child will be started.
+  return create_environment(context, state, envp, NULL, &state->env_buf,
+                            &state->env);
+}
+
+int voyeur_start_async(voyeur_context_t ctx, pid_t child_pid)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  server_state* state = (server_state*) context->server_state;
+  if (!state || !state->loop || state->started || state->spawning) {
+    return -1;
+  }
+
+  if (watch_child(&state->child, child_pid) < 0 ||
+      voyeur_loop_add(state->loop, state->child.fd) < 0) {
+    return -1;
+  }
+
+  // The caller may wait on our descriptor before calling us again.
+  voyeur_loop_flush(state->loop);
 
-  return voyeur_envp;
+  state->started = 1;
+  return 0;
 }
 
 int voyeur_start(voyeur_context_t ctx, pid_t child_pid)
@@ -231,21 +909,71 @@ int voyeur_start(voyeur_context_t ctx, pid_t child_pid)
   voyeur_context* context = (voyeur_context*) ctx;
   server_state* state = (server_state*) context->server_state;
 
+  if (voyeur_start_async(ctx, child_pid) < 0) {
+    return -1;
+  }
+
   // Run the server.
-  int child_pipe_output = start_waitpid_thread(child_pid);
-  int res = run_server(context,
-                       state->server_sock,
-                       child_pipe_output);
+  while (!state->done) {
+    step_server(context, state, -1, MAX_EVENTS);
+  }
+
+  return state->result;
+}
+
+int voyeur_get_fd(voyeur_context_t ctx)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  server_state* state = (server_state*) context->server_state;
+  if (!state || !state->loop) {
+    return -1;
+  }
+
+  return voyeur_loop_fd(state->loop);
+}
+
+int voyeur_process_events(voyeur_context_t ctx, int max_events)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  server_state* state = (server_state*) context->server_state;
+  if (!state || !state->started) {
+    return -1;
+  }
+
+  // Once the child has exited, keep going until we're done regardless
+  // of 'max_events'; there may be nothing left to make our descriptor
+  // readable again. The loop's own count is of input, not events, so
+  // it's only used to tell when nothing is left.
+  state->dispatched = 0;
+  while (!state->done &&
+         (max_events <= 0 || state->dispatched < max_events ||
+          state->child_exited)) {
+    int budget = max_events > 0 ? max_events - state->dispatched : MAX_EVENTS;
+    int count = step_server(context, state, 0, budget);
+    if (count < 0) {
+      return -1;
+    } else if (count == 0 && !state->child_exited) {
+      break;
+    }
+  }
+
+  settle_server(context, state);
+  return state->dispatched;
+}
+
+int voyeur_is_done(voyeur_context_t ctx, int* status)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  server_state* state = (server_state*) context->server_state;
+  if (!state || !state->done) {
+    return 0;
+  }
 
-  // Clean up the socket file.
-  WARN_ON_FAIL(unlink, state->sockinfo.sun_path);
-  char* last_slash = strrchr(state->sockinfo.sun_path, '/');
-  if (last_slash) {
-    *last_slash = '\0';
+  if (status) {
+    *status = state->result;
   }
-  WARN_ON_FAIL(rmdir, state->sockinfo.sun_path);
 
-  return res;
+  return 1;
 }
 
 int voyeur_exec(voyeur_context_t ctx,
@@ -268,3 +996,133 @@ int voyeur_exec(voyeur_context_t ctx,
   free(voyeur_envp);
   return retval;
 }
+
+int voyeur_spawn(voyeur_context_t ctx,
+                 const char* path,
+                 char* const argv[],
+                 char* const envp[],
+                 int* job_id)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  server_state* state = (server_state*) context->server_state;
+  if (!state) {
+    state = create_server(context);
+    if (!state) {
+      return -1;
+    }
+    state->spawning = 1;
+    state->started = 1;
+  } else if (!state->spawning || !state->loop) {
+    return -1;
+  }
+
+  if (state->job_count == state->job_capacity) {
+    int capacity = state->job_capacity ? state->job_capacity * 2 : 16;
+    job_info* jobs = realloc(state->jobs, capacity * sizeof(job_info));
+    if (!jobs) {
+      return -1;
+    }
+    state->jobs = jobs;
+    state->job_capacity = capacity;
+  }
+
+  // The job id is passed down to the child, and every process it
+  // creates, through the environment.
+  int id = state->job_count + 1;
+  char job[16];
+  snprintf(job, sizeof(job), "%d", id);
+
+  void* env_buf;
+  voyeur_env_snapshot* env;
+  char** voyeur_envp =
+    create_environment(context, state, envp, job, &env_buf, &env);
+
+  pid_t child_pid;
+  int spawn_status =
+    posix_spawnp(&child_pid, path, NULL, NULL, argv, voyeur_envp);
+  free(voyeur_envp);
+  free(env_buf);
+  if (spawn_status != 0) {
+    if (env) {
+      voyeur_env_snapshot_destroy(env);
+    }
+    return -1;
+  }
+
+  // The child has inherited the snapshot's memfd, and later jobs
+  // shouldn't.
+  if (env) {
+    voyeur_env_snapshot_close(env);
+  }
+
+  // The job is only registered once we're watching the child; until
+  // then, a failure means the child has to go.
+  job_info* info = &state->jobs[state->job_count];
+  memset(info, 0, sizeof(job_info));
+  if (watch_child(&info->child, child_pid) < 0 ||
+      voyeur_loop_add(state->loop, info->child.fd) < 0) {
+    abandon_child(&info->child);
+    if (env) {
+      voyeur_env_snapshot_destroy(env);
+    }
+    return -1;
+  }
+  info->env = env;
+  state->job_count++;
+  state->jobs_unreported++;
+
+  // The caller may wait on our descriptor before calling us again.
+  voyeur_loop_flush(state->loop);
+
+  if (job_id) {
+    *job_id = id;
+  }
+
+  return 0;
+}
+
+int voyeur_wait_any(voyeur_context_t ctx, int* status, int options)
+{
+  voyeur_context* context = (voyeur_context*) ctx;
+  server_state* state = (server_state*) context->server_state;
+  if (!state || !state->spawning || !state->loop) {
+    return -1;
+  }
+
+  char polled = 0;
+  while (state->jobs_unreported > 0) {
+    for (int i = 0 ; i < state->job_count ; ++i) {
+      job_info* job = &state->jobs[i];
+      if (job->exited && !job->reported) {
+        // Handle everything the job sent before it exited.
+        drain_events(context, state);
+        settle_server(context, state);
+
+        job->reported = 1;
+        state->jobs_unreported--;
+        if (status) {
+          *status = exit_status(job->status);
+        }
+
+        return i + 1;
+      }
+    }
+
+    if (options & VOYEUR_WNOHANG) {
+      if (polled) {
+        settle_server(context, state);
+        return 0;
+      }
+
+      while (handle_events(context, state, 0, MAX_EVENTS) > 0) {
+        continue;
+      }
+      polled = 1;
+    } else if (handle_events(context, state, -1, MAX_EVENTS) < 0) {
+      return -1;
+    }
+  }
+
+  // There are no jobs left to wait for.
+  return -1;
+}
@@ -0,0 +1,108 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <bsd/bsd.h>
+#endif
+
+// Usage: bench-connections <idle connections> <events> <ping fd>
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Translates LIBVOYEUR_SOCKET into an address just like
+// voyeur_create_client_socket does. A leading '@' names a socket in the
+// abstract namespace, whose address is only as long as its name.
+static socklen_t socket_address(const char* sockpath, struct sockaddr_un* addr)
+{
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+
+  if (sockpath[0] == '@') {
+    size_t len = strlcpy(addr->sun_path + 1, sockpath + 1,
+                         sizeof(addr->sun_path) - 1);
+    if (len > sizeof(addr->sun_path) - 2) {
+      len = sizeof(addr->sun_path) - 2;
+    }
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+  }
+
+  strlcpy(addr->sun_path, sockpath, sizeof(addr->sun_path));
+  return sizeof(struct sockaddr_un);
+}
+
+static int open_idle_connections(int count)
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  struct sockaddr_un sockinfo;
+  socklen_t socklen = socket_address(getenv("LIBVOYEUR_SOCKET"), &sockinfo);
+
+  for (int i = 0 ; i < count ; ++i) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 ||
+        connect(sock, (struct sockaddr*) &sockinfo, socklen) < 0) {
+      perror("bench-connections");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void round_trip(int ping_fd)
+{
+  close(open("/dev/null", O_RDONLY));
+
+  char c;
+  read(ping_fd, &c, 1);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 4) {
+    return 1;
+  }
+
+  int conns = atoi(argv[1]);
+  int events = atoi(argv[2]);
+  int ping_fd = atoi(argv[3]);
+
+  if (open_idle_connections(conns) < 0) {
+    return 1;
+  }
+
+  // The first event also makes sure the server has accepted every idle
+  // connection, since connections are accepted in order.
+  round_trip(ping_fd);
+
+  double start = now();
+  for (int i = 0 ; i < events ; ++i) {
+    round_trip(ping_fd);
+  }
+  double elapsed = now() - start;
+
+  printf("%6d idle connections: %8.2f us/event\n",
+         conns, elapsed * 1e6 / events);
+  return 0;
+}
@@ -0,0 +1,64 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Usage: bench-spawn <threads> <spawns per thread>
+
+extern char** environ;
+
+static int spawns_per_thread;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* run_thread(void* arg)
+{
+  char* path   = "/bin/true";
+  char* argv[] = { path, NULL };
+
+  for (int i = 0 ; i < spawns_per_thread ; ++i) {
+    pid_t pid;
+    if (posix_spawn(&pid, path, NULL, NULL, argv, environ) == 0) {
+      waitpid(pid, NULL, 0);
+    }
+  }
+
+  return NULL;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    return 1;
+  }
+
+  int threads = atoi(argv[1]);
+  spawns_per_thread = atoi(argv[2]);
+  pthread_t* thread_ids = malloc(threads * sizeof(pthread_t));
+
+  double start = now();
+  for (int i = 0 ; i < threads ; ++i) {
+    pthread_create(&thread_ids[i], NULL, run_thread, NULL);
+  }
+  for (int i = 0 ; i < threads ; ++i) {
+    pthread_join(thread_ids[i], NULL);
+  }
+  double elapsed = now() - start;
+
+  printf("%2d threads: %8.1f spawns/sec\n",
+         threads, threads * spawns_per_thread / elapsed);
+  free(thread_ids);
+  return 0;
+}
@@ -0,0 +1,23 @@
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The descriptor the vforked child closes. voyeur-test looks for it.
+#define VFORK_FD 42
+
+int main(int argc, char** argv)
+{
+  int fd = open("/dev/null", O_RDONLY);
+  dup2(fd, VFORK_FD);
+
+  pid_t child = vfork();
+  if (child == 0) {
+    // We're the child.
+    close(VFORK_FD);
+    _exit(0);
+  }
+
+  int status;
+  waitpid(child, &status, 0);
+  return 0;
+}
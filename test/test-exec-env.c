@@ -0,0 +1,27 @@
+#ifndef __APPLE__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+
+extern char** environ;
+
+void run_test()
+{
+  char* path   = "/bin/echo";
+  char* argv[] = { path, "exec-env", NULL };
+
+  // Change the environment we were started with before passing it on.
+  setenv("VOYEUR_ADDED", "1", 1);
+  setenv("VOYEUR_CHANGED", "2", 1);
+  unsetenv("VOYEUR_REMOVED");
+
+  execve(path, argv, environ);
+}
+
+int main(int argc, char** argv)
+{
+  run_test();
+  return 0;
+}
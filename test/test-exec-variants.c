@@ -1,3 +1,7 @@
+#ifndef __APPLE__
+#define _GNU_SOURCE
+#endif
+
 #include <spawn.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -100,6 +104,33 @@ void run_execvP_test()
 #endif
 }
 
+void run_vfork_test()
+{
+  static char* new_argv[] = { "/bin/echo", "vfork", NULL };
+  pid_t child_pid;
+  if ((child_pid = vfork()) == 0) {
+    execve(new_path, new_argv, new_envp);
+    _exit(1);
+  } else {
+    int status;
+    waitpid(child_pid, &status, 0);
+  }
+}
+
+void run_vfork_failure_test()
+{
+  // The child's exit shouldn't be mistaken for ours.
+  static char* new_argv[] = { "/nonexistent", "vfork", NULL };
+  pid_t child_pid;
+  if ((child_pid = vfork()) == 0) {
+    execve(new_argv[0], new_argv, new_envp);
+    _exit(7);
+  } else {
+    int status;
+    waitpid(child_pid, &status, 0);
+  }
+}
+
 void run_system_test()
 {
   system("/bin/echo system");
@@ -128,6 +159,8 @@ int main(int argc, char** argv)
   run_execv_test();
   run_execvp_test();
   run_execvP_test();
+  run_vfork_test();
+  run_vfork_failure_test();
   run_system_test();
   run_posix_spawn_test();
   run_posix_spawnp_test();
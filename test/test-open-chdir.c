@@ -0,0 +1,36 @@
+#ifndef __APPLE__
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+void run_test()
+{
+  // Each relative open() should be reported with the directory we're in
+  // at the time.
+  close(open("/dev/null", O_RDONLY));
+  chdir("/dev");
+  close(open("null", O_RDONLY));
+
+  int root = open("/", O_RDONLY);
+  fchdir(root);
+  close(root);
+  close(open("dev/null", O_RDONLY));
+
+#ifdef __linux__
+  // A change that doesn't go through libc's chdir() should be seen too.
+  syscall(SYS_chdir, "/dev");
+  close(open("null", O_RDONLY));
+#endif
+}
+
+int main(int argc, char** argv)
+{
+  run_test();
+  return 0;
+}
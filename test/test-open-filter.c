@@ -0,0 +1,17 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+void run_test()
+{
+  // Only /dev/null and the relative path should be observed.
+  close(open("/dev/null", O_RDONLY));
+  close(open("/dev/zero", O_RDONLY));
+  close(open("/etc/voyeur-test-open-filter", O_RDONLY));
+  close(open("voyeur-test-open-filter", O_RDONLY));
+}
+
+int main(int argc, char** argv)
+{
+  run_test();
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define WORKERS 4
+#define OPENS_PER_PROCESS 100
+
+void run_opens()
+{
+  for (int i = 0 ; i < OPENS_PER_PROCESS ; ++i) {
+    int fd = open("/dev/null", O_RDONLY);
+    close(fd);
+  }
+}
+
+void* run_thread(void* arg)
+{
+  run_opens();
+  return NULL;
+}
+
+int main(int argc, char** argv)
+{
+  // Keep the parent sending events while it forks, so that workers are
+  // forked while the connection is in use.
+  pthread_t thread;
+  pthread_create(&thread, NULL, run_thread, NULL);
+
+  pid_t workers[WORKERS];
+  for (int i = 0 ; i < WORKERS ; ++i) {
+    if ((workers[i] = fork()) == 0) {
+      // We're a worker.
+      run_opens();
+      exit(EXIT_SUCCESS);
+    }
+  }
+
+  pthread_join(thread, NULL);
+
+  int status;
+  for (int i = 0 ; i < WORKERS ; ++i) {
+    waitpid(workers[i], &status, 0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,28 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+void run_test()
+{
+  // These should be summarized as two paths: /dev/null, which was read
+  // and written, and a relative path that doesn't exist.
+  close(open("/dev/null", O_RDONLY));
+  close(open("/dev/null", O_RDONLY));
+  close(open("/dev/null", O_WRONLY));
+  close(open("voyeur-test-open-summary", O_RDONLY));
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1 && strcmp(argv[1], "done") == 0) {
+    return 0;
+  }
+
+  run_test();
+
+  // The summary has to be sent before the exec replaces us.
+  char* new_argv[] = { argv[0], "done", NULL };
+  char* new_envp[] = { NULL };
+  execve(argv[0], new_argv, new_envp);
+  return 1;
+}
@@ -0,0 +1,30 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define OPENS_PER_THREAD 100
+
+void* run_thread(void* arg)
+{
+  for (int i = 0 ; i < OPENS_PER_THREAD ; ++i) {
+    int fd = open("/dev/null", O_RDONLY);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char** argv)
+{
+  pthread_t threads[THREADS];
+  for (int i = 0 ; i < THREADS ; ++i) {
+    pthread_create(&threads[i], NULL, run_thread, NULL);
+  }
+
+  for (int i = 0 ; i < THREADS ; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  return 0;
+}
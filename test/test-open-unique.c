@@ -0,0 +1,18 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+void run_test()
+{
+  // Only the first of each kind of open() should be observed.
+  for (int i = 0 ; i < 3 ; ++i) {
+    close(open("/dev/null", O_RDONLY));
+    close(open("/dev/null", O_WRONLY));
+    close(open("voyeur-test-open-unique", O_RDONLY));
+  }
+}
+
+int main(int argc, char** argv)
+{
+  run_test();
+  return 0;
+}
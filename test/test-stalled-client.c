@@ -0,0 +1,83 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <bsd/bsd.h>
+#endif
+
+#define MARKER_PATH "/tmp/voyeur-test-stalled-client"
+#define SEEN_PATH MARKER_PATH ".seen"
+
+pid_t start_stalled_client(int release_fd)
+{
+  int ready[2];
+  pipe(ready);
+
+  pid_t pid;
+  if ((pid = fork()) == 0) {
+    // Connect to the observer directly and send only part of a message.
+    struct sockaddr_un sockinfo;
+    memset(&sockinfo, 0, sizeof(struct sockaddr_un));
+    sockinfo.sun_family = AF_UNIX;
+    strlcpy(sockinfo.sun_path, getenv("LIBVOYEUR_SOCKET"),
+            sizeof(sockinfo.sun_path));
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    connect(sock, (struct sockaddr*) &sockinfo, sizeof(struct sockaddr_un));
+
+    uint32_t header = 64;
+    write(sock, &header, 2);
+    write(ready[1], "", 1);
+
+    // Stall until we're released.
+    char c;
+    read(release_fd, &c, 1);
+    _exit(0);
+  }
+
+  char c;
+  read(ready[0], &c, 1);
+  return pid;
+}
+
+int run_test()
+{
+  int release[2];
+  pipe(release);
+  pid_t stalled_pid = start_stalled_client(release[0]);
+
+  // The observer creates SEEN_PATH when it sees us open MARKER_PATH. If
+  // it's stuck waiting for the stalled client, that never happens.
+  unlink(SEEN_PATH);
+  int fd = open(MARKER_PATH, O_CREAT, 0777);
+  close(fd);
+
+  int seen = 0;
+  for (int i = 0 ; i < 500 && !seen ; ++i) {
+    seen = access(SEEN_PATH, F_OK) == 0;
+    usleep(10 * 1000);
+  }
+
+  write(release[1], "", 1);
+  int status;
+  waitpid(stalled_pid, &status, 0);
+
+  unlink(MARKER_PATH);
+  unlink(SEEN_PATH);
+  return seen ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+  return run_test();
+}
@@ -0,0 +1,191 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <voyeur.h>
+
+void print_bench_header(char* header)
+{
+  printf("\n");
+  printf("==============================\n");
+  printf("Benchmark: %s\n", header);
+  printf("==============================\n");
+}
+
+void print_bench_footer()
+{
+  printf("==============================\n");
+}
+
+void raise_fd_limit()
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+void ping_open_callback(const char* path,
+                        int oflag,
+                        mode_t mode,
+                        const char* cwd,
+                        int retval,
+                        pid_t pid,
+                        void* userdata)
+{
+  // Tell the child we've seen its event.
+  if (strcmp(path, "/dev/null") == 0) {
+    int* ping_fd = (int*) userdata;
+    write(*ping_fd, "", 1);
+  }
+}
+
+void bench_connections(char use_io_uring)
+{
+  // Each event is a round trip: the child opens /dev/null and waits
+  // until our callback has run. With many idle connections open, this
+  // measures how the cost of a server wakeup scales with the number of
+  // connections being watched.
+  static const char* conns[] = { "10", "100", "1000", "10000" };
+
+  print_bench_header(use_io_uring
+                       ? "wakeup cost vs. idle connections (io_uring)"
+                       : "wakeup cost vs. idle connections (no io_uring)");
+
+  for (size_t i = 0 ; i < sizeof(conns) / sizeof(conns[0]) ; ++i) {
+    int ping[2];
+    pipe(ping);
+
+    voyeur_context_t ctx = voyeur_context_create();
+    voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT,
+                        ping_open_callback, (void*) &ping[1]);
+    voyeur_set_io_uring(ctx, use_io_uring);
+
+    char ping_fd[16];
+    snprintf(ping_fd, sizeof(ping_fd), "%d", ping[0]);
+
+    char* path   = "./bench-connections";
+    char* argv[] = { path, (char*) conns[i], "2000", ping_fd, NULL };
+    char* envp[] = { NULL };
+
+    fflush(stdout);
+    if (voyeur_exec(ctx, path, argv, envp) != 0) {
+      printf("%6s idle connections: FAILED\n", conns[i]);
+    }
+
+    voyeur_context_destroy(ctx);
+    close(ping[0]);
+    close(ping[1]);
+  }
+
+  print_bench_footer();
+}
+
+void exec_count_callback(const char* file,
+                         char* const argv[],
+                         char* const envp[],
+                         const char* path,
+                         const char* cwd,
+                         pid_t pid,
+                         pid_t ppid,
+                         void* userdata)
+{
+  unsigned* count = (unsigned*) userdata;
+  *count += 1;
+}
+
+void bench_spawn()
+{
+  // Each thread of the child spawns and waits for short-lived processes
+  // as quickly as it can. If spawning in hooked processes is serialized,
+  // the throughput won't improve with more threads.
+  static const char* threads[] = { "1", "2", "4", "8" };
+
+  print_bench_header("spawn throughput vs. threads");
+
+  for (size_t i = 0 ; i < sizeof(threads) / sizeof(threads[0]) ; ++i) {
+    unsigned count = 0;
+    voyeur_context_t ctx = voyeur_context_create();
+    voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT,
+                        exec_count_callback, (void*) &count);
+
+    char* path   = "./bench-spawn";
+    char* argv[] = { path, (char*) threads[i], "200", NULL };
+    char* envp[] = { NULL };
+
+    fflush(stdout);
+    if (voyeur_exec(ctx, path, argv, envp) != 0) {
+      printf("%2s threads: FAILED\n", threads[i]);
+    }
+
+    voyeur_context_destroy(ctx);
+  }
+
+  print_bench_footer();
+}
+
+double elapsed_usec(struct timespec* start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e6 +
+         (end.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+void bench_start_stop()
+{
+  // Setting up and tearing down observation is paid once per observed
+  // command, so for short commands it can dominate. The first row is
+  // just the server socket, the ring, and the event loop; the second
+  // adds a trivial child process.
+  static const int iterations = 200;
+
+  print_bench_header("observation start/stop cost");
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0 ; i < iterations ; ++i) {
+    voyeur_context_t ctx = voyeur_context_create();
+    voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT, exec_count_callback, NULL);
+
+    char* envp[] = { NULL };
+    free(voyeur_prepare(ctx, envp));
+    voyeur_context_destroy(ctx);
+  }
+  printf("prepare and destroy: %8.1f usec\n", elapsed_usec(&start) / iterations);
+
+  unsigned count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0 ; i < iterations ; ++i) {
+    voyeur_context_t ctx = voyeur_context_create();
+    voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT,
+                        exec_count_callback, (void*) &count);
+
+    char* path   = "/bin/true";
+    char* argv[] = { path, NULL };
+    char* envp[] = { NULL };
+
+    if (voyeur_exec(ctx, path, argv, envp) != 0) {
+      printf("exec /bin/true: FAILED\n");
+    }
+
+    voyeur_context_destroy(ctx);
+  }
+  printf("exec /bin/true:      %8.1f usec\n", elapsed_usec(&start) / iterations);
+
+  print_bench_footer();
+}
+
+int main(int argc, char** argv)
+{
+  raise_fd_limit();
+  bench_connections(1);
+  bench_connections(0);
+  bench_spawn();
+  bench_start_stop();
+  return 0;
+}
@@ -1,4 +1,10 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <voyeur.h>
 
 char eq(char a, char b)
@@ -74,6 +80,20 @@ void exit_callback(int status,
   *result += 1;
 }
 
+void vfork_exit_callback(int status,
+                         pid_t pid,
+                         pid_t ppid,
+                         void* userdata)
+{
+  printf("[EXIT] %d (pid %u) (ppid %u)\n", status, pid, ppid);
+
+  // Count the vforked child that failed to exec, and the test itself.
+  char* result = (char*) userdata;
+  if (status == 7 || ppid == getpid()) {
+    *result += 1;
+  }
+}
+
 void open_callback(const char* path,
                    int oflag,
                    mode_t mode,
@@ -89,6 +109,116 @@ void open_callback(const char* path,
   *result = 1;
 }
 
+void all_open_callback(const char* path,
+                       int oflag,
+                       mode_t mode,
+                       const char* cwd,
+                       int retval,
+                       pid_t pid,
+                       void* userdata)
+{
+  printf("[OPEN] %s (rv %d) (pid %u)\n", path, retval, pid);
+
+  char* result = (char*) userdata;
+  *result += 1;
+}
+
+void chdir_open_callback(const char* path,
+                         int oflag,
+                         mode_t mode,
+                         const char* cwd,
+                         int retval,
+                         pid_t pid,
+                         void* userdata)
+{
+  printf("[OPEN] %s (in %s) (rv %d) (pid %u)\n", path, cwd, retval, pid);
+
+  // Relative paths should all lead to /dev/null from their cwd.
+  char ok = path[0] == '/' ||
+            (strcmp(cwd, "/dev") == 0 && strcmp(path, "null") == 0) ||
+            (strcmp(cwd, "/") == 0 && strcmp(path, "dev/null") == 0);
+
+  char* result = (char*) userdata;
+  *result += ok ? 1 : 10;
+}
+
+void open_summary_callback(size_t count,
+                           const char* const paths[],
+                           const uint8_t access[],
+                           pid_t pid,
+                           void* userdata)
+{
+  printf("[OPEN SUMMARY] %zu paths (pid %u)\n", count, pid);
+
+  char ok = count == 2;
+  for (size_t i = 0 ; i < count ; ++i) {
+    printf("  %s (access %u)\n", paths[i], (unsigned) access[i]);
+    if (strcmp(paths[i], "/dev/null") == 0) {
+      ok &= access[i] == (VOYEUR_ACCESS_READ | VOYEUR_ACCESS_WRITE);
+    } else {
+      ok &= paths[i][0] == '/' &&
+            strstr(paths[i], "/voyeur-test-open-summary") != NULL &&
+            access[i] == VOYEUR_ACCESS_MISSING;
+    }
+  }
+
+  char* result = (char*) userdata;
+  *result += ok ? 1 : 10;
+}
+
+void stalled_open_callback(const char* path,
+                           int oflag,
+                           mode_t mode,
+                           const char* cwd,
+                           int retval,
+                           pid_t pid,
+                           void* userdata)
+{
+  // Let the test know we're still receiving events.
+  const char* marker = (const char*) userdata;
+  if (strcmp(path, marker) == 0) {
+    char seen[256];
+    snprintf(seen, sizeof(seen), "%s.seen", marker);
+    close(open(seen, O_CREAT | O_WRONLY, 0666));
+  }
+}
+
+typedef struct {
+  voyeur_context_t ctx;
+  int opens[4];
+} job_open_result;
+
+void job_open_callback(const char* path,
+                       int oflag,
+                       mode_t mode,
+                       const char* cwd,
+                       int retval,
+                       pid_t pid,
+                       void* userdata)
+{
+  job_open_result* result = (job_open_result*) userdata;
+  int job = voyeur_current_job(result->ctx);
+  printf("[OPEN] %s (job %d) (pid %u)\n", path, job, pid);
+
+  if (job > 0 && job < 4) {
+    result->opens[job] += 1;
+  }
+}
+
+void counting_open_callback(const char* path,
+                            int oflag,
+                            mode_t mode,
+                            const char* cwd,
+                            int retval,
+                            pid_t pid,
+                            void* userdata)
+{
+  if (strcmp(path, "/dev/null") == 0) {
+    unsigned* result = (unsigned*) userdata;
+    *result += 1;
+  }
+}
+
 void close_callback(int fd, int retval, pid_t pid, void* userdata)
 {
   printf("[CLOSE] %d (rv %d) (pid %u)\n", fd, retval, pid);
@@ -97,6 +227,17 @@ void close_callback(int fd, int retval, pid_t pid, void* userdata)
   *result += 1;
 }
 
+void vfork_close_callback(int fd, int retval, pid_t pid, void* userdata)
+{
+  printf("[CLOSE] %d (rv %d) (pid %u)\n", fd, retval, pid);
+
+  // Only the vforked child closes descriptor 42.
+  char* result = (char*) userdata;
+  if (fd == 42 && retval == 0) {
+    *result += 1;
+  }
+}
+
 void test_exec()
 {
   char result = 0;
@@ -115,6 +256,53 @@ void test_exec()
   voyeur_context_destroy(ctx);
 }
 
+void exec_env_callback(const char* file,
+                       char* const argv[],
+                       char* const envp[],
+                       const char* path,
+                       const char* cwd,
+                       pid_t pid,
+                       pid_t ppid,
+                       void* userdata)
+{
+  printf("[EXEC] %s (pid %u) (ppid %u)\n",
+         file, (unsigned) pid, (unsigned) ppid);
+
+  int seen = 0;
+  for (int i = 0 ; envp[i] ; ++i) {
+    printf("  env: %s\n", envp[i]);
+    if (strcmp(envp[i], "VOYEUR_KEPT=1") == 0 ||
+        strcmp(envp[i], "VOYEUR_ADDED=1") == 0 ||
+        strcmp(envp[i], "VOYEUR_CHANGED=2") == 0) {
+      seen++;
+    } else if (strncmp(envp[i], "VOYEUR_", 7) == 0) {
+      seen = -100;
+    }
+  }
+
+  char* result = (char*) userdata;
+  *result += seen == 3 ? 1 : 0;
+}
+
+void test_exec_env()
+{
+  char result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_exec(ctx, OBSERVE_EXEC_ENV,
+                      exec_env_callback, (void*) &result);
+
+  char* path   = "./test-exec-env";
+  char* argv[] = { path, NULL };
+  char* envp[] = { "VOYEUR_KEPT=1", "VOYEUR_CHANGED=1",
+                   "VOYEUR_REMOVED=1", NULL };
+
+  print_test_header("exec-env");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(result, eq, 1);
+
+  voyeur_context_destroy(ctx);
+}
+
 void test_exec_recursive()
 {
   unsigned result = 0;
@@ -149,6 +337,121 @@ void test_open()
   voyeur_context_destroy(ctx);
 }
 
+void test_open_filter()
+{
+  char result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT,
+                      all_open_callback, (void*) &result);
+
+  const char* include[] = { "/dev/", NULL };
+  const char* exclude[] = { "*zero", NULL };
+  voyeur_filter_open(ctx, include, exclude);
+
+  char* path   = "./test-open-filter";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("open-filter");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(result, eq, 2);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_open_unique()
+{
+  char result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_open(ctx, OBSERVE_OPEN_CWD | OBSERVE_OPEN_UNIQUE,
+                      all_open_callback, (void*) &result);
+
+  char* path   = "./test-open-unique";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("open-unique");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(result, eq, 3);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_open_chdir()
+{
+  char result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_open(ctx, OBSERVE_OPEN_CWD,
+                      chdir_open_callback, (void*) &result);
+
+  char* path   = "./test-open-chdir";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("open-chdir");
+  voyeur_exec(ctx, path, argv, envp);
+
+  // On Linux the test also changes directory with a raw system call.
+# ifdef __linux__
+    print_test_footer(result, eq, 5);
+# else
+    print_test_footer(result, eq, 4);
+# endif
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_open_summary()
+{
+  char result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_open_summary(ctx, open_summary_callback, (void*) &result);
+
+  char* path   = "./test-open-summary";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("open-summary");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(result, eq, 1);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_open_threads()
+{
+  unsigned open_result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT, counting_open_callback, (void*) &open_result);
+
+  char* path   = "./test-open-threads";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("open from many threads");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(open_result == 400, eq, 1);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_open_fork()
+{
+  unsigned open_result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT, counting_open_callback, (void*) &open_result);
+
+  char* path   = "./test-open-fork";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("open from forked workers");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(open_result == 500, eq, 1);
+
+  voyeur_context_destroy(ctx);
+}
+
 void test_exec_and_open()
 {
   char exec_result = 0, open_result = 0;
@@ -185,6 +488,23 @@ void test_open_and_close()
   voyeur_context_destroy(ctx);
 }
 
+void test_close_vfork()
+{
+  char result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_close(ctx, OBSERVE_CLOSE_DEFAULT, vfork_close_callback, (void*) &result);
+
+  char* path   = "./test-close-vfork";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("close in vforked child");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(result, eq, 1);
+
+  voyeur_context_destroy(ctx);
+}
+
 void test_exec_variants()
 {
   unsigned result = 0;
@@ -198,17 +518,35 @@ void test_exec_variants()
   print_test_header("exec-variants");
   voyeur_exec(ctx, path, argv, envp);
 
-  // The expected result is 11 on OS X even though there are only 10 variants
+  // The expected result is 12 on OS X even though there are only 11 variants
   // because 'system' spawns a 'sh' process to do the real work.
 # ifdef __APPLE__
-    print_test_footer(result, eq, 11);
+    print_test_footer(result, eq, 12);
 # else
-    print_test_footer(result, eq, 10);
+    print_test_footer(result, eq, 11);
 # endif
 
   voyeur_context_destroy(ctx);
 }
 
+void test_exec_variants_exit()
+{
+  char result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_exit(ctx, OBSERVE_EXIT_DEFAULT,
+                      vfork_exit_callback, (void*) &result);
+
+  char* path   = "./test-exec-variants";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("exec-variants-exit");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(result, eq, 2);
+
+  voyeur_context_destroy(ctx);
+}
+
 void test_exit()
 {
   unsigned result = 0;
@@ -227,14 +565,208 @@ void test_exit()
   voyeur_context_destroy(ctx);
 }
 
+void test_ring()
+{
+  unsigned exec_result = 0;
+  char open_result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT, exec_callback, (void*) &exec_result);
+  voyeur_observe_open(ctx, OBSERVE_OPEN_CWD, open_callback, (void*) &open_result);
+  voyeur_set_ring_size(ctx, 64 * 1024);
+
+  char* path   = "./test-exec-and-open";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("ring");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(exec_result + open_result, eq, 2);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_inherit_connection()
+{
+  unsigned exec_result = 0;
+  unsigned exit_result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT, exec_callback, (void*) &exec_result);
+  voyeur_observe_exit(ctx, OBSERVE_EXIT_DEFAULT, exit_callback, (void*) &exit_result);
+  voyeur_set_inherit_connection(ctx, 1);
+
+  char* path   = "./test-exec-recursive";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("inherit-connection");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(exec_result + exit_result, eq, 13);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_no_io_uring()
+{
+  char exec_result = 0, open_result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT, exec_callback, (void*) &exec_result);
+  voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT, open_callback, (void*) &open_result);
+  voyeur_set_io_uring(ctx, 0);
+
+  char* path   = "./test-exec-and-open";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("no io_uring");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(exec_result + open_result, eq, 2);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_executor()
+{
+  char exec_result = 0, open_result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT, exec_callback, (void*) &exec_result);
+  voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT, open_callback, (void*) &open_result);
+  voyeur_set_executor(ctx, 4, 2, VOYEUR_BACKPRESSURE_BLOCK);
+
+  char* path   = "./test-exec-and-open";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("executor");
+  voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(exec_result + open_result, eq, 2);
+
+  voyeur_context_destroy(ctx);
+}
+
+void test_process_events()
+{
+  char exec_result = 0, open_result = 0;
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_exec(ctx, OBSERVE_EXEC_DEFAULT, exec_callback, (void*) &exec_result);
+  voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT, open_callback, (void*) &open_result);
+
+  char* path   = "./test-exec-and-open";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("process events");
+
+  char** voyeur_envp = voyeur_prepare(ctx, envp);
+  pid_t pid;
+  posix_spawn(&pid, path, NULL, NULL, argv, voyeur_envp);
+  voyeur_start_async(ctx, pid);
+
+  // Drive the observation from our own poll loop, one event at a time.
+  struct pollfd pfd = { voyeur_get_fd(ctx), POLLIN, 0 };
+  int status;
+  int handled = 0;
+  while (!voyeur_is_done(ctx, &status)) {
+    if (pfd.fd >= 0) {
+      poll(&pfd, 1, -1);
+    } else {
+      usleep(1000);
+    }
+    handled += voyeur_process_events(ctx, 1);
+  }
+
+  // There's at least one exec event and one open event.
+  printf("Handled %d events\n", handled);
+  free(voyeur_envp);
+  print_test_footer(exec_result + open_result + (status == 0) +
+                    (handled >= 2), eq, 4);
+
+  voyeur_context_destroy(ctx);
+}
+
+char run_spawn(size_t ring_size)
+{
+  job_open_result result;
+  memset(&result, 0, sizeof(result));
+  result.ctx = voyeur_context_create();
+  voyeur_observe_open(result.ctx, OBSERVE_OPEN_DEFAULT,
+                      job_open_callback, (void*) &result);
+  voyeur_set_ring_size(result.ctx, ring_size);
+
+  char* path   = "./test-open";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  // Run three jobs at once and check that each one's events were
+  // attributed to it.
+  char passed = 1;
+  for (int i = 1 ; i <= 3 ; ++i) {
+    int job;
+    if (voyeur_spawn(result.ctx, path, argv, envp, &job) != 0 || job != i) {
+      passed = 0;
+    }
+  }
+
+  int status, job, finished = 0;
+  while ((job = voyeur_wait_any(result.ctx, &status, VOYEUR_WAIT_DEFAULT)) > 0) {
+    if (status != 0 || result.opens[job] != 2) {
+      passed = 0;
+    }
+    finished += 1;
+  }
+
+  voyeur_context_destroy(result.ctx);
+  return passed && finished == 3;
+}
+
+void test_spawn()
+{
+  print_test_header("spawn");
+  char socket_result = run_spawn(0);
+  char ring_result = run_spawn(64 * 1024);
+  print_test_footer(socket_result + ring_result, eq, 2);
+}
+
+void test_stalled_client()
+{
+  voyeur_context_t ctx = voyeur_context_create();
+  voyeur_observe_open(ctx, OBSERVE_OPEN_DEFAULT, stalled_open_callback,
+                      (void*) "/tmp/voyeur-test-stalled-client");
+
+  char* path   = "./test-stalled-client";
+  char* argv[] = { path, NULL };
+  char* envp[] = { NULL };
+
+  print_test_header("stalled client");
+  int status = voyeur_exec(ctx, path, argv, envp);
+  print_test_footer(status == 0, eq, 1);
+
+  voyeur_context_destroy(ctx);
+}
+
 int main(int argc, char** argv)
 {
   test_exec();
+  test_exec_env();
   test_exec_recursive();
   test_open();
+  test_open_filter();
+  test_open_unique();
+  test_open_summary();
+  test_open_chdir();
+  test_open_threads();
+  test_open_fork();
   test_exec_and_open();
   test_open_and_close();
+  test_close_vfork();
   test_exec_variants();
+  test_exec_variants_exit();
   test_exit();
+  test_ring();
+  test_inherit_connection();
+  test_no_io_uring();
+  test_executor();
+  test_process_events();
+  test_spawn();
+  test_stalled_client();
   return 0;
 }